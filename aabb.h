@@ -0,0 +1,113 @@
+#ifndef AABB_H
+#define AABB_H
+
+#include "common.h"
+
+#include <algorithm>
+
+// Axis-aligned bounding box. It's the intersection of 3 slabs, one per axis;
+// a slab is the region between two parallel planes.
+class aabb {
+public:
+  // An empty box: min is +infinity and max is -infinity, so that growing it by
+  // anything gives that thing's bounds.
+  aabb()
+    : minimum(infinity, infinity, infinity),
+      maximum(-infinity, -infinity, -infinity) {}
+
+  aabb(const point3& a, const point3& b) : minimum(a), maximum(b) {}
+
+  point3 min() const { return minimum; }
+  point3 max() const { return maximum; }
+
+  bool empty() const {
+    return minimum.x() > maximum.x()
+      || minimum.y() > maximum.y()
+      || minimum.z() > maximum.z();
+  }
+
+  point3 centroid() const {
+    return 0.5 * (minimum + maximum);
+  }
+
+  vec3 extent() const {
+    return maximum - minimum;
+  }
+
+  // Half the surface area. The surface area heuristic only compares ratios of
+  // areas, so the factor of 2 doesn't matter.
+  double half_area() const {
+    if (empty()) {
+      return 0.0;
+    }
+    vec3 d = extent();
+    return d.x() * d.y() + d.y() * d.z() + d.z() * d.x();
+  }
+
+  int longest_axis() const {
+    vec3 d = extent();
+    if (d.x() > d.y() && d.x() > d.z()) return 0;
+    return d.y() > d.z() ? 1 : 2;
+  }
+
+  void grow(const point3& p) {
+    for (int a = 0; a < 3; ++a) {
+      minimum[a] = std::min(minimum[a], p[a]);
+      maximum[a] = std::max(maximum[a], p[a]);
+    }
+  }
+
+  void grow(const aabb& box) {
+    for (int a = 0; a < 3; ++a) {
+      minimum[a] = std::min(minimum[a], box.minimum[a]);
+      maximum[a] = std::max(maximum[a], box.maximum[a]);
+    }
+  }
+
+  bool hit(const ray& r, real t_min, real t_max) const;
+
+  // Same as hit, for a ray whose direction has already been inverted. A BVH
+  // traversal tests many boxes against the same ray, so it inverts once.
+  bool hit(
+    const point3& origin, const vec3& inv_direction, real t_min, real t_max
+  ) const;
+
+  point3 minimum;
+  point3 maximum;
+};
+
+inline aabb surrounding_box(const aabb& box0, const aabb& box1) {
+  aabb box = box0;
+  box.grow(box1);
+  return box;
+}
+
+bool aabb::hit(const ray& r, real t_min, real t_max) const {
+  vec3 inv_direction(
+    1.0 / r.direction().x(), 1.0 / r.direction().y(), 1.0 / r.direction().z()
+  );
+  return hit(r.origin(), inv_direction, t_min, t_max);
+}
+
+bool aabb::hit(
+  const point3& origin, const vec3& inv_direction, real t_min, real t_max
+) const {
+  for (int a = 0; a < 3; ++a) {
+    // Where the ray enters and exits this axis' slab. When the direction is
+    // negative along the axis, it enters through the max plane.
+    auto t0 = (minimum[a] - origin[a]) * inv_direction[a];
+    auto t1 = (maximum[a] - origin[a]) * inv_direction[a];
+    if (inv_direction[a] < 0.0) {
+      std::swap(t0, t1);
+    }
+    // The ray is inside the box where it is inside all 3 slabs at once.
+    t_min = t0 > t_min ? t0 : t_min;
+    t_max = t1 < t_max ? t1 : t_max;
+    if (t_max < t_min) {
+      return false;
+    }
+  }
+  return true;
+}
+
+#endif
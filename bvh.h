@@ -0,0 +1,239 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include "common.h"
+
+#include "aabb.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "scene_arena.h"
+#include "stats.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+// What the builder knows about each object: its bounds, the center of its
+// bounds, and where it is in the caller's array of objects.
+struct bvh_primitive {
+  aabb box;
+  point3 centroid;
+  size_t index;
+};
+
+inline bvh_primitive make_bvh_primitive(const aabb& box, size_t index) {
+  return {box, box.centroid(), index};
+}
+
+// The surface area heuristic (SAH) estimates the cost of tracing a ray through
+// a node as
+//
+//   traversal_cost + (area(L) * count(L) + area(R) * count(R)) / area(node),
+//
+// since the probability that a ray that hits a box also hits a box inside it
+// is the ratio of their surface areas. Costs are measured in primitive
+// intersections, so the cost of making a leaf is the number of primitives.
+const double sah_traversal_cost = 1.0;
+
+// Instead of sorting the primitives along every axis and trying every split,
+// drop their centroids into a few equally-sized bins per axis and only try the
+// planes between bins. It's linear in the number of primitives and almost as
+// good as the full sweep.
+const int sah_bin_count = 16;
+
+// Partitions prims[begin, end) around the cheapest binned SAH split and
+// returns the index of the first primitive of the right half. split_cost, if
+// given, is set to the SAH cost of that split; it's infinity when no plane
+// separates the centroids (they're all at the same spot), and then the range
+// is just cut in half.
+size_t sah_partition(
+  std::vector<bvh_primitive>& prims, size_t begin, size_t end,
+  double* split_cost = nullptr
+) {
+  aabb bounds, centroid_bounds;
+  for (size_t i = begin; i < end; ++i) {
+    bounds.grow(prims[i].box);
+    centroid_bounds.grow(prims[i].centroid);
+  }
+
+  double best_cost = infinity;
+  int best_axis = -1;
+  int best_bin = -1;
+  double best_low = 0.0;
+  double best_scale = 0.0;
+
+  for (int axis = 0; axis < 3; ++axis) {
+    double low = centroid_bounds.min()[axis];
+    double extent = centroid_bounds.max()[axis] - low;
+    if (!(extent > 0.0)) {
+      continue;
+    }
+    double scale = sah_bin_count / extent;
+
+    aabb bin_boxes[sah_bin_count];
+    size_t bin_counts[sah_bin_count] = {};
+    for (size_t i = begin; i < end; ++i) {
+      int b = std::min(
+        sah_bin_count - 1, int((prims[i].centroid[axis] - low) * scale)
+      );
+      bin_boxes[b].grow(prims[i].box);
+      ++bin_counts[b];
+    }
+
+    // Sweep from the right to get the area and count of everything to the
+    // right of each plane; plane k sits between bins k and k + 1.
+    double right_area[sah_bin_count - 1];
+    size_t right_count[sah_bin_count - 1];
+    aabb accumulated;
+    size_t count = 0;
+    for (int k = sah_bin_count - 1; k > 0; --k) {
+      accumulated.grow(bin_boxes[k]);
+      count += bin_counts[k];
+      right_area[k - 1] = accumulated.half_area();
+      right_count[k - 1] = count;
+    }
+
+    // Then from the left, evaluating every plane along the way.
+    accumulated = aabb();
+    count = 0;
+    for (int k = 0; k < sah_bin_count - 1; ++k) {
+      accumulated.grow(bin_boxes[k]);
+      count += bin_counts[k];
+      if (count == 0 || right_count[k] == 0) {
+        continue;
+      }
+      double cost = accumulated.half_area() * count
+        + right_area[k] * right_count[k];
+      if (cost < best_cost) {
+        best_cost = cost;
+        best_axis = axis;
+        best_bin = k;
+        best_low = low;
+        best_scale = scale;
+      }
+    }
+  }
+
+  if (best_axis < 0) {
+    if (split_cost) {
+      *split_cost = infinity;
+    }
+    return begin + (end - begin) / 2;
+  }
+
+  auto middle = std::partition(
+    prims.begin() + begin, prims.begin() + end,
+    [=](const bvh_primitive& p) {
+      int b = std::min(
+        sah_bin_count - 1,
+        int((p.centroid[best_axis] - best_low) * best_scale)
+      );
+      return b <= best_bin;
+    }
+  );
+
+  if (split_cost) {
+    // Degenerate (flat) bounds have no area; don't divide by zero.
+    double area = std::max(bounds.half_area(), 1e-12);
+    *split_cost = sah_traversal_cost + best_cost / area;
+  }
+  return size_t(middle - prims.begin());
+}
+
+// A binary bounding volume hierarchy. Every node holds the box that encloses
+// its two children, so a ray that misses the box skips everything below it,
+// and a ray goes through O(log n) boxes instead of n objects. The nodes below
+// the root are made in the arena that holds the objects.
+class bvh_node : public hittable {
+public:
+  bvh_node() {}
+
+  bvh_node(const hittable_list& list, scene_arena& arena)
+    : bvh_node(list.objects, arena) {}
+
+  bvh_node(const std::vector<hittable*>& objects, scene_arena& arena);
+
+  virtual bool
+    intersect(const ray& r, real t_min, real t_max, ray_hit& hit) const;
+
+  virtual bool bounding_box(aabb& output_box) const;
+
+  hittable* left = nullptr;
+  hittable* right = nullptr;
+  aabb box;
+
+private:
+  void build(
+    const std::vector<hittable*>& objects, std::vector<bvh_primitive>& prims,
+    size_t begin, size_t end, scene_arena& arena
+  );
+};
+
+bvh_node::bvh_node(const std::vector<hittable*>& objects, scene_arena& arena) {
+  RT_TRACE_ZONE_ARGS("build bvh", "objects", objects.size(), nullptr, 0);
+  std::vector<bvh_primitive> prims;
+  prims.reserve(objects.size());
+  for (size_t i = 0; i < objects.size(); ++i) {
+    aabb object_box;
+    if (!objects[i]->bounding_box(object_box)) {
+      std::cerr << "No bounding box in bvh_node constructor.\n";
+    }
+    prims.push_back(make_bvh_primitive(object_box, i));
+  }
+
+  if (prims.empty()) {
+    return;
+  }
+  build(objects, prims, 0, prims.size(), arena);
+}
+
+void bvh_node::build(
+  const std::vector<hittable*>& objects, std::vector<bvh_primitive>& prims,
+  size_t begin, size_t end, scene_arena& arena
+) {
+  size_t span = end - begin;
+
+  if (span == 1) {
+    // Both children point to the same object, so that hit never needs to
+    // check for a missing child.
+    left = right = objects[prims[begin].index];
+  } else if (span == 2) {
+    left = objects[prims[begin].index];
+    right = objects[prims[begin + 1].index];
+  } else {
+    size_t mid = sah_partition(prims, begin, end);
+    bvh_node* left_node = arena.make<bvh_node>();
+    left_node->build(objects, prims, begin, mid, arena);
+    bvh_node* right_node = arena.make<bvh_node>();
+    right_node->build(objects, prims, mid, end, arena);
+    left = left_node;
+    right = right_node;
+  }
+
+  for (size_t i = begin; i < end; ++i) {
+    box.grow(prims[i].box);
+  }
+}
+
+bool bvh_node::intersect(const ray& r, real t_min, real t_max, ray_hit& hit)
+  const {
+  RT_STAT(++thread_stats().box_tests);
+  if (!left || !box.hit(r, t_min, t_max)) {
+    return false;
+  }
+
+  bool hit_left = left->intersect(r, t_min, t_max, hit);
+  // If the left child was hit, the right one only matters if it's hit closer.
+  bool hit_right = right != left
+    && right->intersect(r, t_min, hit_left ? hit.t : t_max, hit);
+
+  return hit_left || hit_right;
+}
+
+bool bvh_node::bounding_box(aabb& output_box) const {
+  output_box = box;
+  return left != nullptr;
+}
+
+#endif
@@ -0,0 +1,740 @@
+#ifndef BVH8_H
+#define BVH8_H
+
+#include "common.h"
+
+#include "aabb.h"
+#include "bvh.h"
+#include "flat_array.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "ray_packet.h"
+#include "stats.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// A node of an 8-wide BVH. Instead of storing 8 boxes as 48 floats, a node
+// stores its own box as an origin and a per-axis scale, and every child box as
+// 8-bit offsets into that frame:
+//
+//   child_min[a] = origin[a] + lo[a][k] * scale[a]
+//   child_max[a] = origin[a] + hi[a][k] * scale[a]
+//
+// The offsets are rounded outwards, so a quantized box always encloses the
+// real one; the price is that it's up to 1/255th of the parent box larger.
+// The 8 offsets of one bound of one axis are contiguous, so they load into a
+// single SIMD register and all 8 children are tested at once.
+//
+// child[k] is the index of another node when leaf_count[k] is 0. Otherwise
+// child k is a leaf, and child[k] is the position of its first primitive in
+// bvh8_tree::indices. Unused slots have lo > hi, an inside-out box that no ray
+// can hit.
+struct alignas(64) bvh8_node {
+  float origin[3];
+  float scale[3];
+  uint8_t lo[3][8];
+  uint8_t hi[3][8];
+  uint32_t child[8];
+  uint8_t leaf_count[8];
+};
+
+// The nodes of an 8-wide BVH over a set of boxes, all in one contiguous array
+// with the root at index 0. It knows nothing about what the boxes enclose: the
+// leaves refer to ranges of indices, and the user of the tree intersects them.
+class bvh8_tree {
+public:
+  static const int max_leaf_size = 8;
+
+  // Builds the tree over the boxes of primitives 0 to boxes.size() - 1.
+  // Leaves hold up to leaf_size primitives. leaf_batch is how many of them
+  // the user intersects for the price of one (its SIMD width), which makes
+  // bigger leaves cheaper for the surface area heuristic.
+  void build(
+    const std::vector<aabb>& boxes, int leaf_size = 4, int leaf_batch = 1
+  );
+
+  // Visits the leaves that r may hit between t_min and t_max, nearest first.
+  // leaf_hit(first, count, t_max) must intersect the primitives in
+  // indices[first, first + count), lower t_max when it finds a closer hit, and
+  // return whether it did.
+  //
+  // Trees read from a file (see scene_binary.h) may be corrupt, and their
+  // nodes are too many to check when the file is mapped. So traversal skips
+  // the children that a tree built here can't have: inner nodes that don't
+  // come after their parent in nodes (see collapse), or aren't in it, and
+  // leaves past primitive_count. Skipping them also keeps the stack from
+  // overflowing, since nodes can't then form a cycle; a full stack skips
+  // them too.
+  template <typename LeafHit>
+  bool traverse(
+    const ray& r, real t_min, real t_max, LeafHit&& leaf_hit
+  ) const;
+
+  // The same for all the rays of a packet at once: a node is visited when any
+  // of them may hit it, and its box test is one SIMD operation for the whole
+  // packet. leaf_hit(first, count, lanes, t_max) must intersect the
+  // primitives with the rays whose bits are set in lanes, lower t_max[k] when
+  // it finds a closer hit for ray k, and return the bit mask of the rays that
+  // it found hits for. Returns the mask of the rays that hit anything.
+  template <typename LeafHit>
+  unsigned traverse_packet(
+    const ray_packet& packet, real t_min, real t_max[],
+    LeafHit&& leaf_hit
+  ) const;
+
+  size_t memory_bytes() const {
+    return nodes.size() * sizeof(bvh8_node) + indices.size() * sizeof(uint32_t);
+  }
+
+  // Flat arrays, so that a tree can be read straight out of a mapped file
+  // (see scene_binary.h).
+  flat_array<bvh8_node> nodes;
+  // Primitive indices, in leaf order: every leaf is a contiguous range.
+  flat_array<uint32_t> indices;
+  // The number of primitives, which leaf ranges must not go past.
+  uint32_t primitive_count = 0;
+  aabb bounds;
+
+private:
+  // Whether the child of parent that traversal would push onto a stack
+  // holding top of stack_size entries is sound (see traverse).
+  bool can_push(uint32_t parent, uint32_t child, int top, int stack_size) const {
+    return child > parent && child < nodes.size() && top < stack_size;
+  }
+
+  // Whether a leaf's range is within the primitives.
+  bool leaf_in_range(uint32_t first, uint32_t count) const {
+    return first <= primitive_count && count <= primitive_count - first;
+  }
+
+  // A node of the binary tree that gets collapsed into the 8-wide one.
+  struct binary_node {
+    aabb box;
+    int left = -1;
+    int right = -1;
+    uint32_t first = 0;
+    uint32_t count = 0;
+  };
+
+  int build_binary(
+    std::vector<binary_node>& binary, std::vector<bvh_primitive>& prims,
+    size_t begin, size_t end, int leaf_size, int leaf_batch
+  );
+
+  uint32_t collapse(const std::vector<binary_node>& binary, int root);
+};
+
+void bvh8_tree::build(
+  const std::vector<aabb>& boxes, int leaf_size, int leaf_batch
+) {
+  nodes.clear();
+  indices.clear();
+  primitive_count = uint32_t(boxes.size());
+  bounds = aabb();
+  if (boxes.empty()) {
+    return;
+  }
+  if (leaf_size > max_leaf_size) {
+    leaf_size = max_leaf_size;
+  }
+
+  std::vector<bvh_primitive> prims;
+  prims.reserve(boxes.size());
+  for (size_t i = 0; i < boxes.size(); ++i) {
+    prims.push_back(make_bvh_primitive(boxes[i], i));
+    bounds.grow(boxes[i]);
+  }
+
+  std::vector<binary_node> binary;
+  binary.reserve(2 * boxes.size() / leaf_size + 1);
+  int root = build_binary(
+    binary, prims, 0, prims.size(), leaf_size, leaf_batch
+  );
+
+  indices.reserve(prims.size());
+  for (const auto& p : prims) {
+    indices.push_back(uint32_t(p.index));
+  }
+
+  if (binary[root].left < 0) {
+    // A single leaf. The 8-wide root must be an inner node, so wrap it.
+    binary_node wrapper;
+    wrapper.box = binary[root].box;
+    wrapper.left = root;
+    wrapper.right = -1;
+    binary.push_back(wrapper);
+    root = int(binary.size()) - 1;
+  }
+  collapse(binary, root);
+}
+
+int bvh8_tree::build_binary(
+  std::vector<binary_node>& binary, std::vector<bvh_primitive>& prims,
+  size_t begin, size_t end, int leaf_size, int leaf_batch
+) {
+  binary_node node;
+  for (size_t i = begin; i < end; ++i) {
+    node.box.grow(prims[i].box);
+  }
+
+  size_t count = end - begin;
+  double split_cost = infinity;
+  size_t mid = count > 1 ? sah_partition(prims, begin, end, &split_cost) : end;
+
+  // Make a leaf when splitting isn't expected to pay off. Leaves can't hold
+  // more than leaf_size primitives, though, so big ranges get split anyway.
+  double leaf_cost = double((count + leaf_batch - 1) / leaf_batch);
+  if (count == 1 || (count <= size_t(leaf_size) && leaf_cost <= split_cost)) {
+    node.first = uint32_t(begin);
+    node.count = uint32_t(count);
+    binary.push_back(node);
+    return int(binary.size()) - 1;
+  }
+
+  node.left = build_binary(binary, prims, begin, mid, leaf_size, leaf_batch);
+  node.right = build_binary(binary, prims, mid, end, leaf_size, leaf_batch);
+  binary.push_back(node);
+  return int(binary.size()) - 1;
+}
+
+// Rounds the double to a float that is not greater (down) or not less (up).
+inline float float_down(double x) {
+  float f = float(x);
+  return double(f) > x ? std::nextafter(f, -FLT_MAX) : f;
+}
+
+inline float float_up(double x) {
+  float f = float(x);
+  return double(f) < x ? std::nextafter(f, FLT_MAX) : f;
+}
+
+uint32_t bvh8_tree::collapse(const std::vector<binary_node>& binary, int root) {
+  // Pull grandchildren up into this node until it has 8 children: every time,
+  // open the inner child with the largest surface area, since it's the one
+  // that rays are most likely to enter.
+  int children[8];
+  int child_count = 0;
+  children[child_count++] = binary[root].left;
+  if (binary[root].right >= 0) {
+    children[child_count++] = binary[root].right;
+  }
+
+  while (child_count < 8) {
+    int widest = -1;
+    double widest_area = -1.0;
+    for (int k = 0; k < child_count; ++k) {
+      const binary_node& c = binary[children[k]];
+      if (c.left >= 0 && c.box.half_area() > widest_area) {
+        widest = k;
+        widest_area = c.box.half_area();
+      }
+    }
+    if (widest < 0) {
+      break;
+    }
+    const binary_node& opened = binary[children[widest]];
+    children[widest] = opened.left;
+    children[child_count++] = opened.right;
+  }
+
+  uint32_t index = uint32_t(nodes.size());
+  nodes.emplace_back();
+
+  // The frame the children are quantized in. The origin is rounded down and
+  // the scale up, so that 255 steps always reach the top of the box.
+  const aabb& box = binary[root].box;
+  float origin[3], scale[3];
+  for (int a = 0; a < 3; ++a) {
+    origin[a] = float_down(box.min()[a]);
+    scale[a] = float_up((box.max()[a] - origin[a]) / 255.0);
+    if (!(scale[a] > 0.0f)) {
+      // Flat along this axis; every child sits at the origin.
+      scale[a] = 1.0f;
+    }
+  }
+
+  uint8_t lo[3][8], hi[3][8];
+  uint32_t child[8];
+  uint8_t leaf_count[8];
+  for (int k = 0; k < 8; ++k) {
+    if (k >= child_count) {
+      for (int a = 0; a < 3; ++a) {
+        lo[a][k] = 255;
+        hi[a][k] = 0;
+      }
+      child[k] = 0;
+      leaf_count[k] = 0;
+      continue;
+    }
+
+    const binary_node& c = binary[children[k]];
+    for (int a = 0; a < 3; ++a) {
+      // Round outwards, then double check in float arithmetic that the
+      // quantized planes really are outside the child's box.
+      double q_lo = std::floor((c.box.min()[a] - origin[a]) / scale[a]);
+      double q_hi = std::ceil((c.box.max()[a] - origin[a]) / scale[a]);
+      int l = int(std::max(0.0, std::min(255.0, q_lo)));
+      int h = int(std::max(0.0, std::min(255.0, q_hi)));
+      while (l > 0 && origin[a] + float(l) * scale[a] > c.box.min()[a]) --l;
+      while (h < 255 && origin[a] + float(h) * scale[a] < c.box.max()[a]) ++h;
+      lo[a][k] = uint8_t(l);
+      hi[a][k] = uint8_t(h);
+    }
+
+    if (c.left < 0) {
+      child[k] = c.first;
+      leaf_count[k] = uint8_t(c.count);
+    } else {
+      child[k] = collapse(binary, children[k]);
+      leaf_count[k] = 0;
+    }
+  }
+
+  // Recursion may have reallocated nodes, so fill this one in only now.
+  bvh8_node& node = nodes[index];
+  for (int a = 0; a < 3; ++a) {
+    node.origin[a] = origin[a];
+    node.scale[a] = scale[a];
+    for (int k = 0; k < 8; ++k) {
+      node.lo[a][k] = lo[a][k];
+      node.hi[a][k] = hi[a][k];
+    }
+  }
+  for (int k = 0; k < 8; ++k) {
+    node.child[k] = child[k];
+    node.leaf_count[k] = leaf_count[k];
+  }
+  return index;
+}
+
+// The ray, prepared for testing boxes: in single precision, with the inverse
+// direction, and knowing which plane of every slab it enters through.
+struct bvh8_ray {
+  bvh8_ray(const ray& r) {
+    for (int a = 0; a < 3; ++a) {
+      origin[a] = float(r.origin()[a]);
+      inv_direction[a] = float(1.0 / r.direction()[a]);
+      negative[a] = inv_direction[a] < 0.0f;
+    }
+  }
+
+  float origin[3];
+  float inv_direction[3];
+  bool negative[3];
+};
+
+// Tests the ray against the 8 child boxes of node. Returns a bit mask of the
+// children that are hit between t_min and t_max, and where the ray enters
+// each of them in t_near.
+inline unsigned intersect_children(
+  const bvh8_node& node, const bvh8_ray& r, float t_min, float t_max,
+  float t_near[8]
+) {
+  // Float rounding in the slab arithmetic could make a ray that grazes a box
+  // miss it; moving the exit a few ulps out prevents that.
+  const float robust = 1.0f + 4.0f * FLT_EPSILON;
+
+#if defined(__AVX2__) && defined(__FMA__)
+  __m256 t0 = _mm256_set1_ps(t_min);
+  __m256 t1 = _mm256_set1_ps(t_max);
+  for (int a = 0; a < 3; ++a) {
+    // child plane = origin + q * scale, so
+    // t = (plane - o) * inv = q * (scale * inv) + (origin - o) * inv.
+    __m256 step = _mm256_set1_ps(node.scale[a] * r.inv_direction[a]);
+    __m256 base = _mm256_set1_ps((node.origin[a] - r.origin[a]) * r.inv_direction[a]);
+    const uint8_t* near_q = r.negative[a] ? node.hi[a] : node.lo[a];
+    const uint8_t* far_q = r.negative[a] ? node.lo[a] : node.hi[a];
+    __m256 q_near = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(
+      _mm_loadl_epi64(reinterpret_cast<const __m128i*>(near_q))
+    ));
+    __m256 q_far = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(
+      _mm_loadl_epi64(reinterpret_cast<const __m128i*>(far_q))
+    ));
+    t0 = _mm256_max_ps(_mm256_fmadd_ps(q_near, step, base), t0);
+    t1 = _mm256_min_ps(_mm256_fmadd_ps(q_far, step, base), t1);
+  }
+  t1 = _mm256_mul_ps(t1, _mm256_set1_ps(robust));
+  _mm256_storeu_ps(t_near, t0);
+  return unsigned(_mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ)));
+#else
+  unsigned mask = 0;
+  for (int k = 0; k < 8; ++k) {
+    float t0 = t_min;
+    float t1 = t_max;
+    for (int a = 0; a < 3; ++a) {
+      float step = node.scale[a] * r.inv_direction[a];
+      float base = (node.origin[a] - r.origin[a]) * r.inv_direction[a];
+      uint8_t q_near = r.negative[a] ? node.hi[a][k] : node.lo[a][k];
+      uint8_t q_far = r.negative[a] ? node.lo[a][k] : node.hi[a][k];
+      float near_t = float(q_near) * step + base;
+      float far_t = float(q_far) * step + base;
+      t0 = near_t > t0 ? near_t : t0;
+      t1 = far_t < t1 ? far_t : t1;
+    }
+    t_near[k] = t0;
+    if (t0 <= t1 * robust) {
+      mask |= 1u << k;
+    }
+  }
+  return mask;
+#endif
+}
+
+template <typename LeafHit>
+bool bvh8_tree::traverse(
+  const ray& r, real t_min, real t_max, LeafHit&& leaf_hit
+) const {
+  if (nodes.empty()) {
+    return false;
+  }
+
+  const bvh8_ray fr(r);
+  const float ft_min = float_down(t_min);
+  float ft_max = float_up(t_max);
+
+  // Every entry remembers where the ray enters the node, so that nodes that
+  // are farther than a hit found after they were pushed can be skipped.
+  struct entry {
+    uint32_t node;
+    float t;
+  };
+  const int stack_size = 1024;
+  entry stack[stack_size];
+  int top = 0;
+  stack[top++] = {0, ft_min};
+
+  bool hit_anything = false;
+  while (top > 0) {
+    entry e = stack[--top];
+    if (e.t > ft_max) {
+      continue;
+    }
+
+    const bvh8_node& node = nodes[e.node];
+    float t_near[8];
+    unsigned mask = intersect_children(node, fr, ft_min, ft_max, t_near);
+    RT_STAT(thread_stats().box_tests += 8);
+
+    // Leaves are intersected right away, nearest first; inner nodes are
+    // pushed farthest first, so that the nearest one is popped next.
+    int order[8];
+    int hits = 0;
+    while (mask) {
+      int k = __builtin_ctz(mask);
+      mask &= mask - 1;
+      int pos = hits++;
+      while (pos > 0 && t_near[order[pos - 1]] > t_near[k]) {
+        order[pos] = order[pos - 1];
+        --pos;
+      }
+      order[pos] = k;
+    }
+
+    for (int n = 0; n < hits; ++n) {
+      int k = order[n];
+      if (node.leaf_count[k] == 0 || t_near[k] > ft_max
+        || !leaf_in_range(node.child[k], node.leaf_count[k])) {
+        continue;
+      }
+      if (leaf_hit(node.child[k], uint32_t(node.leaf_count[k]), t_max)) {
+        hit_anything = true;
+        ft_max = float_up(t_max);
+      }
+    }
+
+    for (int n = hits - 1; n >= 0; --n) {
+      int k = order[n];
+      if (node.leaf_count[k] != 0 || t_near[k] > ft_max
+        || !can_push(e.node, node.child[k], top, stack_size)) {
+        continue;
+      }
+      stack[top++] = {node.child[k], t_near[k]};
+    }
+  }
+
+  return hit_anything;
+}
+
+// A packet prepared for testing boxes, like bvh8_ray with one lane per ray.
+// Rays can point anywhere, so which plane of a slab is the near one is
+// decided per lane.
+struct bvh8_packet {
+  bvh8_packet(const ray_packet& p) {
+    for (int a = 0; a < 3; ++a) {
+      for (int k = 0; k < ray_packet_size; ++k) {
+        origin[a][k] = k < p.count ? float(p.origin[a][k]) : 0.0f;
+        inv_direction[a][k] = k < p.count ? float(1.0 / p.direction[a][k]) : 0.0f;
+        origin_over_direction[a][k] = origin[a][k] * inv_direction[a][k];
+      }
+    }
+  }
+
+  alignas(32) float origin[3][ray_packet_size];
+  alignas(32) float inv_direction[3][ray_packet_size];
+  // origin * inv_direction, so that t = plane * inv_direction - this is a
+  // single fused multiply-subtract.
+  alignas(32) float origin_over_direction[3][ray_packet_size];
+};
+
+// Tests child k of node against every ray of the packet. Returns a bit mask
+// of the rays that hit it between t_min and their t_max, and where each of
+// them enters it in t_near.
+inline unsigned intersect_child_packet(
+  const bvh8_node& node, int k, const bvh8_packet& p, float t_min,
+  const float t_max[], float t_near[]
+) {
+  const float robust = 1.0f + 4.0f * FLT_EPSILON;
+
+#if defined(__AVX2__) && defined(__FMA__)
+  __m256 t0 = _mm256_set1_ps(t_min);
+  __m256 t1 = _mm256_loadu_ps(t_max);
+  for (int a = 0; a < 3; ++a) {
+    // The same planes that the builder checked, in the same arithmetic.
+    float lo = node.origin[a] + float(node.lo[a][k]) * node.scale[a];
+    float hi = node.origin[a] + float(node.hi[a][k]) * node.scale[a];
+    __m256 inv = _mm256_load_ps(p.inv_direction[a]);
+    __m256 o_inv = _mm256_load_ps(p.origin_over_direction[a]);
+    __m256 t_lo = _mm256_fmsub_ps(_mm256_set1_ps(lo), inv, o_inv);
+    __m256 t_hi = _mm256_fmsub_ps(_mm256_set1_ps(hi), inv, o_inv);
+    t0 = _mm256_max_ps(_mm256_min_ps(t_lo, t_hi), t0);
+    t1 = _mm256_min_ps(_mm256_max_ps(t_lo, t_hi), t1);
+  }
+  t1 = _mm256_mul_ps(t1, _mm256_set1_ps(robust));
+  _mm256_storeu_ps(t_near, t0);
+  return unsigned(_mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ)));
+#else
+  unsigned mask = 0;
+  for (int n = 0; n < ray_packet_size; ++n) {
+    float t0 = t_min;
+    float t1 = t_max[n];
+    for (int a = 0; a < 3; ++a) {
+      float lo = node.origin[a] + float(node.lo[a][k]) * node.scale[a];
+      float hi = node.origin[a] + float(node.hi[a][k]) * node.scale[a];
+      float t_lo = lo * p.inv_direction[a][n] - p.origin_over_direction[a][n];
+      float t_hi = hi * p.inv_direction[a][n] - p.origin_over_direction[a][n];
+      t0 = std::max(std::min(t_lo, t_hi), t0);
+      t1 = std::min(std::max(t_lo, t_hi), t1);
+    }
+    t_near[n] = t0;
+    if (t0 <= t1 * robust) {
+      mask |= 1u << n;
+    }
+  }
+  return mask;
+#endif
+}
+
+template <typename LeafHit>
+unsigned bvh8_tree::traverse_packet(
+  const ray_packet& packet, real t_min, real t_max[], LeafHit&& leaf_hit
+) const {
+  if (nodes.empty() || packet.count == 0) {
+    return 0;
+  }
+
+  const bvh8_packet fp(packet);
+  const float ft_min = float_down(t_min);
+  float ft_max[ray_packet_size];
+  for (int n = 0; n < ray_packet_size; ++n) {
+    ft_max[n] = n < packet.count ? float_up(t_max[n]) : -FLT_MAX;
+  }
+
+  // An entry carries the rays that hit the node's box and the nearest point
+  // where one of them enters it.
+  struct entry {
+    uint32_t node;
+    float t;
+    unsigned lanes;
+  };
+  const int stack_size = 1024;
+  entry stack[stack_size];
+  int top = 0;
+  stack[top++] = {0, ft_min, (1u << packet.count) - 1};
+
+  unsigned hit_lanes = 0;
+  while (top > 0) {
+    entry e = stack[--top];
+    // Drop the rays that found a hit before reaching this node.
+    unsigned active = 0;
+    for (unsigned m = e.lanes; m; m &= m - 1) {
+      int n = __builtin_ctz(m);
+      if (e.t <= ft_max[n]) {
+        active |= 1u << n;
+      }
+    }
+    if (!active) {
+      continue;
+    }
+
+    const bvh8_node& node = nodes[e.node];
+    float t_near[8][ray_packet_size];
+    unsigned lanes[8];
+    float nearest[8];
+    int order[8];
+    int hits = 0;
+    // Unused slots are all at the end. They can't be tested like the others:
+    // taking the min and max of their planes would turn them right side out.
+    for (int k = 0; k < 8 && node.lo[0][k] <= node.hi[0][k]; ++k) {
+      lanes[k] = active
+        & intersect_child_packet(node, k, fp, ft_min, ft_max, t_near[k]);
+      RT_STAT(thread_stats().box_tests += __builtin_popcount(active));
+      if (!lanes[k]) {
+        continue;
+      }
+      nearest[k] = FLT_MAX;
+      for (unsigned m = lanes[k]; m; m &= m - 1) {
+        nearest[k] = std::min(nearest[k], t_near[k][__builtin_ctz(m)]);
+      }
+      int pos = hits++;
+      while (pos > 0 && nearest[order[pos - 1]] > nearest[k]) {
+        order[pos] = order[pos - 1];
+        --pos;
+      }
+      order[pos] = k;
+    }
+
+    // As in traverse: leaves right away, nearest first, and inner nodes
+    // pushed farthest first.
+    for (int i = 0; i < hits; ++i) {
+      int k = order[i];
+      if (node.leaf_count[k] == 0
+        || !leaf_in_range(node.child[k], node.leaf_count[k])) {
+        continue;
+      }
+      unsigned leaf_lanes = 0;
+      for (unsigned m = lanes[k]; m; m &= m - 1) {
+        int n = __builtin_ctz(m);
+        if (t_near[k][n] <= ft_max[n]) {
+          leaf_lanes |= 1u << n;
+        }
+      }
+      if (!leaf_lanes) {
+        continue;
+      }
+      unsigned found = leaf_hit(
+        node.child[k], uint32_t(node.leaf_count[k]), leaf_lanes, t_max
+      );
+      hit_lanes |= found;
+      for (unsigned m = found; m; m &= m - 1) {
+        int n = __builtin_ctz(m);
+        ft_max[n] = float_up(t_max[n]);
+      }
+    }
+
+    for (int i = hits - 1; i >= 0; --i) {
+      int k = order[i];
+      if (node.leaf_count[k] != 0
+        || !can_push(e.node, node.child[k], top, stack_size)) {
+        continue;
+      }
+      stack[top++] = {node.child[k], nearest[k], lanes[k]};
+    }
+  }
+
+  return hit_lanes;
+}
+
+// A BVH8 over arbitrary hittables. It's a drop-in replacement for
+// hittable_list and bvh_node.
+class bvh8 : public hittable {
+public:
+  bvh8() {}
+
+  bvh8(const hittable_list& list, int leaf_size = 4)
+    : bvh8(list.objects, leaf_size) {}
+
+  bvh8(const std::vector<hittable*>& objects, int leaf_size = 4);
+
+  virtual bool
+    intersect(const ray& r, real t_min, real t_max, ray_hit& hit) const;
+
+  virtual bool bounding_box(aabb& output_box) const;
+
+  virtual unsigned intersect_packet(
+    const ray_packet& packet, real t_min, real t_max, ray_hit hits[]
+  ) const;
+
+  size_t memory_bytes() const {
+    return tree.memory_bytes() + objects.size() * sizeof(hittable*);
+  }
+
+  bvh8_tree tree;
+  // The objects, reordered so that every leaf is a contiguous range.
+  std::vector<hittable*> objects;
+};
+
+bvh8::bvh8(const std::vector<hittable*>& list, int leaf_size) {
+  RT_TRACE_ZONE_ARGS("build bvh8", "objects", list.size(), nullptr, 0);
+  std::vector<aabb> boxes(list.size());
+  for (size_t i = 0; i < list.size(); ++i) {
+    if (!list[i]->bounding_box(boxes[i])) {
+      std::cerr << "No bounding box in bvh8 constructor.\n";
+    }
+  }
+  tree.build(boxes, leaf_size);
+
+  objects.reserve(list.size());
+  for (uint32_t index : tree.indices) {
+    objects.push_back(list[index]);
+  }
+}
+
+bool bvh8::intersect(const ray& r, real t_min, real t_max, ray_hit& hit)
+  const {
+  return tree.traverse(r, t_min, t_max,
+    [&](uint32_t first, uint32_t count, real& closest_so_far) {
+      bool hit_anything = false;
+      for (uint32_t i = first; i < first + count; ++i) {
+        if (objects[i]->intersect(r, t_min, closest_so_far, hit)) {
+          hit_anything = true;
+          closest_so_far = hit.t;
+        }
+      }
+      return hit_anything;
+    }
+  );
+}
+
+unsigned bvh8::intersect_packet(
+  const ray_packet& packet, real t_min, real t_max, ray_hit hits[]
+) const {
+  ray rays[ray_packet_size];
+  real closest_so_far[ray_packet_size];
+  for (int k = 0; k < packet.count; ++k) {
+    rays[k] = packet.get(k);
+    closest_so_far[k] = t_max;
+  }
+
+  return tree.traverse_packet(packet, t_min, closest_so_far,
+    [&](uint32_t first, uint32_t count, unsigned lanes, real* closest) {
+      unsigned hit_lanes = 0;
+      for (; lanes; lanes &= lanes - 1) {
+        int k = __builtin_ctz(lanes);
+        for (uint32_t i = first; i < first + count; ++i) {
+          if (objects[i]->intersect(rays[k], t_min, closest[k], hits[k])) {
+            hit_lanes |= 1u << k;
+            closest[k] = hits[k].t;
+          }
+        }
+      }
+      return hit_lanes;
+    }
+  );
+}
+
+bool bvh8::bounding_box(aabb& output_box) const {
+  output_box = tree.bounds;
+  return !tree.nodes.empty();
+}
+
+#endif
@@ -3,16 +3,10 @@
 
 #include "common.h"
 
-vec3 random_in_unit_disk() {
-  vec3 p;
-  do {
-    p = vec3(random_double(-1,1), random_double(-1,1), 0);
-
-    // The square of the length of a vector is the scalar projection onto itself.
-    // Keep computing points until one is within a radius of 1 from the origin.
-  } while(dot(p,p) >= 1.0);
-  return p;
-}
+#include "ray_packet.h"
+#include "sampler.h"
+#include "sampling.h"
+#include "trace.h"
 
 class camera {
 public:
@@ -27,6 +21,7 @@ public:
     double aperture,
     double focus_distance
   ) {
+    RT_TRACE_ZONE("camera setup");
     auto theta = degrees_to_radians(vfov);
     // tan is not a linear map, so you can't do just tan(theta).
     auto viewport_height = 2.0 * tan(theta / 2);
@@ -48,8 +43,26 @@ public:
     lens_radius = aperture / 2;
   }
 
-  ray get_ray(double s, double t) const {
-    vec3 randInDisk = lens_radius * random_in_unit_disk();
+  // A random point on the lens, relative to its center, in the camera's
+  // (u, v) frame, from the lens dimensions of s.
+  vec3 sample_lens(sampler& s) const {
+    double x, y;
+    s.get_2d(x, y);
+    return lens_radius * concentric_disk(x, y);
+  }
+
+  // The angle between the rays through the centers of two neighboring rows of
+  // an image of image_height rows: the spread of a camera ray's cone (see
+  // ray_cone.h).
+  real pixel_spread(int image_height) const {
+    const real focus_distance
+      = (lower_left_corner + horizontal / 2 + vertical / 2 - origin).length();
+    return vertical.length() / (focus_distance * image_height);
+  }
+
+  // The lens point is drawn from lens_sampler.
+  ray get_ray(double s, double t, sampler& lens_sampler) const {
+    vec3 randInDisk = sample_lens(lens_sampler);
     // u and v are the horizontal and vertical vectors of the orthonormal basis of the 
     // camera's frame of orientation.
     // By multiplying the random unit disk point by the orthonormal basis vectors, we 
@@ -77,6 +90,34 @@ public:
     );
   }
 
+  // The same, with a lens point drawn from random_double()'s generator.
+  ray get_ray(double s, double t) const {
+    sampler independent(thread_rng());
+    ray r = get_ray(s, t, independent);
+    thread_rng() = independent.stream;
+    return r;
+  }
+
+  // The batched get_ray: fills the first count rays of packet with the rays
+  // through film coordinates (s[k], t[k]) from lens points lens[k], as
+  // returned by sample_lens. It draws no random numbers, so the caller
+  // decides which stream each ray's samples come from, and the loops run
+  // over the packet's lanes, one coordinate at a time.
+  void get_rays(
+    int count, const double s[], const double t[], const vec3 lens[],
+    ray_packet& packet
+  ) const {
+    packet.count = count;
+    for (int a = 0; a < 3; ++a) {
+      for (int k = 0; k < count; ++k) {
+        double offset = u[a] * lens[k].x() + v[a] * lens[k].y();
+        packet.origin[a][k] = origin[a] + offset;
+        packet.direction[a][k] = lower_left_corner[a] + s[k] * horizontal[a]
+          + t[k] * vertical[a] - origin[a] - offset;
+      }
+    }
+  }
+
   point3 origin;
   point3 lower_left_corner;
   vec3 horizontal;
@@ -5,6 +5,11 @@
 
 #include <iostream>
 
+// The brightness of c, as the eye sees it (Rec. 709 weights).
+inline real luminance(const color& c) {
+  return real(0.2126) * c.x() + real(0.7152) * c.y() + real(0.0722) * c.z();
+}
+
 void write_color(std::ostream &out, color pixel_color, int samples_per_pixel) {
   auto r = pixel_color.x();
   auto g = pixel_color.y();
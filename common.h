@@ -5,7 +5,8 @@
 #include <cstdlib>
 #include <limits>
 #include <memory>
-#include <random>
+
+#include "random.h"
 
 // Usings.
 
@@ -13,6 +14,17 @@ using std::shared_ptr;
 using std::make_shared;
 using std::sqrt;
 
+// The precision of vectors (and so of points and colors), rays and
+// intersections. Compile with -DRT_SINGLE_PRECISION for float: it halves the
+// size of everything the tracer moves around and doubles what fits in a SIMD
+// register. Rays then leave surfaces through hit_record::spawn_ray, which
+// keeps them from hitting the surface they leave at either precision.
+#ifdef RT_SINGLE_PRECISION
+using real = float;
+#else
+using real = double;
+#endif
+
 // Constants.
 
 const double infinity = std::numeric_limits<double>::infinity();
@@ -25,15 +37,22 @@ inline double degrees_to_radians(double degrees) {
 }
 
 inline double random_double() {
-  static std::uniform_real_distribution<double> distribution(0.0, 1.0);
-  static std::mt19937 generator;
-  return distribution(generator);
+  return thread_rng().next_double();
 }
 
 inline double random_double(double min, double max) {
   return min + (max - min) * random_double();
 }
 
+// A bound on the relative error of n successive roundings in the precision
+// of real: (n u) / (1 - n u), where u is half the machine epsilon (Higham's
+// gamma_n). A result computed with n rounded operations from exact inputs is
+// within gamma(n) * |result| of the exact one.
+inline constexpr real rounding_gamma(int n) {
+  constexpr real u = std::numeric_limits<real>::epsilon() * real(0.5);
+  return (n * u) / (1 - n * u);
+}
+
 inline double clamp(double x, double min, double max) {
   if (x < min) return min;
   if (x > max) return max;
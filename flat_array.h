@@ -0,0 +1,123 @@
+#ifndef FLAT_ARRAY_H
+#define FLAT_ARRAY_H
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+// A contiguous array of T that either owns its elements, in a vector, or
+// borrows them from memory that someone else owns, like a mapped scene file
+// (see scene_binary.h). Reading an element costs the same either way: one
+// pointer, one index.
+//
+// A borrowed array is read only. Anything that changes it first copies the
+// elements into a vector of its own, so code that builds arrays works on
+// borrowed ones too, just not for free.
+template <typename T>
+class flat_array {
+public:
+  flat_array() {}
+
+  // An array of the count elements at elements, which must stay put, and
+  // unchanged, for as long as the array or any copy of it is used.
+  static flat_array borrow(const T* elements, size_t count) {
+    flat_array a;
+    a.elements = elements;
+    a.count = count;
+    a.borrowed = true;
+    return a;
+  }
+
+  flat_array(const flat_array& other) { *this = other; }
+  flat_array(flat_array&& other) { *this = std::move(other); }
+
+  flat_array& operator=(const flat_array& other) {
+    owned = other.owned;
+    borrowed = other.borrowed;
+    elements = borrowed ? other.elements : owned.data();
+    count = other.count;
+    return *this;
+  }
+
+  flat_array& operator=(flat_array&& other) {
+    owned = std::move(other.owned);
+    borrowed = other.borrowed;
+    elements = borrowed ? other.elements : owned.data();
+    count = other.count;
+    other.clear();
+    return *this;
+  }
+
+  size_t size() const { return count; }
+  bool empty() const { return count == 0; }
+  bool is_borrowed() const { return borrowed; }
+
+  const T* data() const { return elements; }
+  const T* begin() const { return elements; }
+  const T* end() const { return elements + count; }
+  const T& operator[](size_t i) const { return elements[i]; }
+
+  T& operator[](size_t i) {
+    own();
+    return owned[i];
+  }
+
+  void clear() {
+    owned.clear();
+    borrowed = false;
+    sync();
+  }
+
+  void reserve(size_t n) {
+    own();
+    owned.reserve(n);
+    sync();
+  }
+
+  void resize(size_t n) {
+    own();
+    owned.resize(n);
+    sync();
+  }
+
+  void resize(size_t n, const T& value) {
+    own();
+    owned.resize(n, value);
+    sync();
+  }
+
+  void push_back(const T& value) {
+    own();
+    owned.push_back(value);
+    sync();
+  }
+
+  template <typename... Args>
+  T& emplace_back(Args&&... args) {
+    own();
+    owned.emplace_back(std::forward<Args>(args)...);
+    sync();
+    return owned.back();
+  }
+
+private:
+  void own() {
+    if (borrowed) {
+      owned.assign(elements, elements + count);
+      borrowed = false;
+      sync();
+    }
+  }
+
+  void sync() {
+    elements = owned.data();
+    count = owned.size();
+  }
+
+  std::vector<T> owned;
+  const T* elements = nullptr;
+  size_t count = 0;
+  bool borrowed = false;
+};
+
+#endif
@@ -2,19 +2,40 @@
 #define HITTABLE_H
 
 #include "ray.h"
+#include "ray_packet.h"
+#include "aabb.h"
+
+#include <cstdint>
 
 class material;
 
 struct hit_record {
   point3 p;
+  // A bound on the rounding error in every coordinate of p: the exact hit
+  // point is within p - p_error and p + p_error.
+  vec3 p_error;
   vec3 normal;
-  shared_ptr<material> material;
-  double t;
-  color color;
+  // Owned by the scene (see scene_arena.h), so that copying a hit record
+  // doesn't touch a reference count.
+  const ::material* material;
+  real t;
+  ::color color;
 
   // front_face tells if the surface was hit on its front face / exterior.
   bool front_face;
 
+  // Where p is on the unit square of textures, and how fast that changes:
+  // about how far u and v move along a unit of world length on the surface.
+  // Objects only set them when the material asks for them (see
+  // material::needs_uv); objects without a material, which only benchmarks
+  // make, never do.
+  real u, v;
+  real uv_scale;
+  // The width of the ray's footprint on the surface around p, which picks
+  // how blurry a texture lookup is. It's set by integrators that follow the
+  // ray's cone (see ray_cone.h); 0 is a point, the sharpest lookup.
+  real footprint = 0;
+
   inline void set_face_normal(const ray& r, const vec3& outward_normal) {
     // Ray and normal go in the same direction about a line tangent to the
     // surface.
@@ -22,12 +43,111 @@ struct hit_record {
     // When the surface was hit on its back face, the normal points inward.
     normal = front_face ? outward_normal : -outward_normal;
   }
+
+  // A ray that leaves the surface at p in the given direction. p may be on
+  // either side of the surface, so a ray that starts right at it may hit the
+  // surface again at a tiny t (shadow acne). Instead, its origin is moved
+  // along the normal, to the side the direction points to, far enough to
+  // clear the error box around p; then rays need no t_min to avoid acne, at
+  // any precision.
+  inline ray spawn_ray(const vec3& direction) const {
+    real distance = dot(abs(normal), p_error);
+    vec3 offset = distance * normal;
+    if (dot(direction, normal) < 0) {
+      offset = -offset;
+    }
+    point3 origin = p + offset;
+    // Round away from p, so that rounding the sum can't undo the offset.
+    for (int a = 0; a < 3; ++a) {
+      if (offset[a] > 0) {
+        origin[a] = std::nextafter(origin[a], std::numeric_limits<real>::infinity());
+      } else if (offset[a] < 0) {
+        origin[a] = std::nextafter(origin[a], -std::numeric_limits<real>::infinity());
+      }
+    }
+    return ray(origin, direction);
+  }
+};
+
+class hittable;
+
+// What a traversal keeps of the closest hit found so far. It's all an
+// accelerator needs to carry from one candidate to the next, and a lot less
+// to copy than a hit_record; the rest of the record (the point, normal,
+// color and material) is only computed for the closest hit, by the object
+// that was hit (see hittable::finish_hit).
+struct ray_hit {
+  // The object hit, which isn't an aggregate like a list or a BVH, but the
+  // one that knows the surface.
+  const hittable* object;
+  real t;
+  // Which of the object's primitives was hit, e.g. which sphere of a
+  // sphere_set; objects with a single primitive leave it 0.
+  uint32_t primitive;
+  // Whether the ray reached the surface from outside: spheres color their
+  // inside differently.
+  bool exterior;
+  // When object is an instance (see instance.h), the object of its geometry
+  // that was hit, which knows the surface; t and primitive are that
+  // object's. Null otherwise.
+  const hittable* instanced = nullptr;
 };
 
 class hittable {
 public:
-  virtual bool 
-    hit(const ray &r, double t_min, double t_max, hit_record &rec) const = 0;
+  // Finds the closest hit of r with t_min < t < t_max. hit is only written
+  // when there's one: callers keep their closest hit so far in it, and pass
+  // its t as t_max.
+  virtual bool
+    intersect(const ray& r, real t_min, real t_max, ray_hit& hit) const = 0;
+
+  // Fills in rec for a hit of r that intersect found on this object.
+  // Aggregates never show up as ray_hit::object, so they don't override it.
+  virtual void
+    finish_hit(const ray& r, const ray_hit& hit, hit_record& rec) const {}
+
+  // Intersects, then fills in the record of the closest hit only.
+  bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
+    ray_hit closest;
+    if (!intersect(r, t_min, t_max, closest)) {
+      return false;
+    }
+    closest.object->finish_hit(r, closest, rec);
+    return true;
+  }
+
+  // Computes the box that encloses the object. Returns false when the object
+  // has no bounds (e.g. an empty list).
+  virtual bool bounding_box(aabb& output_box) const = 0;
+
+  // Intersects every ray of the packet. Returns a bit mask of the rays that
+  // hit something, and hits[k] is the closest hit of ray k if bit k is set.
+  // Accelerators override it to share their work among the rays; by default
+  // they're traced one at a time.
+  virtual unsigned intersect_packet(
+    const ray_packet& packet, real t_min, real t_max, ray_hit hits[]
+  ) const {
+    unsigned mask = 0;
+    for (int k = 0; k < packet.count; ++k) {
+      if (intersect(packet.get(k), t_min, t_max, hits[k])) {
+        mask |= 1u << k;
+      }
+    }
+    return mask;
+  }
+
+  // The same, with the records of the closest hits filled in.
+  unsigned hit_packet(
+    const ray_packet& packet, real t_min, real t_max, hit_record rec[]
+  ) const {
+    ray_hit hits[ray_packet_size];
+    unsigned mask = intersect_packet(packet, t_min, t_max, hits);
+    for (unsigned m = mask; m; m &= m - 1) {
+      int k = __builtin_ctz(m);
+      hits[k].object->finish_hit(packet.get(k), hits[k], rec[k]);
+    }
+    return mask;
+  }
 };
 
-#endif
\ No newline at end of file
+#endif
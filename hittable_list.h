@@ -3,17 +3,15 @@
 
 #include "hittable.h"
 
-#include <memory>
 #include <vector>
 
-using std::shared_ptr;
-using std::make_shared;
-
+// The objects aren't owned by the list, but by the scene_arena they were made
+// in, like those of the accelerators built over the list.
 class hittable_list: public hittable {
 public:
   hittable_list() {}
   
-  hittable_list(shared_ptr<hittable> object) { 
+  hittable_list(hittable* object) { 
     add(object);
   }
 
@@ -21,31 +19,50 @@ public:
     objects.clear();
   }
 
-  void add(shared_ptr<hittable> object) {
+  void add(hittable* object) {
     objects.push_back(object);
   }
 
-  virtual bool hit(const ray &r, double t_min, double t_max, hit_record &rec) const;
+  virtual bool
+    intersect(const ray& r, real t_min, real t_max, ray_hit& hit) const;
+
+  virtual bool bounding_box(aabb& output_box) const;
 
-  std::vector<shared_ptr<hittable>> objects;
+  std::vector<hittable*> objects;
 };
 
-bool hittable_list::hit(const ray &r, double t_min, double t_max, hit_record &rec) const {
-  hit_record temp_rec;
+bool hittable_list::intersect(const ray& r, real t_min, real t_max, ray_hit& hit)
+  const {
   bool hit_anything = false;
   auto closest_so_far = t_max;
 
   for (const auto &object : objects) {
     // closest_so_far is t_max so that if the ray hits an object that is farther
-    // away, the hit gets ignored.
-    if (object->hit(r, t_min, closest_so_far, temp_rec)) {
+    // away, the hit gets ignored. hit is only overwritten by closer hits.
+    if (object->intersect(r, t_min, closest_so_far, hit)) {
       hit_anything = true;
-      closest_so_far = temp_rec.t;
-      rec = temp_rec;
+      closest_so_far = hit.t;
     }
   }
 
   return hit_anything;
 }
 
+bool hittable_list::bounding_box(aabb& output_box) const {
+  if (objects.empty()) {
+    return false;
+  }
+
+  aabb object_box;
+  output_box = aabb();
+  for (const auto &object : objects) {
+    if (!object->bounding_box(object_box)) {
+      return false;
+    }
+    output_box.grow(object_box);
+  }
+
+  return true;
+}
+
 #endif
\ No newline at end of file
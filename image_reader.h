@@ -0,0 +1,120 @@
+#ifndef IMAGE_READER_H
+#define IMAGE_READER_H
+
+#include "common.h"
+
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Reads the image at path, in linear color, into pixels: width * height
+// colors, row by row from the bottom one up, the way textures count v. It
+// reads back what image_writer.h writes, except PNG:
+//
+//   ppm: PPM, binary (P6) or text (P3), up to 16 bits per channel, gamma 2.
+//   pfm: PFM, color (PF), linear, in either byte order.
+//
+// The format is told by the file's first bytes, not its extension. Returns
+// false, after printing why, if the file can't be read or is in neither.
+bool read_image(
+  const std::string& path, int& width, int& height, std::vector<color>& pixels
+);
+
+// Reads the next number of a PPM or PFM header, skipping blanks and
+// comments, and the single blank after it.
+inline bool read_image_header_number(std::istream& in, double& x) {
+  int c = in.peek();
+  while (std::isspace(c) || c == '#') {
+    if (c == '#') {
+      std::string comment;
+      std::getline(in, comment);
+    } else {
+      in.get();
+    }
+    c = in.peek();
+  }
+  if (!(in >> x)) {
+    return false;
+  }
+  in.get();
+  return true;
+}
+
+bool read_image(
+  const std::string& path, int& width, int& height, std::vector<color>& pixels
+) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in) {
+    std::cerr << "Can't open " << path << ".\n";
+    return false;
+  }
+  char magic[2] = {};
+  in.read(magic, 2);
+  double w, h, max_value;
+  if (!in || magic[0] != 'P'
+    || (magic[1] != '6' && magic[1] != '3' && magic[1] != 'F')
+    || !read_image_header_number(in, w) || !read_image_header_number(in, h)
+    || !read_image_header_number(in, max_value)
+    || w < 1 || h < 1 || w * h > double(size_t(1) << 30) || max_value == 0) {
+    std::cerr << path << " isn't a PPM or PFM image.\n";
+    return false;
+  }
+  width = int(w);
+  height = int(h);
+  pixels.resize(size_t(width) * height);
+  const size_t count = pixels.size() * 3;
+
+  if (magic[1] == 'F') {
+    // A negative scale means little-endian floats. Rows go bottom up.
+    std::vector<float> values(count);
+    in.read(reinterpret_cast<char*>(values.data()), std::streamsize(count * 4));
+    const uint16_t probe = 1;
+    const bool little_endian = *reinterpret_cast<const unsigned char*>(&probe) == 1;
+    if (little_endian != (max_value < 0)) {
+      for (float& value : values) {
+        unsigned char* bytes = reinterpret_cast<unsigned char*>(&value);
+        std::swap(bytes[0], bytes[3]);
+        std::swap(bytes[1], bytes[2]);
+      }
+    }
+    for (size_t p = 0; p < pixels.size(); ++p) {
+      pixels[p] = color(values[3 * p], values[3 * p + 1], values[3 * p + 2]);
+    }
+  } else {
+    // Rows go top down; values are big-endian if they take 2 bytes.
+    std::vector<unsigned> values(count);
+    if (magic[1] == '3') {
+      for (unsigned& value : values) {
+        in >> value;
+      }
+    } else if (max_value < 256) {
+      std::vector<unsigned char> bytes(count);
+      in.read(reinterpret_cast<char*>(bytes.data()), std::streamsize(count));
+      values.assign(bytes.begin(), bytes.end());
+    } else {
+      std::vector<unsigned char> bytes(2 * count);
+      in.read(reinterpret_cast<char*>(bytes.data()), std::streamsize(2 * count));
+      for (size_t n = 0; n < count; ++n) {
+        values[n] = unsigned(bytes[2 * n]) << 8 | bytes[2 * n + 1];
+      }
+    }
+    for (int j = 0; j < height; ++j) {
+      for (int i = 0; i < width; ++i) {
+        const unsigned* rgb = &values[3 * (size_t(height - 1 - j) * width + i)];
+        color c(rgb[0] / max_value, rgb[1] / max_value, rgb[2] / max_value);
+        pixels[size_t(j) * width + i] = c * c;
+      }
+    }
+  }
+  if (!in) {
+    std::cerr << path << " is truncated.\n";
+    return false;
+  }
+  return true;
+}
+
+#endif
@@ -0,0 +1,162 @@
+#ifndef IMAGE_TEXTURE_H
+#define IMAGE_TEXTURE_H
+
+#include "common.h"
+
+#include "hittable.h"
+#include "texture.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// An image wrapped around the texture coordinates of surfaces: u goes from
+// its left edge to its right one, v from its bottom to its top, and both
+// repeat outside [0, 1).
+//
+// It's filtered by trilinear mip-mapping. The image is kept at its own
+// size, at half of it, a quarter, and so on down to a single texel, each
+// level the average of the one above; a lookup blends the two levels whose
+// texels are closest in size to the hit's footprint (see
+// hit_record::footprint), with a bilinear lookup in each. A surface far
+// away is then the average of all of it that a pixel covers, instead of a
+// few texels that change from sample to sample, and the aliasing this
+// causes never needs more samples to go away.
+//
+// Every level is stored in tiles of 4 x 4 texels, one after the other, so
+// that the 4 texels of a bilinear lookup are nearly always in the same 192
+// bytes, where rows of a big image would put them kilobytes apart.
+class image_texture final : public texture {
+public:
+  // pixels holds width * height linear colors, row by row from the bottom.
+  image_texture(int width, int height, const std::vector<color>& pixels);
+
+  virtual color value(const hit_record& hit) const;
+
+  int width() const { return levels[0].width; }
+  int height() const { return levels[0].height; }
+  int level_count() const { return int(levels.size()); }
+
+private:
+  static const int tile_size = 4;
+
+  struct texel {
+    float r, g, b;
+  };
+
+  struct level {
+    int width;
+    int height;
+    int tiles_across;
+    std::vector<texel> texels;
+
+    level(int width, int height)
+      : width(width), height(height),
+        tiles_across((width + tile_size - 1) / tile_size),
+        texels(
+          size_t(tiles_across) * ((height + tile_size - 1) / tile_size)
+            * tile_size * tile_size
+        ) {}
+
+    texel& at(int x, int y) {
+      return texels[index(x, y)];
+    }
+    const texel& at(int x, int y) const {
+      return texels[index(x, y)];
+    }
+
+    size_t index(int x, int y) const {
+      const size_t tile = size_t(y / tile_size) * tiles_across + x / tile_size;
+      return tile * tile_size * tile_size
+        + (y % tile_size) * tile_size + x % tile_size;
+    }
+  };
+
+  // The bilinear lookup of (u, v) in a level, repeating the image.
+  color bilinear(const level& l, real u, real v) const;
+
+  std::vector<level> levels;
+};
+
+image_texture::image_texture(
+  int width, int height, const std::vector<color>& pixels
+) : texture(true) {
+  levels.emplace_back(width, height);
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      const color& c = pixels[size_t(y) * width + x];
+      levels[0].at(x, y) = {float(c.x()), float(c.y()), float(c.z())};
+    }
+  }
+
+  // Every level halves the one above, rounding down, and averages its
+  // texels 2 x 2; the last row or column of an odd size is left out.
+  while (levels.back().width > 1 || levels.back().height > 1) {
+    const level& above = levels.back();
+    level below(std::max(1, above.width / 2), std::max(1, above.height / 2));
+    for (int y = 0; y < below.height; ++y) {
+      for (int x = 0; x < below.width; ++x) {
+        const int x0 = std::min(2 * x, above.width - 1);
+        const int x1 = std::min(2 * x + 1, above.width - 1);
+        const int y0 = std::min(2 * y, above.height - 1);
+        const int y1 = std::min(2 * y + 1, above.height - 1);
+        const texel* t[4] = {
+          &above.at(x0, y0), &above.at(x1, y0), &above.at(x0, y1), &above.at(x1, y1)
+        };
+        below.at(x, y) = {
+          (t[0]->r + t[1]->r + t[2]->r + t[3]->r) / 4,
+          (t[0]->g + t[1]->g + t[2]->g + t[3]->g) / 4,
+          (t[0]->b + t[1]->b + t[2]->b + t[3]->b) / 4
+        };
+      }
+    }
+    levels.push_back(std::move(below));
+  }
+}
+
+color image_texture::value(const hit_record& hit) const {
+  // The footprint covers footprint * uv_scale of the texture's unit square,
+  // which is that many times the size of the image in texels of level 0;
+  // level n has texels 2^n times as wide.
+  const real texels = hit.footprint * hit.uv_scale
+    * std::sqrt(real(width()) * real(height()));
+  const real lod = texels > 1 ? std::log2(texels) : 0;
+  const real last = real(levels.size() - 1);
+  if (lod >= last) {
+    return bilinear(levels.back(), hit.u, hit.v);
+  }
+  const int fine = int(lod);
+  const real blend = lod - fine;
+  const color c = bilinear(levels[fine], hit.u, hit.v);
+  if (blend == 0) {
+    return c;
+  }
+  return (1 - blend) * c + blend * bilinear(levels[fine + 1], hit.u, hit.v);
+}
+
+color image_texture::bilinear(const level& l, real u, real v) const {
+  // Texel centers are at half-integer coordinates.
+  const real x = (u - std::floor(u)) * l.width - real(0.5);
+  const real y = (v - std::floor(v)) * l.height - real(0.5);
+  const real fx = std::floor(x);
+  const real fy = std::floor(y);
+  const real ax = x - fx;
+  const real ay = y - fy;
+  auto wrap = [](int n, int size) {
+    n %= size;
+    return n < 0 ? n + size : n;
+  };
+  const int x0 = wrap(int(fx), l.width);
+  const int x1 = wrap(x0 + 1, l.width);
+  const int y0 = wrap(int(fy), l.height);
+  const int y1 = wrap(y0 + 1, l.height);
+  auto get = [&](int tx, int ty) {
+    const texel& t = l.at(tx, ty);
+    return color(t.r, t.g, t.b);
+  };
+  return (1 - ay) * ((1 - ax) * get(x0, y0) + ax * get(x1, y0))
+    + ay * ((1 - ax) * get(x0, y1) + ax * get(x1, y1));
+}
+
+#endif
@@ -0,0 +1,299 @@
+#ifndef IMAGE_WRITER_H
+#define IMAGE_WRITER_H
+
+#include "common.h"
+
+#include "trace.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// The file formats image_writer writes:
+//
+//   ppm: binary PPM (P6), 8 bits per channel, gamma 2 like write_color.
+//   pfm: PFM, a 32-bit float per channel, linear, little-endian.
+//   png: 16 bits per channel, gamma 2. The image data isn't compressed
+//        (stored deflate blocks), so that no library is needed.
+enum class image_format { ppm, pfm, png };
+
+// Picks the format from the extension of path (".pfm" or ".png"); anything
+// else is ppm.
+inline image_format image_format_for(const char* path) {
+  size_t length = std::strlen(path);
+  if (length >= 4 && std::strcmp(path + length - 4, ".pfm") == 0) {
+    return image_format::pfm;
+  }
+  if (length >= 4 && std::strcmp(path + length - 4, ".png") == 0) {
+    return image_format::png;
+  }
+  return image_format::ppm;
+}
+
+// Writes an image to a stream from a thread of its own, while it's being
+// rendered. The renderer hands over rows as they're finished, in whatever
+// order, with add_rows; that only records where they are and returns. The
+// writer thread waits for the next row in file order, converts it into a
+// buffer allocated once, and writes it; rows that arrive ahead of it are
+// held until then (a reorder buffer of pointers, so nothing is copied).
+//
+// The pixels are accumulated colors, summed over samples_per_pixel samples,
+// with row 0 at the bottom, like in framebuffer.
+class image_writer {
+public:
+  image_writer(
+    std::ostream& out, image_format format, int width, int height,
+    int samples_per_pixel
+  ) : out(out), format(format), width(width), height(height),
+      scale(1.0 / samples_per_pixel), rows(size_t(height), nullptr) {
+    thread = std::thread([this] { write_rows(); });
+  }
+
+  image_writer(const image_writer&) = delete;
+  image_writer& operator=(const image_writer&) = delete;
+
+  ~image_writer() {
+    finish();
+  }
+
+  // Hands over rows [y0, y1), which are width pixels each and start at
+  // pixels. They must stay valid and unchanged until finish returns. Can be
+  // called from any thread.
+  void add_rows(int y0, int y1, const color* pixels) {
+    RT_TRACE_ZONE_ARGS("hand rows to writer", "y0", y0, "y1", y1);
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      for (int j = y0; j < y1; ++j) {
+        rows[j] = pixels + size_t(j - y0) * width;
+      }
+    }
+    row_added.notify_one();
+  }
+
+  // Waits until every row is written. Every row must have been added.
+  void finish() {
+    RT_TRACE_ZONE("wait for writer");
+    if (thread.joinable()) {
+      thread.join();
+      out.flush();
+    }
+  }
+
+private:
+  void write_rows();
+  void write_header();
+  void write_row(const color* row, bool last);
+
+  // PNG pieces.
+  void write_png_chunk(const char* type, const unsigned char* data, size_t size);
+  void write_png_data(const unsigned char* data, size_t size, bool last);
+
+  // Gamma 2, like write_color.
+  double encode(double c) const {
+    return sqrt(clamp(c * scale, 0.0, 1.0));
+  }
+
+  std::ostream& out;
+  const image_format format;
+  const int width;
+  const int height;
+  const double scale;
+
+  std::mutex lock;
+  std::condition_variable row_added;
+  // The rows added so far, by j; null until added.
+  std::vector<const color*> rows;
+  std::thread thread;
+
+  // A row converted to the file's format.
+  std::vector<unsigned char> buffer;
+  // The zlib stream of a PNG: its checksum so far, and the bytes that aren't
+  // in an IDAT chunk yet.
+  uint32_t adler_a = 1, adler_b = 0;
+  std::vector<unsigned char> png_data;
+};
+
+// PNG's CRC-32 (ISO 3309), over data, continuing from crc.
+inline uint32_t png_crc32(uint32_t crc, const unsigned char* data, size_t size) {
+  static const std::vector<uint32_t> table = [] {
+    std::vector<uint32_t> t(256);
+    for (uint32_t n = 0; n < 256; ++n) {
+      uint32_t c = n;
+      for (int k = 0; k < 8; ++k) {
+        c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+      }
+      t[n] = c;
+    }
+    return t;
+  }();
+
+  crc = ~crc;
+  for (size_t n = 0; n < size; ++n) {
+    crc = table[(crc ^ data[n]) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+void image_writer::write_rows() {
+  RT_TRACE_ONLY(trace_thread_name("image writer"));
+  write_header();
+
+  // PFM stores the bottom row first, the others the top one.
+  for (int n = 0; n < height; ++n) {
+    int j = format == image_format::pfm ? n : height - 1 - n;
+    const color* row;
+    {
+      RT_TRACE_ZONE_ARGS("wait for row", "y", j, nullptr, 0);
+      std::unique_lock<std::mutex> guard(lock);
+      row_added.wait(guard, [&] { return rows[j] != nullptr; });
+      row = rows[j];
+    }
+    RT_TRACE_ZONE_ARGS("write row", "y", j, nullptr, 0);
+    write_row(row, n == height - 1);
+  }
+
+  if (!out) {
+    std::cerr << "Failed to write the image.\n";
+  }
+}
+
+void image_writer::write_header() {
+  switch (format) {
+  case image_format::ppm:
+    out << "P6\n" << width << " " << height << "\n255\n";
+    buffer.resize(size_t(width) * 3);
+    break;
+  case image_format::pfm:
+    // A negative scale means little-endian.
+    out << "PF\n" << width << " " << height << "\n-1.0\n";
+    buffer.resize(size_t(width) * 3 * sizeof(float));
+    break;
+  case image_format::png: {
+    static const unsigned char signature[] = {
+      0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'
+    };
+    out.write(reinterpret_cast<const char*>(signature), sizeof(signature));
+    unsigned char header[13] = {
+      (unsigned char)(width >> 24), (unsigned char)(width >> 16),
+      (unsigned char)(width >> 8), (unsigned char)width,
+      (unsigned char)(height >> 24), (unsigned char)(height >> 16),
+      (unsigned char)(height >> 8), (unsigned char)height,
+      // 16 bits per channel, RGB, deflate, standard filters, no interlacing.
+      16, 2, 0, 0, 0
+    };
+    write_png_chunk("IHDR", header, sizeof(header));
+    // The zlib header: deflate with a 32K window, no dictionary.
+    png_data = {0x78, 0x01};
+    // Every row starts with its filter type, 0 (none).
+    buffer.resize(1 + size_t(width) * 3 * 2);
+    break;
+  }
+  }
+}
+
+void image_writer::write_row(const color* row, bool last) {
+  unsigned char* p = buffer.data();
+  switch (format) {
+  case image_format::ppm:
+    for (int i = 0; i < width; ++i) {
+      for (int a = 0; a < 3; ++a) {
+        *p++ = static_cast<unsigned char>(256 * std::min(encode(row[i][a]), 0.999));
+      }
+    }
+    out.write(reinterpret_cast<const char*>(buffer.data()), buffer.size());
+    break;
+  case image_format::pfm:
+    for (int i = 0; i < width; ++i) {
+      for (int a = 0; a < 3; ++a) {
+        float f = float(row[i][a] * scale);
+        uint32_t bits;
+        std::memcpy(&bits, &f, sizeof(bits));
+        for (int b = 0; b < 4; ++b) {
+          *p++ = static_cast<unsigned char>(bits >> (8 * b));
+        }
+      }
+    }
+    out.write(reinterpret_cast<const char*>(buffer.data()), buffer.size());
+    break;
+  case image_format::png:
+    *p++ = 0;
+    for (int i = 0; i < width; ++i) {
+      for (int a = 0; a < 3; ++a) {
+        auto v = static_cast<uint16_t>(65535 * encode(row[i][a]) + 0.5);
+        *p++ = static_cast<unsigned char>(v >> 8);
+        *p++ = static_cast<unsigned char>(v);
+      }
+    }
+    write_png_data(buffer.data(), buffer.size(), last);
+    break;
+  }
+}
+
+void image_writer::write_png_chunk(
+  const char* type, const unsigned char* data, size_t size
+) {
+  auto put32 = [&](uint32_t v) {
+    char bytes[4] = {char(v >> 24), char(v >> 16), char(v >> 8), char(v)};
+    out.write(bytes, 4);
+  };
+  put32(uint32_t(size));
+  out.write(type, 4);
+  out.write(reinterpret_cast<const char*>(data), size);
+  uint32_t crc = png_crc32(0, reinterpret_cast<const unsigned char*>(type), 4);
+  put32(png_crc32(crc, data, size));
+}
+
+// Adds data to the zlib stream as stored blocks, and writes the stream out in
+// IDAT chunks of about 64K as it grows. The last call ends the stream, with
+// its Adler-32 checksum, and the image.
+void image_writer::write_png_data(
+  const unsigned char* data, size_t size, bool last
+) {
+  const size_t max_block = 65535;
+  // 5552 bytes is the most that can be summed before b may overflow.
+  for (size_t first = 0; first < size; first += 5552) {
+    size_t last_byte = std::min(size, first + 5552);
+    for (size_t n = first; n < last_byte; ++n) {
+      adler_a += data[n];
+      adler_b += adler_a;
+    }
+    adler_a %= 65521;
+    adler_b %= 65521;
+  }
+
+  while (size > 0 || last) {
+    size_t block = std::min(size, max_block);
+    bool final_block = last && block == size;
+    png_data.push_back(final_block ? 1 : 0);
+    png_data.push_back(static_cast<unsigned char>(block));
+    png_data.push_back(static_cast<unsigned char>(block >> 8));
+    png_data.push_back(static_cast<unsigned char>(~block));
+    png_data.push_back(static_cast<unsigned char>(~block >> 8));
+    png_data.insert(png_data.end(), data, data + block);
+    data += block;
+    size -= block;
+    if (final_block) {
+      break;
+    }
+  }
+
+  if (last) {
+    for (int shift = 24; shift >= 0; shift -= 8) {
+      png_data.push_back(static_cast<unsigned char>((adler_b << 16 | adler_a) >> shift));
+    }
+  }
+  if (last || png_data.size() >= max_block) {
+    write_png_chunk("IDAT", png_data.data(), png_data.size());
+    png_data.clear();
+  }
+  if (last) {
+    write_png_chunk("IEND", nullptr, 0);
+  }
+}
+
+#endif
@@ -0,0 +1,109 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "common.h"
+
+#include "aabb.h"
+#include "hittable.h"
+#include "material.h"
+#include "transform.h"
+
+#include <cmath>
+
+// A copy of some geometry somewhere else: the geometry, with whatever
+// accelerator it has of its own (a triangle_mesh, a sphere_set, a bvh8 of
+// several objects...), is shared by every instance of it, and an instance is
+// only a pointer to it and a transform, a couple of hundred bytes however
+// big the geometry is. A forest is one tree and an instance per tree, with an
+// accelerator over the instances (e.g. a bvh8 over a list of them) as the
+// top level.
+//
+// A ray is intersected with an instance by taking it into the geometry's own
+// space, where the geometry's accelerator does the work. The direction is
+// transformed without normalizing it, so t means the same in both spaces.
+// Hits are turned back into world space only for the closest one, in
+// finish_hit.
+//
+// The geometry can't itself be, or hold, an instance: a hit only remembers
+// one level of them (see ray_hit::instanced).
+class instance : public hittable {
+public:
+  // to_world takes the geometry's space to the world's; it must not be
+  // singular.
+  instance(const hittable* geometry, const transform& to_world)
+    : geometry(geometry), to_world(to_world),
+      to_object(to_world.inverse()),
+      length_scale(std::cbrt(std::fabs(to_world.determinant()))) {}
+
+  virtual bool
+    intersect(const ray& r, real t_min, real t_max, ray_hit& hit) const;
+
+  virtual void
+    finish_hit(const ray& r, const ray_hit& hit, hit_record& rec) const;
+
+  virtual bool bounding_box(aabb& output_box) const;
+
+  // Owned by the scene (see scene_arena.h).
+  const hittable* geometry;
+  transform to_world;
+  transform to_object;
+  // How much to_world scales lengths, on average over the directions.
+  real length_scale;
+
+private:
+  ray object_ray(const ray& r) const {
+    return ray(to_object.point(r.origin()), to_object.vector(r.direction()));
+  }
+};
+
+bool instance::intersect(const ray& r, real t_min, real t_max, ray_hit& hit)
+  const {
+  ray_hit local;
+  if (!geometry->intersect(object_ray(r), t_min, t_max, local)) {
+    return false;
+  }
+  hit = {this, local.t, local.primitive, local.exterior, local.object};
+  return true;
+}
+
+void instance::finish_hit(const ray& r, const ray_hit& hit, hit_record& rec)
+  const {
+  const ray_hit local = {
+    hit.instanced, hit.t, hit.primitive, hit.exterior, nullptr
+  };
+  hit.instanced->finish_hit(object_ray(r), local, rec);
+
+  // Transforming the point adds its own rounding to that of the geometry.
+  // The normal goes through the inverse transpose, which keeps the sign of
+  // its dot product with the ray, so it still faces the same way.
+  vec3 error;
+  rec.p = to_world.point(rec.p, rec.p_error, error);
+  rec.p_error = error;
+  rec.normal = unit_vector(to_object.transposed_vector(rec.normal));
+  if (rec.material && rec.material->needs_uv) {
+    rec.uv_scale /= length_scale;
+  }
+}
+
+bool instance::bounding_box(aabb& output_box) const {
+  aabb box;
+  if (!geometry->bounding_box(box)) {
+    return false;
+  }
+  // The box around the transformed corners of the geometry's box, and their
+  // rounding errors.
+  output_box = aabb();
+  for (int corner = 0; corner < 8; ++corner) {
+    point3 p(
+      corner & 1 ? box.max().x() : box.min().x(),
+      corner & 2 ? box.max().y() : box.min().y(),
+      corner & 4 ? box.max().z() : box.min().z()
+    );
+    vec3 error;
+    p = to_world.point(p, vec3(0, 0, 0), error);
+    output_box.grow(aabb(p - error, p + error));
+  }
+  return true;
+}
+
+#endif
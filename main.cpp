@@ -1,105 +1,295 @@
-#include <iostream>
+#include "common.h"
+
+#include "bvh.h"
+#include "bvh8.h"
+#include "hittable_list.h"
 #include "sphere.h"
-#include "hitable_list.h"
-#include "float.h"
+#include "sphere_set.h"
 #include "camera.h"
 #include "material.h"
+#include "path_tracer.h"
+#include "progressive.h"
+#include "renderer.h"
+#include "sampler.h"
+#include "scene_arena.h"
+#include "scene_binary.h"
+#include "scene_file.h"
+#include "scenes.h"
+#include "stats.h"
+#include "trace.h"
+#include "wavefront.h"
 
-vec3 color(const ray& r, hitable *world, int depth) {
-  hit_record rec;
-  // t_min=0.0 discards intersection points of objects that are behind the camera.
-  // t_min=0.001 also discards reflected rays whose origin is not exactly t=0, but some floating point approximation of it.
-  // Those rays cause a problem called shadow acne: The reflected ray intersects its origin surface: This extra bounce will
-  // half the origin point's color, causing it to appear darker than the surrounding points.
-  if (world->hit(r, 0.001, MAXFLOAT, rec)) {
-    ray scattered;
-    vec3 attenuation;
-    if (depth < 50 && rec.mat_ptr->scatter(r, rec, attenuation, scattered)) {
-      // Recursively trace the ray until it doesn't hit anything, attenuating the color each time it bounces.
-      // The color of a hitpoint whose ray bounces too many times tends to black.
-      return attenuation * color(scattered, world, depth+1);
-    }
-    return vec3(0,0,0);
-  } 
-  vec3 unit_direction = unit_vector(r.direction());
-  float t = 0.5 * (unit_direction.y() + 1.0);
-  return (1.0 - t)*vec3(1.0, 1.0, 1.0) + t*vec3(0.5, 0.7, 1.0);
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+// The accelerator is picked on the command line ("list", "bvh", "bvh8" or
+// "spheres"), so that they can be compared on the same scene. The first three
+// give the same image; "spheres" rounds spheres to float (see sphere_set.h),
+// which can change a few pixels where real is double.
+hittable* make_accelerator(
+  const char* name, const hittable_list& scene, scene_arena& arena
+) {
+  if (std::strcmp(name, "list") == 0) {
+    return arena.make<hittable_list>(scene);
+  }
+  if (std::strcmp(name, "bvh") == 0) {
+    return arena.make<bvh_node>(scene, arena);
+  }
+  if (std::strcmp(name, "spheres") == 0) {
+    auto spheres = arena.make<sphere_set>(scene);
+    spheres->build();
+    return spheres;
+  }
+  return arena.make<bvh8>(scene);
+}
+
+// The sample sequence is picked on the command line too ("random", "halton",
+// "sobol" or "bluenoise").
+sample_sequence sequence_named(const char* name) {
+  sample_sequence sequence = sample_sequence::sobol;
+  sample_sequence_named(name, sequence);
+  return sequence;
+}
+
+#if defined(RT_STATS)
+// Writes what the render counted (see stats.h) next to the image, to
+// output.stats.json, or to the standard error if the image went to the
+// standard output.
+void write_stats(const std::string& output) {
+  render_stats stats = collect_stats();
+  if (output == "-") {
+    stats.write_json(std::cerr);
+    return;
+  }
+  std::ofstream file(output + ".stats.json");
+  if (!file) {
+    std::cerr << "Can't write " << output << ".stats.json.\n";
+    return;
+  }
+  stats.write_json(file);
+}
+#endif
+
+#if defined(RT_TRACE)
+// Writes the timeline of the render (see trace.h) next to the image, to
+// output.trace.json, or to trace.json if the image went to the standard
+// output.
+void write_timeline(const std::string& output) {
+  const std::string path = output == "-" ? "trace.json" : output + ".trace.json";
+  std::ofstream file(path);
+  if (!file) {
+    std::cerr << "Can't write " << path << ".\n";
+    return;
+  }
+  write_trace(file);
 }
+#endif
+
+// Renders in passes, and writes the image so far to output after every pass,
+// and a checkpoint to output.checkpoint every minute. A render that finds the
+// checkpoint of the same image resumes from it. error_threshold turns on
+// adaptive sampling (see progressive_settings).
+int render_progressively(
+  renderer& tile_renderer, const camera& cam, const hittable& world,
+  int max_depth, const std::string& output, double error_threshold
+) {
+  if (output == "-") {
+    std::cerr << "A progressive render needs an output file.\n";
+    return 1;
+  }
+  const render_settings& settings = tile_renderer.settings;
+
+  progressive_settings passes;
+  passes.checkpoint_path = output + ".checkpoint";
+  passes.error_threshold = error_threshold;
+  accumulation_buffer acc(
+    settings.image_width, settings.image_height, settings.seed,
+    settings.sequence
+  );
+  if (acc.load(passes.checkpoint_path)) {
+    std::cerr << "Resuming after pass " << acc.passes_done << ".\n";
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  path_tracer<decltype(&sky)> integrator(world, &sky);
+  integrator.max_depth = max_depth;
+  integrator.cone_spread = cam.pixel_spread(settings.image_height);
+  render_progressive(tile_renderer, cam, world,
+    [&](const ray& r, bool hit, const hit_record& rec, sampler& s) {
+      return integrator.radiance(r, hit, rec, s);
+    },
+    passes, acc,
+    [&](const accumulation_buffer& acc) {
+      // Through a temporary file, so that the image is never half written.
+      const std::string temporary = output + ".tmp";
+      {
+        std::ofstream file(temporary, std::ios::binary);
+        acc.resolve().write(file, image_format_for(output.c_str()), 1);
+      }
+      std::rename(temporary.c_str(), output.c_str());
+      std::cerr << "\rPass " << acc.passes_done << " written after "
+        << std::chrono::duration<double>(
+          std::chrono::steady_clock::now() - start
+        ).count()
+        << " s.\n";
+    }
+  );
 
-hitable *random_scene() {
-  int n = 0;
-  hitable **list = new hitable*[n+1];
-
-  texture *checker = new checker_texture(new constant_texture(vec3(102/255,51/255,153/255)), new constant_texture(vec3(0.9,0.9,0.9)));
-  list[0] = new sphere(vec3(0,-1000,0), 1000, new lambertian(checker));
-  
-  int i = 1;
-  // for (int a = -11; a < 11; a++) {
-  //   for (int b = -11; b < 11; b++) {
-  //     float choose_mat = drand48();
-  //     vec3 center(a+0.9*drand48(), 0.2, b+0.9*drand48());
-  //     if ((center-vec3(4,0.2,0)).length() > 0.9) {
-  //       if (choose_mat < 0.8) {
-  //         // Diffuse.
-  //         list[i++] = new sphere(center, 0.2, new lambertian(new constant_texture(vec3(drand48()*drand48(),drand48()*drand48(),drand48()*drand48()))));
-  //       } else if (choose_mat < 0.95) {
-  //         // Metal.
-  //         list[i++] = new sphere(center, 0.2, new metal(vec3(0.5*(1+drand48()), 0.5*(1+drand48()), 0.5*(1+drand48())), 0.5*drand48()));
-  //       } else {
-  //         // Glass.
-  //         list[i++] = new sphere(center, 0.2, new dielectric(1.5));
-  //       }
-  //     }
-  //   }
-  // }
-
-  list[i++] = new sphere(vec3(0, 1, 0), 1.0, new dielectric(1.5));
-  list[i++] = new sphere(vec3(-4, 1,0), 1.0, new lambertian(new constant_texture(vec3(0.4, 0.2, 0.1))));
-  list[i++] = new sphere(vec3(4, 1, 0), 1.0, new metal(vec3(0.7, 0.6, 0.5), 0.0));
-  
-  return new hitable_list(list, i);
+  double samples = 0;
+  for (uint32_t n : acc.samples) {
+    samples += n;
+  }
+  std::cerr << "Done, " << samples / acc.samples.size()
+    << " samples per pixel on average.\n";
+  RT_STAT(write_stats(output));
+  RT_TRACE_ONLY(write_timeline(output));
+  return 0;
 }
 
-int main() {
+int main(int argc, char** argv) {
   int nx = 1280;
   int ny = 720;
   // Number of antialiasing samples.
   int ns = 100;
-  std::cout << "P3\n" << nx << " " << ny << "\n255\n";
-
-  hitable *world = random_scene();
-
-  vec3 lookfrom(0,1,4);
-  vec3 lookat(0,0,0);
-  float dist_to_focus = (lookfrom-lookat).length();
-  float aperture = 0.0;
-  camera cam(lookfrom, lookat, vec3(0,1,0), 90, float(nx)/float(ny), aperture, dist_to_focus);
-
-  for (int j = ny-1; j >= 0; j--) {
-    for (int i = 0; i < nx; i++) {
-      vec3 col(0, 0, 0);
-
-      for (int s=0; s < ns; s++) {
-        // Pixel sample. At the image level, pixel coordinates are discrete, e.g. (1,5) or (1079,35).
-        // At the scene level, though, a pixel covers a frustum volume of unit-length base. Here, (i,j) is
-        // the lower left corner of that base, which extends continuously to (i+1,j+1). The sample is taken
-        // from within the base, uniformly at random from (i,j) to (i+1,j+1). The frustum may enclose 
-        // portions of multiple objects of the scene; therefore, samples may pick the color of different
-        // objects.
-        float u = float(i + drand48()) / float(nx);
-        float v = float(j + drand48()) / float(ny);
-        ray r = cam.get_ray(u, v);
-        col += color(r, world, 0);
-      }
 
-      // Average of pixel color samples.
-      col /= float(ns);
-      // Gamma correction.
-      col = vec3(sqrt(col[0]), sqrt(col[1]), sqrt(col[2]));
-      int ir = int(255.99*col[0]);
-      int ig = int(255.99*col[1]);
-      int ib = int(255.99*col[2]);
-      std::cout << ir << " " << ig << " " << ib << "\n";
+  // The scene is read from the scene file given after the sequence (see
+  // scene_file.h), if there's one, with the camera and the render settings it
+  // has; otherwise it's the book's final scene. The settings above and on the
+  // command line are the ones the file doesn't set. A binary scene (.rtscene,
+  // see scene_binary.h) is mapped instead of read; it sets every setting, and
+  // comes with its own sphere_set, so the accelerator is ignored.
+  //
+  // The grid has close to 500 spheres; a BVH tests a handful of them per ray
+  // instead of all of them. The arena owns the spheres, their materials and
+  // the accelerator, and frees them all at the end.
+  RT_TRACE_ONLY(trace_thread_name("main"));
+  scene_arena arena;
+  scene_description scene;
+  scene.settings.image_width = nx;
+  scene.settings.image_height = ny;
+  scene.settings.samples_per_pixel = ns;
+  scene.settings.sequence = sequence_named(argc > 4 ? argv[4] : "sobol");
+  hittable* world = nullptr;
+  if (argc > 5 && is_binary_scene(argv[5])) {
+    world = map_binary_scene(argv[5], arena, scene);
+    if (!world) {
+      return 1;
+    }
+  } else if (argc > 5) {
+    if (!load_scene(argv[5], arena, scene)) {
+      return 1;
+    }
+  } else {
+    RT_TRACE_ZONE("build scene");
+    scene.world = random_scene(arena);
+  }
+  if (argc > 5) {
+    nx = scene.settings.image_width;
+    ny = scene.settings.image_height;
+    ns = scene.settings.samples_per_pixel;
+  }
+  if (!world) {
+    world = make_accelerator(argc > 1 ? argv[1] : "bvh8", scene.world, arena);
+  }
+  // "path" follows every sample's path to its end before the next one;
+  // "wavefront" advances all the samples of a tile one bounce at a time;
+  // "progressive" renders like "path", in passes over the whole image (see
+  // render_progressive); "adaptive" too, but stops sampling the pixels that
+  // have converged, and lets the noisy ones take up to 4 times as many
+  // samples. "adaptive=t" sets the error they converge at to t, instead of
+  // the scene's error_threshold.
+  const char* mode = argc > 2 ? argv[2] : "path";
+  bool wavefront = std::strcmp(mode, "wavefront") == 0;
+  bool adaptive = std::strncmp(mode, "adaptive", 8) == 0
+    && (mode[8] == '\0' || mode[8] == '=');
+  if (adaptive && mode[8] == '=') {
+    char* end;
+    scene.error_threshold = std::strtod(mode + 9, &end);
+    if (end == mode + 9 || *end != '\0' || !(scene.error_threshold > 0)) {
+      std::cerr << "Bad error threshold in " << mode << ".\n";
+      return 1;
+    }
+  }
+  bool progressive = adaptive || std::strcmp(mode, "progressive") == 0;
+  // The image goes to this file, in the format of its extension (.ppm, .pfm
+  // or .png), or to the standard output as a binary PPM if it's "-".
+  const char* output = argc > 3 ? argv[3] : "-";
+
+  point3 lookfrom(0,1,4);
+  point3 lookat(0,0,0);
+  double dist_to_focus = (lookfrom-lookat).length();
+  double aperture = 0.0;
+  camera cam = scene.cam ? *scene.cam
+    : camera(lookfrom, lookat, vec3(0,1,0), 90, double(nx)/double(ny), aperture, dist_to_focus);
+
+  // Pixel sample. At the image level, pixel coordinates are discrete, e.g. (1,5) or (1079,35).
+  // At the scene level, though, a pixel covers a frustum volume of unit-length base. Here, (i,j) is
+  // the lower left corner of that base, which extends continuously to (i+1,j+1). The renderer takes
+  // the sample from within the base, uniformly at random from (i,j) to (i+1,j+1). The frustum may
+  // enclose portions of multiple objects of the scene; therefore, samples may pick the color of
+  // different objects.
+  render_settings settings = scene.settings;
+  settings.samples_per_pixel = adaptive ? 4 * ns : ns;
+  renderer tile_renderer(settings);
+
+  if (progressive) {
+    return render_progressively(
+      tile_renderer, cam, *world, scene.max_depth, output,
+      adaptive ? scene.error_threshold : 0.0
+    );
+  }
+
+  std::ofstream file;
+  if (std::strcmp(output, "-") != 0) {
+    file.open(output, std::ios::binary);
+    if (!file) {
+      std::cerr << "Can't open " << output << ".\n";
+      return 1;
     }
   }
-}
\ No newline at end of file
+  // Rows are written as soon as they're rendered, from a thread of their own.
+  image_writer writer(
+    file.is_open() ? file : std::cout, image_format_for(output), nx, ny, ns
+  );
+  tile_renderer.writer = &writer;
+
+  auto start = std::chrono::steady_clock::now();
+  // The render's pixels, which the writer reads until finish returns.
+  framebuffer image(0, 0);
+  size_t rays = 0;
+  if (wavefront) {
+    wavefront_integrator<decltype(&sky)> integrator(cam, *world, &sky);
+    integrator.max_depth = scene.max_depth;
+    integrator.cone_spread = cam.pixel_spread(ny);
+    image = integrator.render(tile_renderer);
+    rays = integrator.rays_traced;
+  } else {
+    path_tracer<decltype(&sky)> integrator(*world, &sky);
+    integrator.max_depth = scene.max_depth;
+    integrator.cone_spread = cam.pixel_spread(ny);
+    // Camera rays are traced in packets; bounces one at a time.
+    image = tile_renderer.render(cam, *world,
+      [&](const ray& r, bool hit, const hit_record& rec, sampler& s) {
+        return integrator.radiance(r, hit, rec, s);
+      }
+    );
+  }
+  writer.finish();
+  double seconds = std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - start
+  ).count();
+
+  std::cerr << "\nDone in " << seconds << " s, "
+    << double(nx) * ny * ns / seconds << " samples/s";
+  if (rays) {
+    std::cerr << ", " << rays / seconds << " rays/s";
+  }
+  std::cerr << ".\n";
+  RT_STAT(write_stats(output));
+  RT_TRACE_ONLY(write_timeline(output));
+}
@@ -0,0 +1,212 @@
+#include "common.h"
+
+#include "bvh.h"
+#include "bvh8.h"
+#include "camera.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "scene_arena.h"
+#include "sphere.h"
+#include "sphere_set.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+// Compares tracing rays against a hittable_list, a bvh_node, a bvh8 and a
+// sphere_set built over the same spheres, for scenes of increasing size.
+//
+// The spheres fill a cube whose side grows with the cube root of their count,
+// so the density (and the number of spheres a ray goes through before it hits
+// one) stays about the same in all scenes. Rays start outside the cube and
+// point at random spots inside it.
+//
+// A second table compares tracing camera rays one at a time and in packets of
+// 8 samples of the same pixel, with the accelerators that have a packet
+// traversal.
+
+using bench_clock = std::chrono::steady_clock;
+
+double seconds_since(bench_clock::time_point start) {
+  return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+hittable_list sphere_field(size_t count, double side, scene_arena& arena) {
+  hittable_list world;
+  auto mat = arena.make<lambertian>(color(0.5, 0.5, 0.5));
+  for (size_t n = 0; n < count; ++n) {
+    point3 center = side * vec3::random(-0.5, 0.5);
+    double radius = random_double(0.2, 0.5);
+    world.add(arena.make<sphere>(center, radius, mat->albedo, mat->albedo, mat));
+  }
+  return world;
+}
+
+std::vector<ray> random_rays(size_t count, double side) {
+  std::vector<ray> rays;
+  rays.reserve(count);
+  for (size_t n = 0; n < count; ++n) {
+    point3 origin = 2.0 * side * unit_vector(vec3::random(-1.0, 1.0));
+    point3 target = side * vec3::random(-0.5, 0.5);
+    rays.push_back(ray(origin, target - origin));
+  }
+  return rays;
+}
+
+// Returns rays per second. Stops early, after at least min_rays, if the
+// budget runs out, so that the list doesn't take hours on the big scenes.
+double trace(
+  const hittable& world, const std::vector<ray>& rays, size_t min_rays,
+  double budget_seconds, size_t& hits
+) {
+  hits = 0;
+  auto start = bench_clock::now();
+  size_t n = 0;
+  for (; n < rays.size(); ++n) {
+    hit_record rec;
+    if (world.hit(rays[n], 0.001, infinity, rec)) {
+      ++hits;
+    }
+    if (n >= min_rays && (n & 63) == 0 && seconds_since(start) > budget_seconds) {
+      break;
+    }
+  }
+  return n / seconds_since(start);
+}
+
+// Traces samples_per_pixel camera rays through every pixel of a width x width
+// image, one at a time or a ray_packet at a time. Returns rays per second.
+double trace_camera(
+  const hittable& world, const camera& cam, int width, int samples_per_pixel,
+  bool packets, size_t& hits
+) {
+  hits = 0;
+  auto start = bench_clock::now();
+  for (int j = 0; j < width; ++j) {
+    for (int i = 0; i < width; ++i) {
+      for (int s0 = 0; s0 < samples_per_pixel; s0 += ray_packet_size) {
+        double u[ray_packet_size], v[ray_packet_size];
+        vec3 lens[ray_packet_size];
+        for (int k = 0; k < ray_packet_size; ++k) {
+          u[k] = (i + random_double()) / width;
+          v[k] = (j + random_double()) / width;
+          sampler independent(thread_rng());
+          lens[k] = cam.sample_lens(independent);
+          thread_rng() = independent.stream;
+        }
+        ray_packet packet;
+        cam.get_rays(ray_packet_size, u, v, lens, packet);
+
+        hit_record rec[ray_packet_size];
+        if (packets) {
+          hits += __builtin_popcount(world.hit_packet(packet, 0.001, infinity, rec));
+          continue;
+        }
+        for (int k = 0; k < ray_packet_size; ++k) {
+          if (world.hit(packet.get(k), 0.001, infinity, rec[k])) {
+            ++hits;
+          }
+        }
+      }
+    }
+  }
+  return double(width) * width * samples_per_pixel / seconds_since(start);
+}
+
+void compare_packets(size_t max_count) {
+  const int width = 256;
+  const int samples_per_pixel = 8;
+
+  std::printf(
+    "\n%10s %15s %15s %15s %15s\n", "spheres", "bvh8 (rays/s)",
+    "packet (rays/s)", "set (rays/s)", "packet (rays/s)"
+  );
+
+  for (size_t count = 100; count <= max_count; count *= 100) {
+    thread_rng() = rng(count);
+    double side = 2.0 * std::cbrt(double(count));
+    scene_arena arena;
+    hittable_list world = sphere_field(count, side, arena);
+    bvh8 wide(world);
+    sphere_set spheres(world);
+    spheres.build();
+
+    camera cam(point3(0, 0, 1.5 * side), point3(0, 0, 0), vec3(0, 1, 0), 40, 1.0, 0.0, 1.0);
+    size_t hits[4];
+    double rates[4];
+    int n = 0;
+    for (const hittable* accelerator : {(const hittable*)&wide, (const hittable*)&spheres}) {
+      for (bool packets : {false, true}) {
+        // Same rays every time.
+        thread_rng() = rng(count);
+        rates[n] = trace_camera(*accelerator, cam, width, samples_per_pixel, packets, hits[n]);
+        ++n;
+      }
+    }
+    if (hits[0] != hits[1] || hits[0] != hits[2] || hits[0] != hits[3]) {
+      std::fprintf(
+        stderr, "Packets disagree: %zu, %zu, %zu and %zu hits\n",
+        hits[0], hits[1], hits[2], hits[3]
+      );
+    }
+
+    std::printf(
+      "%10zu %15.0f %15.0f %15.0f %15.0f\n",
+      count, rates[0], rates[1], rates[2], rates[3]
+    );
+  }
+}
+
+int main(int argc, char** argv) {
+  size_t max_count = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1000000;
+  const size_t ray_count = 200000;
+
+  std::printf(
+    "%10s %10s %10s %14s %14s %14s %14s %10s %10s\n",
+    "spheres", "bvh (ms)", "bvh8 (ms)", "list (rays/s)", "bvh (rays/s)",
+    "bvh8 (rays/s)", "set (rays/s)", "bvh (MB)", "bvh8 (MB)"
+  );
+
+  for (size_t count = 10; count <= max_count; count *= 10) {
+    thread_rng() = rng(count);
+    double side = 2.0 * std::cbrt(double(count));
+    scene_arena arena;
+    hittable_list world = sphere_field(count, side, arena);
+    std::vector<ray> rays = random_rays(ray_count, side);
+
+    // The nodes below the root are made in the arena, after the spheres.
+    size_t scene_bytes = arena.bytes_used();
+    auto start = bench_clock::now();
+    bvh_node bvh(world, arena);
+    double bvh_ms = 1000.0 * seconds_since(start);
+    size_t bvh_bytes = sizeof(bvh_node) + arena.bytes_used() - scene_bytes;
+
+    start = bench_clock::now();
+    bvh8 wide(world);
+    double bvh8_ms = 1000.0 * seconds_since(start);
+
+    sphere_set spheres(world);
+    spheres.build();
+
+    size_t list_hits, bvh_hits, bvh8_hits, set_hits;
+    double list_rate = trace(world, rays, 100, 2.0, list_hits);
+    double bvh_rate = trace(bvh, rays, ray_count, 0.0, bvh_hits);
+    double bvh8_rate = trace(wide, rays, ray_count, 0.0, bvh8_hits);
+    double set_rate = trace(spheres, rays, ray_count, 0.0, set_hits);
+    if (bvh_hits != bvh8_hits || bvh_hits != set_hits) {
+      std::fprintf(
+        stderr, "Accelerators disagree: %zu, %zu and %zu hits\n",
+        bvh_hits, bvh8_hits, set_hits
+      );
+    }
+
+    std::printf(
+      "%10zu %10.1f %10.1f %14.0f %14.0f %14.0f %14.0f %10.2f %10.2f\n",
+      count, bvh_ms, bvh8_ms, list_rate, bvh_rate, bvh8_rate, set_rate,
+      bvh_bytes / 1e6, wide.tree.memory_bytes() / 1e6
+    );
+  }
+
+  compare_packets(max_count);
+}
@@ -0,0 +1,60 @@
+#include "common.h"
+
+#include "scene_arena.h"
+#include "scene_binary.h"
+#include "scene_file.h"
+#include "sphere_set.h"
+#include "trace.h"
+
+#include <chrono>
+#include <iostream>
+
+// Turns a text scene (see scene_file.h) into a binary one (see
+// scene_binary.h): loads it, builds a sphere_set and its BVH8 over its
+// spheres, and saves them with the scene's settings and camera.
+//
+//   compile_scene input.scene output.rtscene
+//
+// The binary scene has every render setting, so the ones the text scene
+// doesn't set are saved as the raytracer's defaults, with the sobol
+// sequence. Objects other than spheres are left out.
+int main(int argc, char** argv) {
+  if (argc != 3) {
+    std::cerr << "Usage: " << argv[0] << " input.scene output.rtscene\n";
+    return 1;
+  }
+  RT_TRACE_ONLY(trace_thread_name("main"));
+  auto start = std::chrono::steady_clock::now();
+  auto seconds_since_start = [&] {
+    return std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start
+    ).count();
+  };
+
+  scene_arena arena;
+  scene_description scene;
+  scene.settings.image_width = 1280;
+  scene.settings.image_height = 720;
+  scene.settings.samples_per_pixel = 100;
+  if (!load_scene(argv[1], arena, scene)) {
+    return 1;
+  }
+  std::cerr << "Loaded " << scene.world.objects.size() << " objects in "
+    << seconds_since_start() << " s.\n";
+
+  sphere_set spheres(scene.world);
+  if (spheres.size() == 0) {
+    std::cerr << argv[1] << " has no spheres.\n";
+    return 1;
+  }
+  spheres.build();
+  std::cerr << "Built the tree of " << spheres.size() << " spheres after "
+    << seconds_since_start() << " s.\n";
+
+  if (!save_binary_scene(argv[2], spheres, scene)) {
+    return 1;
+  }
+  std::cerr << "Saved " << argv[2] << " after " << seconds_since_start()
+    << " s.\n";
+  return 0;
+}
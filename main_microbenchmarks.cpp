@@ -0,0 +1,385 @@
+#include "common.h"
+
+#include "bvh8.h"
+#include "camera.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "sampler.h"
+#include "scene_arena.h"
+#include "sphere.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <streambuf>
+#include <vector>
+
+// Times the kernels the renderer spends its time in, one at a time: ns per
+// call, rays per second for the ones that trace a ray, and heap allocations
+// per call. Run with a name, e.g. "sphere", to run only the kernels whose
+// names contain it.
+//
+// Every kernel runs over inputs made from fixed seeds, so runs compare. The
+// kernels that read scene data run twice: "warm" over a scene that stays in
+// the cache, and "cold" over one much bigger than the last-level cache,
+// visited in a shuffled order, so that most calls miss it like they do in
+// a big render.
+//
+// Timings are the best of several runs of about 50 ms each.
+
+using bench_clock = std::chrono::steady_clock;
+
+double seconds_since(bench_clock::time_point start) {
+  return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+// Every heap allocation of the program is counted here.
+std::atomic<size_t> allocation_count{0};
+
+void* operator new(std::size_t size) {
+  allocation_count.fetch_add(1, std::memory_order_relaxed);
+  if (void* p = std::malloc(size ? size : 1)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+  std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+  std::free(p);
+}
+
+// Makes the compiler believe value is used, so that it isn't optimized out
+// with the kernel that computed it.
+template <typename T>
+inline void keep(const T& value) {
+  asm volatile("" : : "m"(value) : "memory");
+}
+
+struct kernel_result {
+  double ns_per_op;
+  double allocations_per_op;
+};
+
+// Calls op(n) for n = 0, 1, ... The op count is doubled until a run takes
+// long enough to time, and the result is the best of the runs after that.
+template <typename Op>
+kernel_result measure(const Op& op) {
+  const double run_seconds = 0.05;
+  const int runs = 5;
+
+  size_t ops = 1024;
+  while (true) {
+    auto start = bench_clock::now();
+    for (size_t n = 0; n < ops; ++n) {
+      op(n);
+    }
+    if (seconds_since(start) >= run_seconds) {
+      break;
+    }
+    ops *= 2;
+  }
+
+  kernel_result best = {infinity, 0.0};
+  for (int run = 0; run < runs; ++run) {
+    size_t allocations = allocation_count.load(std::memory_order_relaxed);
+    auto start = bench_clock::now();
+    for (size_t n = 0; n < ops; ++n) {
+      op(n);
+    }
+    double ns = 1e9 * seconds_since(start) / ops;
+    if (ns < best.ns_per_op) {
+      best.ns_per_op = ns;
+      best.allocations_per_op
+        = double(allocation_count.load(std::memory_order_relaxed) - allocations)
+          / ops;
+    }
+  }
+  return best;
+}
+
+const char* filter = nullptr;
+
+// Whether the kernel of this name passes the filter. Kernels whose inputs
+// take long to set up check it before setting them up, so that running one
+// kernel doesn't wait on the inputs of others.
+bool wanted(const char* name) {
+  return !filter || std::strstr(name, filter);
+}
+
+// Runs op if its name passes the filter, and prints a row. If rays is set,
+// every op traces one ray.
+template <typename Op>
+void run(const char* name, const char* cache, bool rays, const Op& op) {
+  if (!wanted(name)) {
+    return;
+  }
+  kernel_result result = measure(op);
+  char rate[32] = "-";
+  if (rays) {
+    std::snprintf(rate, sizeof(rate), "%.1f", 1e3 / result.ns_per_op);
+  }
+  std::printf(
+    "%-34s %-6s %10.2f %10s %10.2f\n",
+    name, cache, result.ns_per_op, rate, result.allocations_per_op
+  );
+}
+
+// Inputs are picked from arrays of input_count of them, a power of 2.
+const size_t input_count = 1024;
+
+std::vector<ray> random_rays(size_t count, double side) {
+  std::vector<ray> rays;
+  rays.reserve(count);
+  for (size_t n = 0; n < count; ++n) {
+    point3 origin = 2.0 * side * unit_vector(vec3::random(-1.0, 1.0));
+    point3 target = side * vec3::random(-0.5, 0.5);
+    rays.push_back(ray(origin, target - origin));
+  }
+  return rays;
+}
+
+// count spheres of radius 0.2 to 0.5 in a cube of the given side, centered
+// on the origin.
+hittable_list sphere_field(
+  size_t count, double side, const material* mat, scene_arena& arena
+) {
+  hittable_list world;
+  for (size_t n = 0; n < count; ++n) {
+    point3 center = side * vec3::random(-0.5, 0.5);
+    double radius = random_double(0.2, 0.5);
+    world.add(arena.make<sphere>(center, radius, color(1, 1, 1), color(1, 1, 1), mat));
+  }
+  return world;
+}
+
+// The numbers 0 to count - 1 in a random order.
+std::vector<uint32_t> shuffled_indices(size_t count) {
+  std::vector<uint32_t> order(count);
+  for (size_t n = 0; n < count; ++n) {
+    order[n] = uint32_t(n);
+  }
+  for (size_t n = count - 1; n > 0; --n) {
+    std::swap(order[n], order[thread_rng().next_bits() % (n + 1)]);
+  }
+  return order;
+}
+
+// A stream buffer that drops what's written to it, so that write_color is
+// timed without the file system.
+class null_buffer : public std::streambuf {
+protected:
+  int overflow(int c) override { return c; }
+  std::streamsize xsputn(const char*, std::streamsize count) override {
+    return count;
+  }
+};
+
+// Big enough to spill out of the last-level cache of anything we run on.
+const size_t cold_bytes = size_t(256) << 20;
+
+void sampling_kernels() {
+  thread_rng() = rng(1);
+  run("random_double", "warm", false, [](size_t) {
+    keep(random_double());
+  });
+
+  for (auto sequence : {sample_sequence::random, sample_sequence::sobol}) {
+    const char* name = sequence == sample_sequence::random
+      ? "sampler::get_2d (random)" : "sampler::get_2d (sobol)";
+    run(name, "warm", false, [&](size_t n) {
+      // A new sample every 8 dimensions, like a short path.
+      sampler s(sequence, 1, int(n & 255), int(n >> 8 & 255), 256, uint32_t(n >> 3));
+      double u, v;
+      s.get_2d(u, v);
+      keep(u);
+      keep(v);
+    });
+  }
+
+  camera cam(point3(13, 2, 3), point3(0, 0, 0), vec3(0, 1, 0), 20, 16.0 / 9.0, 0.1, 10.0);
+  std::vector<double> film(2 * input_count);
+  for (double& x : film) {
+    x = random_double();
+  }
+  run("camera::get_ray", "warm", true, [&](size_t n) {
+    size_t k = n & (input_count - 1);
+    sampler s(sample_sequence::sobol, 1, int(k), 0, int(input_count), uint32_t(n));
+    keep(cam.get_ray(film[2 * k], film[2 * k + 1], s));
+  });
+}
+
+void intersection_kernels() {
+  thread_rng() = rng(2);
+  scene_arena arena;
+  const lambertian* mat = arena.make<lambertian>(color(0.5, 0.5, 0.5));
+
+  // One sphere at the origin, and rays at it of which about half hit it.
+  sphere ball(point3(0, 0, 0), 1.0, color(1, 1, 1), color(1, 1, 1), mat);
+  std::vector<ray> rays = random_rays(input_count, 2.0);
+  run("sphere::hit", "warm", true, [&](size_t n) {
+    hit_record rec;
+    keep(ball.hit(rays[n & (input_count - 1)], 0.001, infinity, rec));
+    keep(rec);
+  });
+
+  // The same, over the spheres of an arena too big for the cache. The cold
+  // lists below pick their spheres from it too.
+  const bool cold_lists = wanted("hittable_list::hit (64)");
+  const size_t cold_count = cold_bytes / sizeof(sphere);
+  std::vector<sphere*> balls;
+  std::vector<uint32_t> order;
+  if (wanted("sphere::hit") || cold_lists) {
+    balls.resize(cold_count);
+    for (sphere*& b : balls) {
+      b = arena.make<sphere>(point3(0, 0, 0), 1.0, color(1, 1, 1), color(1, 1, 1), mat);
+    }
+    order = shuffled_indices(cold_count);
+  }
+  run("sphere::hit", "cold", true, [&](size_t n) {
+    hit_record rec;
+    const sphere* b = balls[order[n % cold_count]];
+    keep(b->hit(rays[n & (input_count - 1)], 0.001, infinity, rec));
+    keep(rec);
+  });
+
+  // Lists of 64 spheres: one for warm, and for cold, enough lists of
+  // spheres picked at random from the arena to spill out of the cache.
+  const size_t list_size = 64;
+  const double side = 4.0;
+  hittable_list list = sphere_field(list_size, side, mat, arena);
+  std::vector<ray> list_rays = random_rays(input_count, side);
+  run("hittable_list::hit (64)", "warm", true, [&](size_t n) {
+    hit_record rec;
+    keep(list.hit(list_rays[n & (input_count - 1)], 0.001, infinity, rec));
+    keep(rec);
+  });
+
+  std::vector<hittable_list> lists(cold_lists ? cold_count / list_size : 0);
+  for (hittable_list& l : lists) {
+    for (size_t k = 0; k < list_size; ++k) {
+      sphere* b = balls[order[thread_rng().next_bits() % cold_count]];
+      b->center = side * vec3::random(-0.5, 0.5);
+      b->radius = random_double(0.2, 0.5);
+      l.add(b);
+    }
+  }
+  run("hittable_list::hit (64)", "cold", true, [&](size_t n) {
+    hit_record rec;
+    const hittable_list& l = lists[n % lists.size()];
+    keep(l.hit(list_rays[n & (input_count - 1)], 0.001, infinity, rec));
+    keep(rec);
+  });
+
+  // bvh8 over a sphere field that fits the cache, and over one that
+  // doesn't: bigger scenes are what make traversal miss.
+  for (size_t count : {size_t(1000), size_t(1000000)}) {
+    const char* name
+      = count == 1000 ? "bvh8::hit (1K spheres)" : "bvh8::hit (1M spheres)";
+    if (!wanted(name)) {
+      continue;
+    }
+    thread_rng() = rng(count);
+    scene_arena scene_memory;
+    double field_side = 2.0 * std::cbrt(double(count));
+    hittable_list field = sphere_field(count, field_side, mat, scene_memory);
+    bvh8 wide(field);
+    std::vector<ray> field_rays = random_rays(input_count * 64, field_side);
+    run(
+      name, count == 1000 ? "warm" : "cold", true,
+      [&](size_t n) {
+        hit_record rec;
+        keep(wide.hit(field_rays[n % field_rays.size()], 0.001, infinity, rec));
+        keep(rec);
+      }
+    );
+  }
+}
+
+void shading_kernels() {
+  thread_rng() = rng(3);
+  scene_arena arena;
+  const material* materials[] = {
+    arena.make<lambertian>(color(0.5, 0.5, 0.5)),
+    arena.make<metal>(color(0.7, 0.6, 0.5)),
+    arena.make<fuzzy>(color(0.7, 0.6, 0.5), 0.3),
+    arena.make<dielectric>(1.5)
+  };
+  const char* names[] = {
+    "lambertian::scatter", "metal::scatter", "fuzzy::scatter",
+    "dielectric::scatter"
+  };
+
+  // Hits on a sphere, from outside and from inside, to scatter.
+  sphere ball(point3(0, 0, 0), 1.0, color(1, 1, 1), color(1, 1, 1), nullptr);
+  std::vector<ray> incoming;
+  std::vector<hit_record> hits;
+  while (hits.size() < input_count) {
+    ray r(point3(0, 0, 0) + 2.0 * unit_vector(vec3::random(-1, 1)), vec3::random(-1, 1));
+    if (hits.size() % 2) {
+      r = ray(0.5 * vec3::random(-1, 1), vec3::random(-1, 1));
+    }
+    hit_record rec;
+    if (ball.hit(r, 0.001, infinity, rec)) {
+      incoming.push_back(r);
+      hits.push_back(rec);
+    }
+  }
+
+  for (int m = 0; m < 4; ++m) {
+    run(names[m], "warm", false, [&](size_t n) {
+      size_t k = n & (input_count - 1);
+      sampler s(sample_sequence::sobol, 3, int(k), 0, int(input_count), uint32_t(n));
+      s.start_bounce(0);
+      color attenuation;
+      ray scattered;
+      keep(materials[m]->scatter(incoming[k], hits[k], attenuation, scattered, s));
+      keep(scattered);
+    });
+  }
+
+  std::vector<vec3> directions(input_count);
+  std::vector<double> cosines(input_count);
+  for (size_t k = 0; k < input_count; ++k) {
+    directions[k] = unit_vector(vec3::random(-1, 1));
+    cosines[k] = random_double();
+  }
+  run("refract", "warm", false, [&](size_t n) {
+    size_t k = n & (input_count - 1);
+    vec3 d = directions[k];
+    vec3 normal = d.z() < 0 ? vec3(0, 0, 1) : vec3(0, 0, -1);
+    keep(refract(d, normal, 1 / 1.5));
+  });
+  run("schlick", "warm", false, [&](size_t n) {
+    keep(schlick(cosines[n & (input_count - 1)], 1.5));
+  });
+
+  null_buffer buffer;
+  std::ostream out(&buffer);
+  std::vector<color> pixels(input_count);
+  for (color& c : pixels) {
+    c = 100 * color::random();
+  }
+  run("write_color", "warm", false, [&](size_t n) {
+    write_color(out, pixels[n & (input_count - 1)], 100);
+  });
+}
+
+int main(int argc, char** argv) {
+  filter = argc > 1 ? argv[1] : nullptr;
+
+  std::printf(
+    "%-34s %-6s %10s %10s %10s\n", "kernel", "cache", "ns/op", "Mrays/s",
+    "allocs/op"
+  );
+  sampling_kernels();
+  intersection_kernels();
+  shading_kernels();
+}
@@ -4,55 +4,12 @@
 #include "sphere.h"
 #include "camera.h"
 #include "material.h"
+#include "path_tracer.h"
+#include "renderer.h"
+#include "scene_arena.h"
 
 #include <iostream>
 
-// ray_color samples the color of a scene using the given ray.
-color ray_color(
-  const ray& r,
-  const hittable& scene,
-  const color bg_color_1,
-  const color bg_color_2,
-  int bounces,
-  bool use_hit_color
-) {
-  if (bounces < 0) {
-    return color(0.0, 0.0, 0.0);
-  }
-
-  hit_record hit;
-  // t_min is 0.001, instead of 0.0, to avoid shadow acne caused by the bouncing
-  // ray hitting its origin surface.
-  if (scene.hit(r, 0.001, infinity, hit)) {
-    color bounce_color;
-    color attenuation;
-
-    ray bounce_ray;
-    if (!hit.material->scatter(r, hit, attenuation, bounce_ray)) {
-      return color(0.0, 0.0, 0.0);
-    }
-
-    bounce_color = ray_color(
-      bounce_ray,
-      scene,
-      bg_color_1,
-      bg_color_2,
-      bounces - 1,
-      use_hit_color
-    );
-
-    color sample_color = attenuation * bounce_color;
-    if (use_hit_color) {
-      sample_color += attenuation * hit.color;
-    }
-    return sample_color;
-  }
-
-  // Sample the background, blending blue and white linearly.
-  double t = 0.5 + 0.5 * unit_vector(r.direction()).y();
-  return t * bg_color_1 + (1 - t) * bg_color_2;
-}
-
 int main() {
   const auto aspect_ratio = 16.0 / 9.0;
   const int image_width = 384;
@@ -63,19 +20,18 @@ int main() {
   const color bg_color_2(134.0 / 256.0, 154.0 / 256.0, 181.0 / 256.0);
   const double glass_refractive_index = 1.5;
 
-  std::cout << "P3\n" << image_width << " " << image_height << "\n255\n";
-
   point3 origin(0.0, 0.0, 0.0);
   vec3 horizontal(4.0, 0.0, 0.0);
   vec3 vertical(0.0, 2.25, 0.0);
   point3 lower_left_corner
     = origin - horizontal / 2 - vertical / 2 - vec3(0.0, 0.0, 1.0);
 
+  scene_arena arena;
   hittable_list scene;
 
-  shared_ptr<fuzzy> mat1 = make_shared<fuzzy>(color(0.2, 0.2, 0.2), 0.5);
+  fuzzy* mat1 = arena.make<fuzzy>(color(0.2, 0.2, 0.2), 0.5);
   scene.add(
-    make_shared<sphere>(
+    arena.make<sphere>(
       point3(1.0, 0, -1),
       0.5,
       color(177.0 / 256.0, 169.0 / 256.0, 107.0 / 256.0),
@@ -84,9 +40,9 @@ int main() {
       )
   );
 
-  shared_ptr<lambertian> mat2 = make_shared<lambertian>(color(0.1, 0.2, 0.5));
+  lambertian* mat2 = arena.make<lambertian>(color(0.1, 0.2, 0.5));
   scene.add(
-    make_shared<sphere>(
+    arena.make<sphere>(
       point3(0.0, 0, -1),
       0.5,
       color(171.0 / 256.0, 117.0 / 256.0, 133.0 / 256.0),
@@ -95,9 +51,9 @@ int main() {
       )
   );
 
-  shared_ptr<dielectric> mat3 = make_shared<dielectric>(glass_refractive_index);
+  dielectric* mat3 = arena.make<dielectric>(glass_refractive_index);
   scene.add(
-    make_shared<sphere>(
+    arena.make<sphere>(
       point3(-1.0, 0, -1),
       0.5,
       color(0.0 / 256.0, 0.0 / 256.0, 0.0 / 256.0),
@@ -106,7 +62,7 @@ int main() {
       )
   );
   scene.add(
-    make_shared<sphere>(
+    arena.make<sphere>(
       point3(-1.0, 0, -1),
       // The negative radius doesn't affect the geometry, because the equation
       // of the sphere squares the radius. The normals get inverted, though,
@@ -119,9 +75,9 @@ int main() {
   );
 
   // Ground.
-  shared_ptr<lambertian> mat4 = make_shared<lambertian>(color(134.0 / 256.0, 154.0 / 256.0, 181.0 / 256.0));
+  lambertian* mat4 = arena.make<lambertian>(color(134.0 / 256.0, 154.0 / 256.0, 181.0 / 256.0));
   scene.add(
-    make_shared<sphere>(
+    arena.make<sphere>(
       point3(0, -100.5, -1),
       100,
       color(134.0 / 256.0, 154.0 / 256.0, 181.0 / 256.0),
@@ -134,25 +90,24 @@ int main() {
   point3 look_at(0, 0, -1);
   camera cam(look_from, look_at, vec3(0, 1, 0), 20, aspect_ratio, 2.0, (look_from - look_at).length());
 
-  for (int j = image_height - 1; j >= 0; --j) {
-    std::cerr << "\rScanlines remaining: " << j << " " << std::flush;
-    for (int i = 0; i < image_width; ++i) {
-      color pixel_color(0.0, 0.0, 0.0);
-      for (int s = 0; s < samples_per_pixel; s++) {
-        // Draw from [0, 1). It's important that it not be 1, because we don't
-        // want to step on the neighboring pixel.
-        auto sample_offset_u = random_double();
-        auto sample_offset_v = random_double();
-        auto u = (double(i) + sample_offset_u) / (double(image_width) - 1);
-        auto v = (double(j) + sample_offset_v) / (double(image_height) - 1);
-        ray r = cam.get_ray(u, v);
-        pixel_color += ray_color(
-          r, scene, bg_color_1, bg_color_2, max_bounces, false
-        );
-      }
-      write_color(std::cout, pixel_color, samples_per_pixel);
-    }
-  }
+  render_settings settings;
+  settings.image_width = image_width;
+  settings.image_height = image_height;
+  settings.samples_per_pixel = samples_per_pixel;
+  renderer tile_renderer(settings);
+
+  // Sample the background, blending blue and white linearly.
+  auto background = [&](const ray& r) {
+    double t = 0.5 + 0.5 * unit_vector(r.direction()).y();
+    return t * bg_color_1 + (1 - t) * bg_color_2;
+  };
+  path_tracer<decltype(background)> integrator(scene, background);
+  integrator.max_depth = max_bounces;
+
+  framebuffer image = tile_renderer.render(cam, [&](const ray& r, sampler& s) {
+    return integrator.radiance(r, s);
+  });
+  image.write(std::cout, image_format::ppm, samples_per_pixel);
 
   std::cerr << "\nDone.\n";
 }
\ No newline at end of file
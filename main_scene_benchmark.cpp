@@ -0,0 +1,473 @@
+#include "common.h"
+
+#include "bvh8.h"
+#include "camera.h"
+#include "hittable_list.h"
+#include "path_tracer.h"
+#include "renderer.h"
+#include "scene_arena.h"
+#include "scenes.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+// Renders a fixed corpus of scenes end to end, the way main does (a bvh8 and
+// the path tracer, in tiles on the pool), and reports for each one: the time
+// to build it, the wall time of the render, the rays and samples traced per
+// second, the peak resident memory while it was built and rendered, and how
+// well the render scales from 1 thread to every hardware thread.
+//
+// The corpus is the book's final scene, a field of random spheres at every
+// power of 10 from 100 up to --max-spheres (1M by default, 10M at most), the
+// final scene's grid all in glass and all in metal, and the final scene
+// through a wide lens. Every scene is made from a fixed seed, so runs compare.
+//
+// Usage: scene_benchmark [options] [filter]
+//   filter            only run the scenes whose names contain it
+//   --max-spheres N   the biggest sphere field (default 1000000)
+//   --threads N       the most threads to scale to (default: all of them)
+//   --json FILE       write the results to FILE as JSON
+//   --budgets FILE    check the results against the budgets in FILE, and
+//                     exit with 1 if a scene misses one
+//   --record          write the budgets to the --budgets file instead, from
+//                     these results
+//
+// Renders are small (160x90, 16 samples per pixel) so that the corpus runs in
+// seconds; the time of a render is the best of 3.
+
+using bench_clock = std::chrono::steady_clock;
+
+double seconds_since(bench_clock::time_point start) {
+  return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+// The peak resident memory of the process, in MB, since the last call to
+// reset_peak_rss(). Linux resets VmHWM to the current RSS when "5" is written
+// to clear_refs, so the memory of the scenes before is handed back to the
+// system first; where that doesn't work, this is the peak of the whole
+// process so far, from getrusage, and only ever grows.
+void reset_peak_rss() {
+#if defined(__GLIBC__)
+  malloc_trim(0);
+#endif
+  std::ofstream clear_refs("/proc/self/clear_refs");
+  clear_refs << "5";
+}
+
+double peak_rss_mb() {
+  std::ifstream status("/proc/self/status");
+  std::string line;
+  while (std::getline(status, line)) {
+    if (line.compare(0, 6, "VmHWM:") == 0) {
+      return std::strtod(line.c_str() + 6, nullptr) / 1024;
+    }
+  }
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss / 1024.0;
+}
+
+// A scene of the corpus: make(arena) fills the arena and returns the
+// objects, and view(aspect_ratio) is the camera that looks at them.
+struct bench_scene {
+  std::string name;
+  std::function<hittable_list(scene_arena&)> make;
+  std::function<camera(double)> view;
+};
+
+std::vector<bench_scene> corpus(size_t max_spheres) {
+  auto final_view = [](double aspect) { return final_scene_camera(aspect, 0.1); };
+  std::vector<bench_scene> scenes;
+  scenes.push_back({"final", random_scene, final_view});
+  for (size_t count = 100; count <= max_spheres; count *= 10) {
+    scenes.push_back({
+      "spheres_" + std::to_string(count),
+      [count](scene_arena& arena) { return sphere_field(arena, count); },
+      [count](double aspect) { return sphere_field_camera(count, aspect); }
+    });
+  }
+  scenes.push_back({
+    "glass", [](scene_arena& arena) { return sphere_grid(arena, 0.0, 0.0); },
+    final_view
+  });
+  scenes.push_back({
+    "metal", [](scene_arena& arena) { return sphere_grid(arena, 0.0, 1.0); },
+    final_view
+  });
+  // Out of focus everywhere but at 10 units, so every sample of a pixel goes
+  // a different way.
+  scenes.push_back({
+    "dof", random_scene,
+    [](double aspect) { return final_scene_camera(aspect, 2.0); }
+  });
+  return scenes;
+}
+
+// One render of a scene with some number of threads.
+struct run_result {
+  unsigned threads;
+  double seconds;
+  double mrays_per_second;
+  double samples_per_second;
+};
+
+struct scene_result {
+  std::string name;
+  size_t objects;
+  double build_seconds;
+  double peak_rss_mb;
+  size_t rays;
+  std::vector<run_result> runs;
+
+  // The speedup with the most threads over 1 thread, divided by the number
+  // of threads: 1 is perfect scaling.
+  double efficiency() const {
+    const run_result& last = runs.back();
+    return runs.front().seconds / last.seconds / last.threads;
+  }
+};
+
+// 1, 2, 4, ... up to max_threads, and max_threads itself.
+std::vector<unsigned> thread_counts(unsigned max_threads) {
+  std::vector<unsigned> counts;
+  for (unsigned n = 1; n < max_threads; n *= 2) {
+    counts.push_back(n);
+  }
+  counts.push_back(max_threads);
+  return counts;
+}
+
+const int image_width = 160;
+const int image_height = 90;
+const int samples_per_pixel = 16;
+const int repeats = 3;
+
+scene_result run_scene(
+  const bench_scene& scene, const std::vector<unsigned>& threads
+) {
+  scene_result result;
+  result.name = scene.name;
+
+  // Seeded by the name, so a scene is the same whichever others run.
+  uint64_t seed = 0;
+  for (char c : scene.name) {
+    seed = mix64(seed + uint8_t(c));
+  }
+
+  reset_peak_rss();
+  thread_rng() = rng(seed);
+  scene_arena arena;
+  const camera cam = scene.view(double(image_width) / image_height);
+  hittable_list objects = scene.make(arena);
+  result.objects = objects.objects.size();
+  auto start = bench_clock::now();
+  const bvh8* world = arena.make<bvh8>(objects);
+  result.build_seconds = seconds_since(start);
+
+  path_tracer<decltype(&sky)> integrator(*world, &sky);
+  for (unsigned thread_count : threads) {
+    render_settings settings;
+    settings.image_width = image_width;
+    settings.image_height = image_height;
+    settings.samples_per_pixel = samples_per_pixel;
+    settings.thread_count = thread_count;
+    settings.show_progress = false;
+    renderer tile_renderer(settings);
+
+    // Traced like renderer::render(cam, world, shade), so that the rays are
+    // main's; every tile adds up its rays and adds them to the total once.
+    double best = infinity;
+    for (int n = 0; n < repeats; ++n) {
+      std::atomic<size_t> rays{0};
+      auto render_start = bench_clock::now();
+      tile_renderer.render_tiles([&](const tile& t, color* accumulated) {
+        size_t tile_rays = 0;
+        auto shade = [&](const ray& r, bool hit, const hit_record& rec, sampler& s) {
+          return integrator.radiance(r, hit, rec, s, &tile_rays);
+        };
+        for (int j = t.y0; j < t.y1; ++j) {
+          for (int i = t.x0; i < t.x1; ++i) {
+            *accumulated++ = tile_renderer.trace_samples(
+              cam, *world, shade, i, j, 0, samples_per_pixel
+            );
+            tile_rays += samples_per_pixel;
+          }
+        }
+        rays.fetch_add(tile_rays, std::memory_order_relaxed);
+      });
+      best = std::min(best, seconds_since(render_start));
+      result.rays = rays;
+    }
+
+    const double samples = double(image_width) * image_height * samples_per_pixel;
+    result.runs.push_back(
+      {thread_count, best, result.rays / best / 1e6, samples / best}
+    );
+  }
+  result.peak_rss_mb = peak_rss_mb();
+  return result;
+}
+
+void write_json(std::ostream& out, const std::vector<scene_result>& results) {
+  out << "{\n"
+    << "  \"image_width\": " << image_width << ",\n"
+    << "  \"image_height\": " << image_height << ",\n"
+    << "  \"samples_per_pixel\": " << samples_per_pixel << ",\n"
+    << "  \"hardware_threads\": " << std::thread::hardware_concurrency() << ",\n"
+    << "  \"scenes\": [\n";
+  for (size_t n = 0; n < results.size(); ++n) {
+    const scene_result& r = results[n];
+    out << "    {\n"
+      << "      \"name\": \"" << r.name << "\",\n"
+      << "      \"objects\": " << r.objects << ",\n"
+      << "      \"build_seconds\": " << r.build_seconds << ",\n"
+      << "      \"peak_rss_mb\": " << r.peak_rss_mb << ",\n"
+      << "      \"rays\": " << r.rays << ",\n"
+      << "      \"scaling_efficiency\": " << r.efficiency() << ",\n"
+      << "      \"runs\": [\n";
+    for (size_t k = 0; k < r.runs.size(); ++k) {
+      const run_result& run = r.runs[k];
+      out << "        {\"threads\": " << run.threads
+        << ", \"seconds\": " << run.seconds
+        << ", \"mrays_per_second\": " << run.mrays_per_second
+        << ", \"samples_per_second\": " << run.samples_per_second << "}"
+        << (k + 1 < r.runs.size() ? ",\n" : "\n");
+    }
+    out << "      ]\n"
+      << "    }" << (n + 1 < results.size() ? ",\n" : "\n");
+  }
+  out << "  ]\n}\n";
+}
+
+// What a scene must achieve. A line of the budgets file is
+//   scene  min_mrays_per_second  max_peak_rss_mb  min_scaling_efficiency
+// where the throughput is with 1 thread and the efficiency is that of the
+// run with the most threads. An efficiency of 0 means the budget was recorded
+// with 1 thread, so it has no scaling to check against: that fails, like a
+// run with 1 thread does, since scaling is part of the budget. A line
+//   tolerance  t
+// lets every measurement miss its budget by a fraction t, for the noise of
+// timings. Lines starting with # are comments.
+struct scene_budget {
+  double min_mrays_per_second;
+  double max_peak_rss_mb;
+  double min_scaling_efficiency;
+};
+
+struct budgets {
+  double tolerance = 0.25;
+  std::map<std::string, scene_budget> scenes;
+};
+
+bool read_budgets(const char* path, budgets& out) {
+  std::ifstream in(path);
+  if (!in) {
+    std::cerr << "Can't read the budgets in " << path << ".\n";
+    return false;
+  }
+  std::string line;
+  while (std::getline(in, line)) {
+    std::istringstream fields(line);
+    std::string name;
+    if (!(fields >> name) || name[0] == '#') {
+      continue;
+    }
+    if (name == "tolerance") {
+      fields >> out.tolerance;
+      continue;
+    }
+    scene_budget b;
+    if (!(fields >> b.min_mrays_per_second >> b.max_peak_rss_mb
+          >> b.min_scaling_efficiency)) {
+      std::cerr << "Bad budget line in " << path << ": " << line << "\n";
+      return false;
+    }
+    out.scenes[name] = b;
+  }
+  return true;
+}
+
+// The name of the processor, for the budgets file: budgets only hold on
+// hardware like the one they were recorded on.
+std::string processor_name() {
+  std::ifstream in("/proc/cpuinfo");
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.compare(0, 10, "model name") == 0) {
+      size_t colon = line.find(':');
+      if (colon != std::string::npos && colon + 2 <= line.size()) {
+        return line.substr(colon + 2);
+      }
+    }
+  }
+  return "unknown";
+}
+
+bool write_budgets(
+  const char* path, const std::vector<scene_result>& results, double tolerance
+) {
+  std::ofstream out(path);
+  if (!out) {
+    std::cerr << "Can't write the budgets to " << path << ".\n";
+    return false;
+  }
+  const bool scaled = !results.empty() && results.front().runs.size() > 1;
+  if (!scaled) {
+    std::cerr << "Recorded with 1 thread: the budgets have no scaling, and "
+      << "checking them fails until they're recorded with more.\n";
+  }
+  out << "# Budgets of scene_benchmark, recorded with --record on this hardware:\n"
+    << "#   " << processor_name() << ", "
+    << std::thread::hardware_concurrency() << " hardware threads, runs of up to "
+    << (results.empty() ? 0 : results.front().runs.back().threads)
+    << " threads.\n"
+    << "# Throughputs and efficiencies only hold on hardware like it.\n"
+    << "# scene  min_mrays_per_second(1 thread)  max_peak_rss_mb  "
+    << "min_scaling_efficiency\n"
+    << "tolerance " << tolerance << "\n";
+  for (const scene_result& r : results) {
+    out << r.name << " " << r.runs.front().mrays_per_second << " "
+      << r.peak_rss_mb << " " << (r.runs.size() > 1 ? r.efficiency() : 0.0)
+      << "\n";
+  }
+  return true;
+}
+
+// Prints every budget a result misses, and returns how many it missed.
+int check_budget(const scene_result& r, const budgets& limits) {
+  auto found = limits.scenes.find(r.name);
+  if (found == limits.scenes.end()) {
+    std::cerr << r.name << ": no budget.\n";
+    return 0;
+  }
+  const scene_budget& b = found->second;
+  const double t = limits.tolerance;
+  int failures = 0;
+  double mrays = r.runs.front().mrays_per_second;
+  if (mrays < b.min_mrays_per_second * (1 - t)) {
+    std::cerr << r.name << ": " << mrays << " Mrays/s, budget "
+      << b.min_mrays_per_second << ".\n";
+    ++failures;
+  }
+  if (r.peak_rss_mb > b.max_peak_rss_mb * (1 + t)) {
+    std::cerr << r.name << ": " << r.peak_rss_mb << " MB peak RSS, budget "
+      << b.max_peak_rss_mb << ".\n";
+    ++failures;
+  }
+  // Scaling can't be checked without threads to scale to, or without a
+  // budget for it, and a budget that isn't checked isn't met.
+  if (r.runs.size() == 1) {
+    std::cerr << r.name << ": scaling can't be checked with 1 thread.\n";
+    ++failures;
+  } else if (b.min_scaling_efficiency == 0) {
+    std::cerr << r.name << ": no scaling budget; record the budgets with "
+      << "more than 1 thread.\n";
+    ++failures;
+  } else if (r.efficiency() < b.min_scaling_efficiency * (1 - t)) {
+    std::cerr << r.name << ": scaling efficiency " << r.efficiency()
+      << " with " << r.runs.back().threads << " threads, budget "
+      << b.min_scaling_efficiency << ".\n";
+    ++failures;
+  }
+  return failures;
+}
+
+int main(int argc, char** argv) {
+  size_t max_spheres = 1000000;
+  unsigned max_threads = std::max(1u, std::thread::hardware_concurrency());
+  const char* json_path = nullptr;
+  const char* budgets_path = nullptr;
+  bool record = false;
+  const char* filter = "";
+  for (int n = 1; n < argc; ++n) {
+    bool has_value = n + 1 < argc;
+    if (std::strcmp(argv[n], "--max-spheres") == 0 && has_value) {
+      max_spheres = std::min<size_t>(std::strtoull(argv[++n], nullptr, 10), 10000000);
+    } else if (std::strcmp(argv[n], "--threads") == 0 && has_value) {
+      max_threads = std::max(1, std::atoi(argv[++n]));
+    } else if (std::strcmp(argv[n], "--json") == 0 && has_value) {
+      json_path = argv[++n];
+    } else if (std::strcmp(argv[n], "--budgets") == 0 && has_value) {
+      budgets_path = argv[++n];
+    } else if (std::strcmp(argv[n], "--record") == 0) {
+      record = true;
+    } else if (argv[n][0] != '-') {
+      filter = argv[n];
+    } else {
+      std::cerr << "Unknown option " << argv[n] << ".\n";
+      return 2;
+    }
+  }
+  if (record && !budgets_path) {
+    std::cerr << "--record needs --budgets.\n";
+    return 2;
+  }
+
+  // Recording keeps the tolerance of the budgets it replaces, if there are
+  // any.
+  budgets limits;
+  if (budgets_path && (!record || std::ifstream(budgets_path))
+    && !read_budgets(budgets_path, limits)) {
+    return 2;
+  }
+
+  const std::vector<unsigned> threads = thread_counts(max_threads);
+  std::printf("%-16s %9s %9s %9s %11s %9s  %s\n",
+    "scene", "objects", "build s", "RSS MB", "Msamples/s", "Mrays/s",
+    "Mrays/s by threads");
+
+  std::vector<scene_result> results;
+  int failures = 0;
+  for (const bench_scene& scene : corpus(max_spheres)) {
+    if (scene.name.find(filter) == std::string::npos) {
+      continue;
+    }
+    scene_result r = run_scene(scene, threads);
+    std::printf("%-16s %9zu %9.3f %9.1f %11.3f %9.3f ",
+      r.name.c_str(), r.objects, r.build_seconds, r.peak_rss_mb,
+      r.runs.front().samples_per_second / 1e6, r.runs.front().mrays_per_second);
+    for (const run_result& run : r.runs) {
+      std::printf(" %u:%.3f", run.threads, run.mrays_per_second);
+    }
+    std::printf("\n");
+    std::fflush(stdout);
+    if (budgets_path && !record) {
+      failures += check_budget(r, limits);
+    }
+    results.push_back(r);
+  }
+
+  if (json_path) {
+    std::ofstream out(json_path);
+    if (!out) {
+      std::cerr << "Can't write " << json_path << ".\n";
+      return 2;
+    }
+    write_json(out, results);
+  }
+  if (record) {
+    return write_budgets(budgets_path, results, limits.tolerance) ? 0 : 2;
+  }
+  if (failures > 0) {
+    std::cerr << failures << " budgets missed.\n";
+    return 1;
+  }
+  return 0;
+}
@@ -4,6 +4,10 @@
 #include "ray.h"
 #include "hittable.h"
 #include "common.h"
+#include "sampler.h"
+#include "sampling.h"
+#include "stats.h"
+#include "texture.h"
 
 double schlick(double cos_theta, double refractive_idx) {
   auto r0 = (1 - refractive_idx) / (1 + refractive_idx);
@@ -11,39 +15,89 @@ double schlick(double cos_theta, double refractive_idx) {
   return r0 + (1 - r0) * pow((1 - cos_theta), 5);
 }
 
+// The material classes of this file. A material knows which one it is, so
+// that hits can be sorted by class without a virtual call, and every class's
+// scatter run in a loop of its own (see wavefront.h). Classes defined
+// elsewhere are "other". The classes are final, so that a call through a
+// reference to one of them isn't virtual, and so that a type can't belong to
+// a class whose scatter it overrides.
+enum class material_type { other, lambertian, metal, fuzzy, dielectric };
+
+const int material_type_count = 5;
+static_assert(
+  material_type_count == render_stats::material_classes,
+  "render_stats counts scatters by material_type"
+);
+
 class material {
 public:
+  material(material_type type = material_type::other) : type(type) {}
+
+  // The random numbers of the bounce come from s.
   virtual bool scatter(
-    const ray &r, const hit_record &hit, color &attenuation, ray &scattered
+    const ray &r, const hit_record &hit, color &attenuation, ray &scattered,
+    sampler& s
   ) const = 0;
+
+  // The same, drawing from random_double()'s generator.
+  bool scatter(
+    const ray &r, const hit_record &hit, color &attenuation, ray &scattered
+  ) const {
+    sampler independent(thread_rng());
+    bool scatters = scatter(r, hit, attenuation, scattered, independent);
+    thread_rng() = independent.stream;
+    return scatters;
+  }
+
+  const material_type type;
+  // Whether scatter uses the hit's texture coordinates (see hit_record::u).
+  bool needs_uv = false;
 };
 
-class lambertian : public material {
+class lambertian final : public material {
 public:
-  lambertian(const color &albedo) : albedo(albedo) {}
+  lambertian(const color &albedo)
+    : material(material_type::lambertian), albedo(albedo) {}
+
+  // The albedo is looked up in albedo_texture at every hit.
+  lambertian(const texture* albedo_texture)
+    : material(material_type::lambertian), albedo(1.0, 1.0, 1.0),
+      albedo_texture(albedo_texture) {
+    needs_uv = albedo_texture->needs_uv;
+  }
 
   virtual bool scatter(
-    const ray& r, const hit_record& hit, color& attenuation, ray& scattered
+    const ray& r, const hit_record& hit, color& attenuation, ray& scattered,
+    sampler& s
   ) const {
-    vec3 scatter_direction = hit.normal + unit_vector(vec3::random());
-    scattered = ray(hit.p, scatter_direction);
-    attenuation = this->albedo;
+    // Cosine-weighted around the normal, the distribution of a Lambertian
+    // surface.
+    double x, y;
+    s.get_2d(x, y);
+    vec3 b1, b2;
+    orthonormal_basis(hit.normal, b1, b2);
+    vec3 scatter_direction = to_basis(cosine_hemisphere(x, y), b1, b2, hit.normal);
+    scattered = hit.spawn_ray(scatter_direction);
+    attenuation = albedo_texture ? albedo_texture->value(hit) : this->albedo;
     return true;
   }
 
   color albedo;
+  // Owned by the scene (see scene_arena.h); if it's null, the albedo is.
+  const texture* albedo_texture = nullptr;
 };
 
-class metal : public material {
+class metal final : public material {
 public:
-  metal(color albedo) : albedo(albedo) {}
+  metal(color albedo) : material(material_type::metal), albedo(albedo) {}
 
   virtual bool scatter(
-    const ray& r, const hit_record& hit, color& attenuation, ray& scattered
+    const ray& r, const hit_record& hit, color& attenuation, ray& scattered,
+    sampler& s
   ) const {
     vec3 reflected 
       = reflect(unit_vector(r.direction()), hit.normal);
-    scattered = ray(hit.p, reflected);
+    scattered = hit.spawn_ray(reflected);
     attenuation = this->albedo;
     return dot(scattered.direction(), hit.normal) > 0;
   }
@@ -51,45 +105,40 @@ public:
   color albedo;
 };
 
-class fuzzy : public material {
+class fuzzy final : public material {
 public:
-  fuzzy(color albedo, double fuzz) : albedo(albedo), fuzz(fuzz < 1 ? fuzz: 1) {}
+  fuzzy(color albedo, double fuzz)
+    : material(material_type::fuzzy), albedo(albedo), fuzz(fuzz < 1 ? fuzz: 1) {}
 
   virtual bool scatter(
-    const ray& r, const hit_record& hit, color& attenuation, ray& scattered
+    const ray& r, const hit_record& hit, color& attenuation, ray& scattered,
+    sampler& s
   ) const {
     vec3 reflected
       = reflect(unit_vector(r.direction()), hit.normal);
     // The fuzz increases the radius of the sampled sphere.
     // The bigger the sphere, the fuzzier the reflection.
-    vec3 fuzzed = reflected + fuzz*this->sample_unit_sphere(vec3(0.0, 0.0, 0.0));
-    scattered = ray(hit.p, fuzzed);
+    double x, y;
+    s.get_2d(x, y);
+    vec3 fuzzed = reflected + fuzz * uniform_sphere(x, y);
+    scattered = hit.spawn_ray(fuzzed);
     attenuation = this->albedo;
     return dot(scattered.direction(), hit.normal) > 0;
   }
 
-private:
-  point3 sample_unit_sphere(point3 center) const {
-    while (true) {
-      // Sample an axis-aligned unit cube; reject the sample if it is outside the
-      // unit sphere.
-      vec3 random_direction = vec3::random(-1.0, 1.0);
-      if (random_direction.length_squared() > 1.0) continue;
-      return unit_vector(center + random_direction);
-    }
-  }
-
 public:
   color albedo;
   double fuzz;
 };
 
-class dielectric : public material {
+class dielectric final : public material {
 public:
-  dielectric(double refractive_idx) : refractive_idx(refractive_idx) {}
+  dielectric(double refractive_idx)
+    : material(material_type::dielectric), refractive_idx(refractive_idx) {}
 
   virtual bool scatter(
-    const ray& r, const hit_record& hit, color& attenuation, ray& scattered
+    const ray& r, const hit_record& hit, color& attenuation, ray& scattered,
+    sampler& s
   ) const {
     attenuation = color(1.0, 1.0, 1.0);
     const double air_refractive_idx = 1.0;
@@ -111,23 +160,26 @@ public:
 
     if (eta_over_etap * sin_theta > 1.0) {
       // No solution to Snell's law. Must reflect.
+      RT_STAT(++thread_stats().total_internal_reflections);
       vec3 reflected = reflect(unit_vector(r.direction()), hit.normal);
-      scattered = ray(hit.p, reflected);
+      scattered = hit.spawn_ray(reflected);
       return true;
     }
 
     double reflect_prob = schlick(cos_theta, eta_over_etap);
-    if (random_double() < reflect_prob)
+    if (s.get_1d() < reflect_prob)
     {
+      RT_STAT(++thread_stats().fresnel_reflections);
       vec3 reflected = reflect(unit_vector(r.direction()), hit.normal);
-      scattered = ray(hit.p, reflected);
+      scattered = hit.spawn_ray(reflected);
       return true;
     }
 
+    RT_STAT(++thread_stats().refractions);
     vec3 refracted = refract(
       unit_vector(r.direction()), hit.normal, eta_over_etap
     );
-    scattered = ray(hit.p, refracted);
+    scattered = hit.spawn_ray(refracted);
     return true;
   }
 
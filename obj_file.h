@@ -0,0 +1,216 @@
+#ifndef OBJ_FILE_H
+#define OBJ_FILE_H
+
+#include "common.h"
+
+#include "trace.h"
+#include "triangle_mesh.h"
+
+#include <charconv>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Loads the triangles of the Wavefront OBJ file at path into mesh, which may
+// already have some. Every vertex position p becomes p * scale + offset.
+//
+// Only geometry is read: vertices (v), normals (vn), texture coordinates (vt)
+// and faces (f), whose corners are v, v/vt, v//vn or v/vt/vn, counted from 1,
+// or from the end if negative. Faces of more than 3 corners are split into a
+// fan of triangles. A face whose corners don't all have a normal is flat, and
+// one whose corners don't all have texture coordinates gets the default ones
+// of triangle_mesh. Everything else (groups, materials, smoothing) is
+// skipped.
+//
+// The file is read a line at a time, so it's never in memory all at once:
+// only the mesh's pools are. Returns false, after printing where the file is
+// wrong, if it can't be read or parsed. The mesh still has to be built.
+bool load_obj(
+  const std::string& path, triangle_mesh& mesh, real scale = 1,
+  const vec3& offset = vec3(0, 0, 0)
+);
+
+// The blank separated words of a line of an OBJ file.
+class obj_line {
+public:
+  obj_line(const std::string& line)
+    : p(line.data()), end(line.data() + line.size()) {}
+
+  bool word(std::string_view& w) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) {
+      ++p;
+    }
+    if (p == end || *p == '#') {
+      return false;
+    }
+    const char* start = p;
+    while (p < end && *p != ' ' && *p != '\t' && *p != '\r') {
+      ++p;
+    }
+    w = std::string_view(start, size_t(p - start));
+    return true;
+  }
+
+  bool vector(vec3& v);
+
+private:
+  const char* p;
+  const char* end;
+};
+
+// Reads the number that is all of w.
+template <typename Number>
+bool obj_number(std::string_view w, Number& x) {
+  auto result = std::from_chars(w.data(), w.data() + w.size(), x);
+  return result.ec == std::errc() && result.ptr == w.data() + w.size();
+}
+
+bool obj_line::vector(vec3& v) {
+  double x[3];
+  for (int a = 0; a < 3; ++a) {
+    std::string_view w;
+    if (!word(w) || !obj_number(w, x[a])) {
+      return false;
+    }
+  }
+  v = vec3(x[0], x[1], x[2]);
+  return true;
+}
+
+// Reads the index of a face corner at the start of w, up to the next / or
+// the end, and moves w past it and its /. An empty index is 0. Returns false
+// if it isn't a number.
+inline bool obj_index(std::string_view& w, long& index) {
+  size_t slash = w.find('/');
+  std::string_view number = w.substr(0, slash);
+  w = slash == std::string_view::npos ? std::string_view() : w.substr(slash + 1);
+  index = 0;
+  if (number.empty()) {
+    return true;
+  }
+  auto result = std::from_chars(
+    number.data(), number.data() + number.size(), index
+  );
+  return result.ec == std::errc() && result.ptr == number.data() + number.size();
+}
+
+// Turns an index of the file into one of a pool of count elements, of which
+// the file's start at first. Returns false if it's 0 or out of range.
+inline bool obj_resolve(long index, size_t first, size_t count, uint32_t& out) {
+  long resolved = index > 0
+    ? long(first) + index - 1
+    : long(count) + index;
+  if (index == 0 || resolved < long(first) || resolved >= long(count)) {
+    return false;
+  }
+  out = uint32_t(resolved);
+  return true;
+}
+
+bool load_obj(
+  const std::string& path, triangle_mesh& mesh, real scale, const vec3& offset
+) {
+  RT_TRACE_ZONE("load obj");
+  std::ifstream in(path);
+  if (!in) {
+    std::cerr << "Can't open " << path << ".\n";
+    return false;
+  }
+  auto fail = [&](size_t line, const char* message) {
+    std::cerr << path << ":" << line << ": " << message << "\n";
+    return false;
+  };
+
+  // Indices in the file are relative to its own vertices, normals and texture
+  // coordinates.
+  const size_t first_vertex = mesh.vertices.size();
+  const size_t first_normal = mesh.normals.size();
+  const size_t first_texcoord = mesh.texcoords.size();
+  std::string text;
+  std::vector<uint32_t> corners;
+  std::vector<uint32_t> corner_normals;
+  std::vector<uint32_t> corner_texcoords;
+  for (size_t line = 1; std::getline(in, text); ++line) {
+    obj_line words(text);
+    std::string_view statement;
+    if (!words.word(statement)) {
+      continue;
+    }
+    if (statement == "v") {
+      vec3 v;
+      if (!words.vector(v)) {
+        return fail(line, "A vertex needs 3 coordinates.");
+      }
+      mesh.vertices.push_back(scale * v + offset);
+    } else if (statement == "vn") {
+      vec3 n;
+      if (!words.vector(n)) {
+        return fail(line, "A normal needs 3 coordinates.");
+      }
+      mesh.normals.push_back(n);
+    } else if (statement == "vt") {
+      // A third coordinate, if there's one, is ignored.
+      std::string_view w[2];
+      triangle_mesh::texcoord c;
+      if (!words.word(w[0]) || !words.word(w[1])
+        || !obj_number(w[0], c.u) || !obj_number(w[1], c.v)) {
+        return fail(line, "Texture coordinates need 2 numbers.");
+      }
+      mesh.texcoords.push_back(c);
+    } else if (statement == "f") {
+      corners.clear();
+      corner_normals.clear();
+      corner_texcoords.clear();
+      bool all_normals = true;
+      bool all_texcoords = true;
+      std::string_view w;
+      while (words.word(w)) {
+        long v, vt, vn = 0;
+        uint32_t vertex, normal = triangle_mesh::no_normal;
+        uint32_t texcoord = triangle_mesh::no_texcoord;
+        if (!obj_index(w, v) || !obj_index(w, vt) || !obj_index(w, vn)
+          || !obj_resolve(v, first_vertex, mesh.vertices.size(), vertex)
+          || (vt && !obj_resolve(vt, first_texcoord, mesh.texcoords.size(), texcoord))
+          || (vn && !obj_resolve(vn, first_normal, mesh.normals.size(), normal))) {
+          return fail(line, "Bad face corner.");
+        }
+        all_normals = all_normals && vn;
+        all_texcoords = all_texcoords && vt;
+        corners.push_back(vertex);
+        corner_normals.push_back(normal);
+        corner_texcoords.push_back(texcoord);
+      }
+      if (corners.size() < 3) {
+        return fail(line, "A face needs 3 corners or more.");
+      }
+      for (size_t c = 2; c < corners.size(); ++c) {
+        triangle_mesh::triangle tri = {
+          {corners[0], corners[c - 1], corners[c]},
+          {triangle_mesh::no_normal, triangle_mesh::no_normal, triangle_mesh::no_normal},
+          {triangle_mesh::no_texcoord, triangle_mesh::no_texcoord, triangle_mesh::no_texcoord}
+        };
+        if (all_normals) {
+          tri.normal[0] = corner_normals[0];
+          tri.normal[1] = corner_normals[c - 1];
+          tri.normal[2] = corner_normals[c];
+        }
+        if (all_texcoords) {
+          tri.texcoord[0] = corner_texcoords[0];
+          tri.texcoord[1] = corner_texcoords[c - 1];
+          tri.texcoord[2] = corner_texcoords[c];
+        }
+        mesh.triangles.push_back(tri);
+      }
+    }
+  }
+  if (in.bad()) {
+    std::cerr << "Can't read " << path << ".\n";
+    return false;
+  }
+  return true;
+}
+
+#endif
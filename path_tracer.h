@@ -0,0 +1,134 @@
+#ifndef PATH_TRACER_H
+#define PATH_TRACER_H
+
+#include "common.h"
+
+#include "hittable.h"
+#include "material.h"
+#include "ray_cone.h"
+#include "sampler.h"
+#include "stats.h"
+
+#include <algorithm>
+
+// Russian roulette: once a path has bounced depth >= roulette_depth times,
+// it goes on with probability p, the largest component of its throughput,
+// and its throughput is divided by p when it does. A path that carries
+// little light is likely to end, and the ones that survive make up for it, so
+// the expected color doesn't change. Returns whether the path goes on. The
+// draw comes from s.
+inline bool survives_roulette(
+  color& throughput, int depth, int roulette_depth, sampler& s
+) {
+  if (depth < roulette_depth) {
+    return true;
+  }
+  double p = std::max(throughput.x(), std::max(throughput.y(), throughput.z()));
+  if (p >= 1.0) {
+    return true;
+  }
+  if (s.get_1d() >= p) {
+    return false;
+  }
+  throughput = throughput / p;
+  return true;
+}
+
+// Follows a path from the camera bounce by bounce, in a loop: the attenuation
+// of all the bounces so far (the throughput) is carried forward, instead of
+// being applied on the way back from a recursion like in ray_color. Every
+// bounce either ends the path or becomes the next ray.
+template <typename Background>
+class path_tracer {
+public:
+  // background(r) is the color carried by a ray that hits nothing.
+  path_tracer(const hittable& world, const Background& background)
+    : world(world), background(background) {}
+
+  // The color carried by r, a camera ray whose bounces draw from s.
+  color radiance(const ray& r, sampler& s) const {
+    // The renderer has counted r as a camera ray.
+    hit_record rec;
+    bool hit = world.hit(r, 0, infinity, rec);
+    return trace(r, hit, rec, s);
+  }
+
+  // The same, for a ray that has already been intersected with the world:
+  // hit tells whether it hit anything, and rec is its closest hit if it did.
+  // If rays_traced isn't null, the bounce rays the path traces are added to
+  // it.
+  color radiance(
+    const ray& r, bool hit, const hit_record& rec, sampler& s,
+    size_t* rays_traced = nullptr
+  ) const {
+    hit_record next = rec;
+    return trace(r, hit, next, s, rays_traced);
+  }
+
+  const hittable& world;
+  const Background background;
+  // Paths end, black, after max_depth bounces.
+  int max_depth = 50;
+  // Paths aren't cut short by Russian roulette before this many bounces.
+  int roulette_depth = 3;
+  // Whether every bounce adds the color of the surface it hits, attenuated.
+  bool add_hit_color = false;
+  // The spread of the cone of camera rays (see ray_cone.h), which picks how
+  // blurry texture lookups are. 0 makes them all as sharp as can be.
+  real cone_spread = 0;
+
+private:
+  // rec is overwritten by every bounce.
+  color trace(
+    ray r, bool hit, hit_record& rec, sampler& s, size_t* rays_traced = nullptr
+  ) const;
+};
+
+template <typename Background>
+color path_tracer<Background>::trace(
+  ray r, bool hit, hit_record& rec, sampler& s, size_t* rays_traced
+) const {
+  color sample_color(0.0, 0.0, 0.0);
+  color throughput(1.0, 1.0, 1.0);
+
+  ray_cone cone{0, cone_spread};
+  int depth = 0;
+  for (; hit; ++depth) {
+    ray scattered;
+    color attenuation;
+    s.start_bounce(depth);
+    if (depth >= max_depth) {
+      RT_STAT(thread_stats().end_path(path_end::max_depth, depth));
+      return sample_color;
+    }
+    cone.reach(r, rec);
+    RT_STAT(++thread_stats().scatters[int(rec.material->type)]);
+    if (!rec.material->scatter(r, rec, attenuation, scattered, s)) {
+      RT_STAT(thread_stats().end_path(path_end::absorbed, depth));
+      return sample_color;
+    }
+    if (add_hit_color) {
+      sample_color += throughput * attenuation * rec.color;
+    }
+    throughput = throughput * attenuation;
+    if (!survives_roulette(throughput, depth + 1, roulette_depth, s)) {
+      RT_STAT(thread_stats().end_path(path_end::roulette, depth + 1));
+      return sample_color;
+    }
+
+    // Materials scatter through hit_record::spawn_ray, whose origin is off the
+    // surface, so the bouncing ray can't hit its origin surface (shadow
+    // acne), and needs no t_min.
+    r = scattered;
+    hit = world.hit(r, 0, infinity, rec);
+    RT_STAT(++thread_stats().bounce_rays);
+    if (rays_traced) {
+      ++*rays_traced;
+    }
+  }
+
+  RT_STAT(thread_stats().end_path(path_end::escaped, depth));
+  return sample_color + throughput * background(r);
+}
+
+#endif
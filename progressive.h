@@ -0,0 +1,329 @@
+#ifndef PROGRESSIVE_H
+#define PROGRESSIVE_H
+
+#include "common.h"
+
+#include "camera.h"
+#include "hittable.h"
+#include "renderer.h"
+#include "sampler.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// How a progressive render is split into passes over the whole image.
+struct progressive_settings {
+  // The first sample of every pixel is taken in preview_levels passes, from
+  // coarse to fine: the first pass samples one pixel in every
+  // 2^(preview_levels - 1) in each direction, and every next one the pixels
+  // halfway between those already sampled. The first passes take a fraction
+  // of a second, and show every sampled pixel over the block around it.
+  int preview_levels = 4;
+  // Every pass after those adds this many samples to every pixel, until it
+  // has samples_per_pixel of them.
+  int samples_per_pass = 8;
+  // After a pass, a checkpoint is saved to checkpoint_path if at least this
+  // many seconds went by since the last one; and after the last pass. No
+  // checkpoints if the path is empty.
+  double checkpoint_seconds = 60.0;
+  std::string checkpoint_path;
+
+  // Adaptive sampling, if it's above 0: a pixel stops taking samples once it
+  // and its 8 neighbors are converged, that is, the standard error of their
+  // means, in the units of the written image (from 0 to 1, after gamma), is
+  // below error_threshold. Noisy pixels go on until they have
+  // samples_per_pixel samples, so that should be set well above what a
+  // uniform render would take. Errors aren't trusted before a pixel has
+  // adaptive_min_samples samples: a rare bright path may not have shown up
+  // yet.
+  double error_threshold = 0.0;
+  int adaptive_min_samples = 16;
+};
+
+// The state of a progressive render: the sum of the samples of every pixel
+// so far, how many there are, and how many passes are done. For adaptive
+// sampling, it also sums the squares of the samples' luminances, which give
+// the variance of every pixel.
+//
+// Every sample draws its random numbers from a sampler keyed by (seed, pixel,
+// sample), so the seed, the sequence and the sample counts are all the
+// random number state there is: a render resumed from a checkpoint traces
+// the very samples it would have traced, and ends with the same image.
+class accumulation_buffer {
+public:
+  accumulation_buffer(
+    int width, int height, uint64_t seed, sample_sequence sequence
+  ) : width(width), height(height), seed(seed), sequence(sequence),
+      sums(size_t(width) * height, color(0.0, 0.0, 0.0)),
+      luminance_squares(size_t(width) * height, 0),
+      samples(size_t(width) * height, 0),
+      converged(size_t(width) * height, 0) {}
+
+  // The average of every pixel, so it's written with 1 sample per pixel.
+  // Pixels without samples yet show the pixel of a coarser preview pass whose
+  // block they are in.
+  framebuffer resolve() const;
+
+  // Saves the buffer to path, through a temporary file renamed over it, so
+  // that a job killed while saving leaves the last checkpoint whole.
+  bool save(const std::string& path) const;
+
+  // Loads a checkpoint saved by save. Returns false, and leaves the buffer as
+  // it is, if there's none, or if it's for another image size, seed or
+  // sample sequence, or the other precision.
+  bool load(const std::string& path);
+
+  // The standard error of the mean of pixel p, after gamma: an error e in
+  // a linear value v is about e / (2 sqrt(v)) in sqrt(v).
+  real error(size_t p) const;
+
+  // Recomputes converged (see progressive_settings::error_threshold). It only
+  // depends on the sums, so it isn't saved in checkpoints.
+  void update_converged(real threshold, int min_samples);
+
+  int width;
+  int height;
+  uint64_t seed;
+  sample_sequence sequence;
+  int passes_done = 0;
+  std::vector<color> sums;
+  std::vector<real> luminance_squares;
+  std::vector<uint32_t> samples;
+  std::vector<uint8_t> converged;
+};
+
+// Renders with r's settings, in passes, until every pixel has
+// samples_per_pixel samples, starting where acc is (new, or loaded from a
+// checkpoint). Samples are traced like in r.render(cam, world, shade).
+// on_pass(acc) is called after every pass, e.g. to write a preview. r must
+// have no writer: the passes aren't images.
+template <typename Shade, typename OnPass>
+void render_progressive(
+  renderer& r, const camera& cam, const hittable& world, const Shade& shade,
+  const progressive_settings& settings, accumulation_buffer& acc,
+  const OnPass& on_pass
+);
+
+// What a checkpoint starts with: a tag, and the size of real, so that a float
+// build doesn't load the sums of a double one.
+const char accumulation_magic[8] = {'r', 't', 'a', 'c', 'c', '3', '\0', char(sizeof(real))};
+
+framebuffer accumulation_buffer::resolve() const {
+  framebuffer image(width, height);
+  for (int j = 0; j < height; ++j) {
+    for (int i = 0; i < width; ++i) {
+      // The corners of ever bigger blocks around (i, j), until a sampled one.
+      size_t p = size_t(j) * width + i;
+      for (unsigned mask = ~1u; !samples[p] && mask != 0; mask <<= 1) {
+        p = size_t(j & mask) * width + (i & mask);
+      }
+      if (samples[p]) {
+        image.at(i, j) = sums[p] / real(samples[p]);
+      }
+    }
+  }
+  return image;
+}
+
+bool accumulation_buffer::save(const std::string& path) const {
+  RT_TRACE_ZONE("save checkpoint");
+  const std::string temporary = path + ".tmp";
+  {
+    std::ofstream out(temporary, std::ios::binary);
+    int32_t header[4] = {width, height, passes_done, int32_t(sequence)};
+    out.write(accumulation_magic, sizeof(accumulation_magic));
+    out.write(reinterpret_cast<const char*>(header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(&seed), sizeof(seed));
+    out.write(
+      reinterpret_cast<const char*>(samples.data()),
+      samples.size() * sizeof(uint32_t)
+    );
+    out.write(
+      reinterpret_cast<const char*>(sums.data()), sums.size() * sizeof(color)
+    );
+    out.write(
+      reinterpret_cast<const char*>(luminance_squares.data()),
+      luminance_squares.size() * sizeof(real)
+    );
+    if (!out) {
+      std::cerr << "Failed to write checkpoint " << temporary << ".\n";
+      return false;
+    }
+  }
+  if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+    std::cerr << "Failed to rename " << temporary << " to " << path << ".\n";
+    return false;
+  }
+  return true;
+}
+
+bool accumulation_buffer::load(const std::string& path) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in) {
+    return false;
+  }
+
+  char magic[sizeof(accumulation_magic)];
+  int32_t header[4];
+  uint64_t file_seed;
+  in.read(magic, sizeof(magic));
+  in.read(reinterpret_cast<char*>(header), sizeof(header));
+  in.read(reinterpret_cast<char*>(&file_seed), sizeof(file_seed));
+  if (!in || std::memcmp(magic, accumulation_magic, sizeof(magic)) != 0
+    || header[0] != width || header[1] != height || file_seed != seed
+    || header[3] != int32_t(sequence)) {
+    std::cerr << path << " is a checkpoint of another render; ignoring it.\n";
+    return false;
+  }
+
+  std::vector<uint32_t> file_samples(samples.size());
+  std::vector<color> file_sums(sums.size());
+  std::vector<real> file_squares(luminance_squares.size());
+  in.read(
+    reinterpret_cast<char*>(file_samples.data()),
+    file_samples.size() * sizeof(uint32_t)
+  );
+  in.read(
+    reinterpret_cast<char*>(file_sums.data()), file_sums.size() * sizeof(color)
+  );
+  in.read(
+    reinterpret_cast<char*>(file_squares.data()),
+    file_squares.size() * sizeof(real)
+  );
+  if (!in) {
+    std::cerr << path << " is truncated; ignoring it.\n";
+    return false;
+  }
+
+  passes_done = header[2];
+  samples = std::move(file_samples);
+  sums = std::move(file_sums);
+  luminance_squares = std::move(file_squares);
+  return true;
+}
+
+real accumulation_buffer::error(size_t p) const {
+  const real n = real(samples[p]);
+  if (n < 2) {
+    return infinity;
+  }
+  const real mean = luminance(sums[p]) / n;
+  const real variance
+    = std::max(real(0), (luminance_squares[p] - n * mean * mean) / (n - 1));
+  // Dark pixels would need a lot of samples to get a small error after
+  // gamma, but nobody sees it; their error is taken as that of a dim gray.
+  return std::sqrt(variance / n) / (2 * std::sqrt(std::max(mean, real(0.01))));
+}
+
+void accumulation_buffer::update_converged(real threshold, int min_samples) {
+  std::vector<uint8_t> below(samples.size());
+  for (size_t p = 0; p < samples.size(); ++p) {
+    below[p] = samples[p] >= uint32_t(min_samples) && error(p) < threshold;
+  }
+  // A pixel is only converged if its neighbors are too: a pixel that got
+  // lucky with its first samples is likely to have a noisy neighbor.
+  for (int j = 0; j < height; ++j) {
+    for (int i = 0; i < width; ++i) {
+      bool all = true;
+      for (int y = std::max(0, j - 1); y <= std::min(height - 1, j + 1); ++y) {
+        for (int x = std::max(0, i - 1); x <= std::min(width - 1, i + 1); ++x) {
+          all = all && below[size_t(y) * width + x];
+        }
+      }
+      converged[size_t(j) * width + i] = all;
+    }
+  }
+}
+
+template <typename Shade, typename OnPass>
+void render_progressive(
+  renderer& r, const camera& cam, const hittable& world, const Shade& shade,
+  const progressive_settings& settings, accumulation_buffer& acc,
+  const OnPass& on_pass
+) {
+  const int width = r.settings.image_width;
+  const int spp = r.settings.samples_per_pixel;
+  auto last_checkpoint = std::chrono::steady_clock::now();
+
+  while (true) {
+    // How many samples the pass adds to pixel (i, j), which has taken
+    // first of them so far.
+    int stride = 0;
+    if (acc.passes_done < settings.preview_levels) {
+      stride = 1 << (settings.preview_levels - 1 - acc.passes_done);
+    }
+    if (settings.error_threshold > 0) {
+      acc.update_converged(
+        real(settings.error_threshold), settings.adaptive_min_samples
+      );
+    }
+    auto samples_for = [&](int i, int j, int first) {
+      if (stride) {
+        return first == 0 && i % stride == 0 && j % stride == 0 ? 1 : 0;
+      }
+      if (acc.converged[size_t(j) * width + i]) {
+        return 0;
+      }
+      return std::max(0, std::min(settings.samples_per_pass, spp - first));
+    };
+
+    if (!stride) {
+      bool done = true;
+      for (size_t p = 0; done && p < acc.samples.size(); ++p) {
+        done = acc.converged[p] || acc.samples[p] >= uint32_t(spp);
+      }
+      if (done) {
+        break;
+      }
+    }
+
+    RT_TRACE_ZONE_ARGS("pass", "pass", acc.passes_done, nullptr, 0);
+    std::vector<real> squares(acc.samples.size(), 0);
+    framebuffer pass = r.render_tiles([&](const tile& t, color* accumulated) {
+      for (int j = t.y0; j < t.y1; ++j) {
+        for (int i = t.x0; i < t.x1; ++i) {
+          size_t p = size_t(j) * width + i;
+          int first = int(acc.samples[p]);
+          int count = samples_for(i, j, first);
+          *accumulated++ = count
+            ? r.trace_samples(cam, world, shade, i, j, first, count, &squares[p])
+            : color(0.0, 0.0, 0.0);
+        }
+      }
+    });
+
+    for (int j = 0; j < r.settings.image_height; ++j) {
+      for (int i = 0; i < width; ++i) {
+        size_t p = size_t(j) * width + i;
+        int count = samples_for(i, j, int(acc.samples[p]));
+        acc.sums[p] += pass.pixels[p];
+        acc.luminance_squares[p] += squares[p];
+        acc.samples[p] += count;
+      }
+    }
+    ++acc.passes_done;
+    on_pass(acc);
+
+    auto now = std::chrono::steady_clock::now();
+    if (!settings.checkpoint_path.empty()
+      && std::chrono::duration<double>(now - last_checkpoint).count()
+        >= settings.checkpoint_seconds) {
+      acc.save(settings.checkpoint_path);
+      last_checkpoint = now;
+    }
+  }
+
+  if (!settings.checkpoint_path.empty()) {
+    acc.save(settings.checkpoint_path);
+  }
+}
+
+#endif
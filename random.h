@@ -0,0 +1,68 @@
+#ifndef RANDOM_H
+#define RANDOM_H
+
+#include <cstdint>
+#include <cstring>
+
+// SplitMix64's output function. It scrambles a 64-bit integer so well that
+// feeding it consecutive integers (times an odd constant) produces a sequence
+// that passes BigCrush. That's what makes the generator below counter-based:
+// the n-th number of a stream is mix64(key + n * gamma), so any element can be
+// computed without computing the ones before it.
+inline uint64_t mix64(uint64_t z) {
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+// Maps 64 random bits to a double in [0, 1). The top 52 bits become the
+// mantissa of a double in [1, 2), which is then shifted down to [0, 1).
+inline double bits_to_unit_double(uint64_t bits) {
+  uint64_t u = (bits >> 12) | 0x3ff0000000000000ULL;
+  double d;
+  std::memcpy(&d, &u, sizeof(d));
+  return d - 1.0;
+}
+
+// A 16-byte random number generator. Each stream is identified by a key, and
+// the counter is the dimension of the next number drawn from it.
+//
+// Used sequentially, with a per-thread key, it's an ordinary fast generator.
+// Used as a counter-based generator, the key is derived from (seed, pixel,
+// sample) and the counter starts at 0 for every pixel sample, so the numbers
+// a sample sees depend only on which sample it is, and never on which thread
+// rendered it or in what order the pixels were visited.
+class rng {
+public:
+  static constexpr uint64_t gamma = 0x9e3779b97f4a7c15ULL;
+  static constexpr uint64_t default_seed = 0x853c49e6748fea9bULL;
+
+  constexpr rng() : key(default_seed), counter(0) {}
+  constexpr explicit rng(uint64_t key) : key(key), counter(0) {}
+
+  // The stream of one sample of one pixel.
+  static rng for_sample(uint64_t seed, uint64_t pixel, uint64_t sample) {
+    return rng(mix64(mix64(seed + pixel * gamma) ^ (sample + 1) * gamma));
+  }
+
+  uint64_t next_bits() {
+    return mix64(key + ++counter * gamma);
+  }
+
+  double next_double() {
+    return bits_to_unit_double(next_bits());
+  }
+
+  uint64_t key;
+  uint64_t counter;
+};
+
+// The generator that random_double() draws from. Each thread has its own, so
+// drawing numbers takes no locks and shares no cache lines. The renderer
+// re-keys it for every pixel sample.
+inline rng& thread_rng() {
+  thread_local rng generator;
+  return generator;
+}
+
+#endif
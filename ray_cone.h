@@ -0,0 +1,39 @@
+#ifndef RAY_CONE_H
+#define RAY_CONE_H
+
+#include "common.h"
+
+#include "hittable.h"
+
+#include <algorithm>
+#include <cmath>
+
+// The cone of space a ray stands for: a camera ray stands for its whole
+// pixel, a cone that starts as a point at the lens and spreads by the angle
+// of one pixel (see camera::pixel_spread). Where it hits a surface, the
+// cone's width, stretched by how obliquely it meets the surface, is the
+// footprint a texture lookup should average over (see
+// hit_record::footprint); textures pick the level of their mip pyramid from
+// it, so that distant textures don't alias.
+//
+// Bounces carry the cone on from the hit with the same spread. That ignores
+// how curved surfaces and rough materials widen it, which makes the lookups
+// after a bounce sharper than they could be, never blurrier.
+struct ray_cone {
+  // The width at the ray's origin.
+  real width = 0;
+  // The angle by which the width grows with distance, in radians.
+  real spread = 0;
+
+  // Moves the cone along r to its hit rec, and sets rec.footprint. The cone
+  // is then the one of the ray that bounces off rec.
+  void reach(const ray& r, hit_record& rec) {
+    const real length = r.direction().length();
+    width += spread * rec.t * length;
+    // Glancing hits stretch the footprint, up to 100 times.
+    const real cosine = std::fabs(dot(r.direction(), rec.normal)) / length;
+    rec.footprint = width / std::max(cosine, real(0.01));
+  }
+};
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef RAY_PACKET_H
+#define RAY_PACKET_H
+
+#include "common.h"
+
+// How many rays a packet holds: one AVX2 register of floats.
+const int ray_packet_size = 8;
+
+// Up to ray_packet_size rays stored as a structure of arrays: the x
+// coordinates of all origins are contiguous, then the y's, and so on, so that
+// one SIMD register holds the same coordinate of every ray. Only the first
+// count rays are used.
+struct ray_packet {
+  ray get(int k) const {
+    return ray(
+      point3(origin[0][k], origin[1][k], origin[2][k]),
+      vec3(direction[0][k], direction[1][k], direction[2][k])
+    );
+  }
+
+  void set(int k, const ray& r) {
+    for (int a = 0; a < 3; ++a) {
+      origin[a][k] = r.origin()[a];
+      direction[a][k] = r.direction()[a];
+    }
+  }
+
+  alignas(32) real origin[3][ray_packet_size];
+  alignas(32) real direction[3][ray_packet_size];
+  int count = 0;
+};
+
+#endif
@@ -0,0 +1,345 @@
+#ifndef RENDERER_H
+#define RENDERER_H
+
+#include "common.h"
+
+#include "camera.h"
+#include "hittable.h"
+#include "image_writer.h"
+#include "ray_packet.h"
+#include "sampler.h"
+#include "stats.h"
+#include "thread_pool.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct render_settings {
+  int image_width = 384;
+  int image_height = 216;
+  int samples_per_pixel = 100;
+  // Tiles are tile_size x tile_size pixels; the ones on the right and top
+  // borders may be smaller.
+  int tile_size = 16;
+  // 0 means one thread per hardware thread.
+  unsigned thread_count = 0;
+  // Every pixel sample draws its random numbers from a sampler keyed by
+  // (seed, pixel, sample), so the same seed gives the same image no matter
+  // how many threads render it.
+  uint64_t seed = 0;
+  // What the samplers draw from.
+  sample_sequence sequence = sample_sequence::sobol;
+  // Where camera rays start when the renderer traces them itself.
+  double ray_t_min = 0.0;
+  bool show_progress = true;
+};
+
+// The accumulated (summed, not averaged) color samples of every pixel. Row 0
+// is the bottom of the image, like the j coordinate of the render loops.
+class framebuffer {
+public:
+  framebuffer(int width, int height)
+    : width(width), height(height), pixels(size_t(width) * height) {}
+
+  color& at(int i, int j) { return pixels[size_t(j) * width + i]; }
+  const color& at(int i, int j) const { return pixels[size_t(j) * width + i]; }
+
+  // Writes the image in one of image_writer's formats.
+  void write(
+    std::ostream& out, image_format format, int samples_per_pixel
+  ) const {
+    image_writer writer(out, format, width, height, samples_per_pixel);
+    writer.add_rows(0, height, pixels.data());
+    writer.finish();
+  }
+
+  // Writes an ASCII PPM, top row first.
+  void write_ppm(std::ostream& out, int samples_per_pixel) const {
+    out << "P3\n" << width << " " << height << "\n255\n";
+    for (int j = height - 1; j >= 0; --j) {
+      for (int i = 0; i < width; ++i) {
+        write_color(out, at(i, j), samples_per_pixel);
+      }
+    }
+  }
+
+  int width;
+  int height;
+  std::vector<color> pixels;
+};
+
+struct tile {
+  int x0, y0;
+  // One past the last pixel.
+  int x1, y1;
+};
+
+// A counter that workers bump when they finish a tile. Nobody ever waits on
+// it: a reporter thread polls it and prints progress, so the workers never
+// touch std::cerr or a lock.
+struct render_progress {
+  std::atomic<size_t> tiles_done{0};
+  size_t tile_count = 0;
+};
+
+class renderer {
+public:
+  renderer(const render_settings& settings)
+    : settings(settings), pool(settings.thread_count) {}
+
+  // Renders the image seen by cam. radiance(r, s) is called with every
+  // camera ray, and the sampler its bounces draw from, and must return the
+  // color carried by it; it's the ray_color of the render loops, and is
+  // called from several threads at once.
+  template <typename Radiance>
+  framebuffer render(const camera& cam, const Radiance& radiance);
+
+  // Same, but the renderer traces the camera rays through world itself, a
+  // ray_packet of samples of the same pixel at a time, and
+  // shade(r, hit, rec, s) continues from there: it's called with every
+  // camera ray, whether it hit anything and, if it did, its closest hit.
+  // Samples use the same random numbers as with render(cam, radiance), so
+  // the images match.
+  template <typename Shade>
+  framebuffer render(const camera& cam, const hittable& world, const Shade& shade);
+
+  // The sum of samples [first_sample, first_sample + sample_count) of pixel
+  // (i, j), traced like render(cam, world, shade) does. Sample s of a pixel
+  // is the same whichever call traces it, so the samples of a pixel can be
+  // split among calls (see progressive.h). If luminance_squares isn't null,
+  // the squares of the samples' luminances are added to it.
+  template <typename Shade>
+  color trace_samples(
+    const camera& cam, const hittable& world, const Shade& shade,
+    int i, int j, int first_sample, int sample_count,
+    real* luminance_squares = nullptr
+  ) const;
+
+  // What the renders above are built on, for integrators that work on a
+  // whole tile at a time: runs the tiles on the pool, and
+  // sample_tile(t, accumulated) must store the sum of the samples of every
+  // pixel of tile t in accumulated, row by row from the bottom.
+  template <typename SampleTile>
+  framebuffer render_tiles(const SampleTile& sample_tile);
+
+  std::vector<tile> make_tiles() const;
+
+  const render_settings settings;
+  work_stealing_pool pool;
+  render_progress progress;
+  // If set, every band of rows is handed to it as soon as the last tile of
+  // the band is done, so the image is written while the rest renders.
+  image_writer* writer = nullptr;
+
+private:
+  // sample_pixel(i, j) returns the sum of the samples of pixel (i, j).
+  template <typename SamplePixel>
+  framebuffer render_pixels(const SamplePixel& sample_pixel);
+
+  template <typename SampleTile>
+  void render_tile(
+    const tile& t, const SampleTile& sample_tile, framebuffer& image
+  );
+
+  void report_progress(bool& finished);
+
+  // Wakes the reporter up when the render is done, so that a render doesn't
+  // end with it asleep.
+  std::mutex report_lock;
+  std::condition_variable report_wakeup;
+};
+
+std::vector<tile> renderer::make_tiles() const {
+  std::vector<tile> tiles;
+  const int size = settings.tile_size;
+  // Top rows first, so that the image fills in the same order as the
+  // single-threaded scanline loop did.
+  for (int y1 = settings.image_height; y1 > 0; y1 -= size) {
+    int y0 = std::max(0, y1 - size);
+    for (int x0 = 0; x0 < settings.image_width; x0 += size) {
+      int x1 = std::min(settings.image_width, x0 + size);
+      tiles.push_back({x0, y0, x1, y1});
+    }
+  }
+  return tiles;
+}
+
+template <typename Radiance>
+framebuffer renderer::render(const camera& cam, const Radiance& radiance) {
+  return render_pixels([&](int i, int j) {
+    color pixel_color(0.0, 0.0, 0.0);
+    for (int s = 0; s < settings.samples_per_pixel; ++s) {
+      sampler samples(
+        settings.sequence, settings.seed, i, j, settings.image_width, s
+      );
+      // Draw from [0, 1). It's important that it not be 1, because we don't
+      // want to step on the neighboring pixel.
+      double film_u, film_v;
+      samples.get_2d(film_u, film_v);
+      auto u = (double(i) + film_u) / (settings.image_width - 1);
+      auto v = (double(j) + film_v) / (settings.image_height - 1);
+      ray r = cam.get_ray(u, v, samples);
+      RT_STAT(++thread_stats().camera_rays);
+      pixel_color += radiance(r, samples);
+    }
+    return pixel_color;
+  });
+}
+
+template <typename Shade>
+framebuffer renderer::render(
+  const camera& cam, const hittable& world, const Shade& shade
+) {
+  return render_pixels([&](int i, int j) {
+    return trace_samples(cam, world, shade, i, j, 0, settings.samples_per_pixel);
+  });
+}
+
+template <typename Shade>
+color renderer::trace_samples(
+  const camera& cam, const hittable& world, const Shade& shade,
+  int i, int j, int first_sample, int sample_count, real* luminance_squares
+) const {
+  color pixel_color(0.0, 0.0, 0.0);
+  const int end = first_sample + sample_count;
+  for (int s0 = first_sample; s0 < end; s0 += ray_packet_size) {
+    const int count = std::min(ray_packet_size, end - s0);
+
+    // Draw the film and lens samples of every ray from its own sampler, and
+    // keep the samplers to shade each ray with the dimensions that follow.
+    double u[ray_packet_size], v[ray_packet_size];
+    vec3 lens[ray_packet_size];
+    sampler samplers[ray_packet_size];
+    for (int k = 0; k < count; ++k) {
+      samplers[k] = sampler(
+        settings.sequence, settings.seed, i, j, settings.image_width, s0 + k
+      );
+      double film_u, film_v;
+      samplers[k].get_2d(film_u, film_v);
+      u[k] = (double(i) + film_u) / (settings.image_width - 1);
+      v[k] = (double(j) + film_v) / (settings.image_height - 1);
+      lens[k] = cam.sample_lens(samplers[k]);
+    }
+
+    ray_packet packet;
+    cam.get_rays(count, u, v, lens, packet);
+    RT_STAT(thread_stats().camera_rays += count);
+    hit_record rec[ray_packet_size];
+    unsigned hits = world.hit_packet(packet, settings.ray_t_min, infinity, rec);
+
+    for (int k = 0; k < count; ++k) {
+      color sample_color
+        = shade(packet.get(k), ((hits >> k) & 1) != 0, rec[k], samplers[k]);
+      pixel_color += sample_color;
+      if (luminance_squares) {
+        real y = luminance(sample_color);
+        *luminance_squares += y * y;
+      }
+    }
+  }
+  return pixel_color;
+}
+
+template <typename SamplePixel>
+framebuffer renderer::render_pixels(const SamplePixel& sample_pixel) {
+  return render_tiles([&](const tile& t, color* accumulated) {
+    for (int j = t.y0; j < t.y1; ++j) {
+      for (int i = t.x0; i < t.x1; ++i) {
+        *accumulated++ = sample_pixel(i, j);
+      }
+    }
+  });
+}
+
+template <typename SampleTile>
+framebuffer renderer::render_tiles(const SampleTile& sample_tile) {
+  RT_TRACE_ZONE("render");
+  framebuffer image(settings.image_width, settings.image_height);
+  std::vector<tile> tiles = make_tiles();
+
+  progress.tiles_done = 0;
+  progress.tile_count = tiles.size();
+
+  bool finished = false;
+  std::thread reporter;
+  if (settings.show_progress) {
+    reporter = std::thread([this, &finished] { report_progress(finished); });
+  }
+
+  // The tiles of every band of rows that aren't done yet. The worker that
+  // finishes the last one hands the band to the writer; the acquire-release
+  // decrement makes the other tiles' pixels visible to it.
+  const int size = settings.tile_size;
+  const int tiles_per_band = (settings.image_width + size - 1) / size;
+  std::vector<std::atomic<int>> tiles_left((settings.image_height + size - 1) / size);
+  for (auto& left : tiles_left) {
+    left = tiles_per_band;
+  }
+
+  pool.parallel_for(tiles.size(), [&](size_t index, unsigned) {
+    const tile& t = tiles[index];
+    render_tile(t, sample_tile, image);
+    if (writer
+      && tiles_left[(settings.image_height - t.y1) / size].fetch_sub(1) == 1) {
+      writer->add_rows(t.y0, t.y1, &image.at(0, t.y0));
+    }
+  });
+
+  {
+    std::lock_guard<std::mutex> guard(report_lock);
+    finished = true;
+  }
+  report_wakeup.notify_one();
+  if (reporter.joinable()) {
+    reporter.join();
+  }
+
+  return image;
+}
+
+template <typename SampleTile>
+void renderer::render_tile(
+  const tile& t, const SampleTile& sample_tile, framebuffer& image
+) {
+  RT_TRACE_ZONE_ARGS("tile", "x", t.x0, "y", t.y0);
+  const int tile_width = t.x1 - t.x0;
+  // Accumulate into a buffer that belongs to this tile only, and copy it into
+  // the image at the end. Tiles don't overlap, so no two workers ever write
+  // the same pixel, and the tile buffer stays in this core's cache.
+  std::vector<color> accumulated(size_t(tile_width) * (t.y1 - t.y0));
+  sample_tile(t, accumulated.data());
+
+  for (int j = t.y0; j < t.y1; ++j) {
+    std::copy_n(
+      &accumulated[size_t(j - t.y0) * tile_width], tile_width, &image.at(t.x0, j)
+    );
+  }
+
+  progress.tiles_done.fetch_add(1, std::memory_order_relaxed);
+}
+
+void renderer::report_progress(bool& finished) {
+  size_t last_reported = size_t(-1);
+  std::unique_lock<std::mutex> guard(report_lock);
+  while (!finished) {
+    size_t done = progress.tiles_done.load(std::memory_order_relaxed);
+    if (done != last_reported) {
+      std::cerr << "\rTiles remaining: " << progress.tile_count - done << " "
+        << std::flush;
+      last_reported = done;
+    }
+    report_wakeup.wait_for(
+      guard, std::chrono::milliseconds(100), [&] { return finished; }
+    );
+  }
+  std::cerr << "\rTiles remaining: 0 " << std::flush;
+}
+
+#endif
@@ -0,0 +1,436 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "random.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <vector>
+
+// The sequences a sampler can draw from:
+//
+//   random:     independent uniform numbers, from the rng stream of the
+//               sample.
+//   halton:     the Halton sequence, with a prime base per dimension, and
+//               the digits of every dimension of every pixel scrambled by a
+//               random permutation.
+//   sobol:      the first two dimensions of the Sobol sequence, for every
+//               pair of dimensions, Owen-scrambled, and in a shuffled order,
+//               by a hash of (seed, pixel, dimension). Every pair is then a
+//               (0, 2)-sequence of its own: the first 2^k samples of a pixel
+//               have one sample in every 2^-a x 2^-(k-a) box of the pair.
+//   blue_noise: the Sobol points of sobol, but scrambled by dimension only,
+//               so that they're the same in every pixel, and rotated (mod 1)
+//               by a tiled blue noise mask. The errors of neighboring
+//               pixels no longer correlate, and the noise left at low sample
+//               counts is high-frequency, which the eye blurs away.
+//
+// All of them are sampled by (seed, pixel, sample, dimension), so the
+// numbers of a sample don't depend on which thread traces it, or when.
+enum class sample_sequence { random, halton, sobol, blue_noise };
+
+// The sequence called name ("random", "halton", "sobol" or "bluenoise"), for
+// command lines and scene files. Returns false if there's none.
+inline bool sample_sequence_named(const std::string& name, sample_sequence& sequence) {
+  static const char* const names[] = {"random", "halton", "sobol", "bluenoise"};
+  for (int n = 0; n < 4; ++n) {
+    if (name == names[n]) {
+      sequence = sample_sequence(n);
+      return true;
+    }
+  }
+  return false;
+}
+
+// The dimensions of a path. The camera has the first camera_dimensions of
+// them (the film position, then the lens), and bounce n the bounce_dimensions
+// from camera_dimensions + n * bounce_dimensions, so that a bounce draws from
+// the same dimensions in every sample, whatever the bounces before it drew.
+// What a bounce draws past its budget comes from the random stream. The
+// warps of sampling.h take a fixed number of dimensions, so that the
+// materials here draw 2 and 1 more for the roulette.
+const uint32_t camera_dimensions = 4;
+const uint32_t bounce_dimensions = 8;
+
+// Halton dimensions past this many fall back to the random stream: the
+// Halton sequence in large bases is barely better than random anyway.
+const uint32_t halton_dimensions = 256;
+
+// The blue noise mask is blue_noise_size x blue_noise_size pixels, and tiles
+// the image.
+const int blue_noise_size = 64;
+
+// The numbers of one sample of one pixel: the film position, the lens and
+// every bounce of its path draw from it. It's a small value, so that a path
+// can carry it from bounce to bounce (see wavefront.h).
+class sampler {
+public:
+  // Sample index of pixel (i, j) of an image width pixels wide.
+  sampler(
+    sample_sequence sequence, uint64_t seed, int i, int j, int width,
+    uint32_t index
+  );
+
+  // Independent numbers drawn from stream, for the loops that don't keep a
+  // sampler per sample.
+  explicit sampler(const rng& stream)
+    : stream(stream), sequence(sample_sequence::random) {}
+
+  sampler() : sampler(rng()) {}
+
+  // The next dimension, in [0, 1).
+  double get_1d();
+
+  // The next two dimensions, as a point of the unit square. The points of a
+  // pixel's samples are stratified in 2D, not just in each dimension.
+  void get_2d(double& u, double& v);
+
+  // Moves on to the dimensions of bounce depth (the first is 0).
+  void start_bounce(int depth) {
+    dimension = camera_dimensions + uint32_t(depth) * bounce_dimensions;
+    dimension_end = dimension + bounce_dimensions;
+  }
+
+  // The random numbers past the budget of the camera or a bounce, and all of
+  // them with sample_sequence::random.
+  rng stream;
+
+private:
+  // A 64-bit hash of dimension d of the pixel (or of the image, for blue
+  // noise), whose bits seed the scrambles of d.
+  uint64_t dimension_hash(uint32_t d) const {
+    return mix64(key ^ (uint64_t(d) + 1) * rng::gamma);
+  }
+
+  double halton(uint32_t d) const;
+  // Sobol dimensions 0 and 1 (if v isn't null) of the shuffled sample,
+  // scrambled.
+  void sobol(uint32_t d, uint32_t& u, uint32_t* v) const;
+  // The blue noise mask at the pixel, for dimension d, shifted by a hash of
+  // d (and component), so that dimensions don't share a mask.
+  double blue_noise(uint32_t d, int component) const;
+
+  sample_sequence sequence;
+  uint32_t index = 0;
+  uint32_t reversed_index = 0;
+  uint32_t x = 0, y = 0;
+  uint32_t dimension = 0;
+  uint32_t dimension_end = camera_dimensions;
+  // Where the scrambles of every dimension come from.
+  uint64_t key = 0;
+};
+
+// The bits of x in reverse order.
+inline uint32_t reverse_bits(uint32_t x) {
+#if defined(__GNUC__)
+  x = __builtin_bswap32(x);
+#else
+  x = (x << 16) | (x >> 16);
+  x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+#endif
+  x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+  x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+  x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+  return x;
+}
+
+// A hash where every bit of the result only depends on the bits of x at and
+// below it (Laine and Karras, with Burley's constants).
+inline uint32_t laine_karras_permutation(uint32_t x, uint32_t seed) {
+  x += seed;
+  x ^= x * 0x6c50b47cu;
+  x ^= x * 0xb82f1e52u;
+  x ^= x * 0xc7afe638u;
+  x ^= x * 0x8d22f6e6u;
+  return x;
+}
+
+// An Owen scramble of the 32-bit fraction x: whether a bit is flipped depends
+// on the bits above it and on seed. It keeps the stratification of a
+// sequence, and makes the strata of different seeds independent.
+inline uint32_t owen_scramble(uint32_t x, uint32_t seed) {
+  return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+}
+
+// The first two dimensions of the Sobol sequence, as 32-bit fractions. The
+// first is the van der Corput sequence; the direction numbers of the second
+// are the rows of Pascal's triangle mod 2.
+inline uint32_t sobol_0(uint32_t index) {
+  return reverse_bits(index);
+}
+
+inline uint32_t sobol_1(uint32_t index) {
+  // It's linear in the bits of index (over GF(2)), so it's summed from a
+  // table per byte of index rather than bit by bit.
+  static const std::vector<uint32_t> tables = [] {
+    std::vector<uint32_t> t(4 * 256, 0);
+    uint32_t directions[32];
+    directions[0] = 1u << 31;
+    for (int k = 1; k < 32; ++k) {
+      directions[k] = directions[k - 1] ^ (directions[k - 1] >> 1);
+    }
+    for (int byte = 0; byte < 4; ++byte) {
+      for (int value = 0; value < 256; ++value) {
+        for (int bit = 0; bit < 8; ++bit) {
+          if (value & (1 << bit)) {
+            t[byte * 256 + value] ^= directions[byte * 8 + bit];
+          }
+        }
+      }
+    }
+    return t;
+  }();
+  return tables[index & 0xff] ^ tables[256 + ((index >> 8) & 0xff)]
+    ^ tables[512 + ((index >> 16) & 0xff)] ^ tables[768 + (index >> 24)];
+}
+
+// A 32-bit fraction as a double in [0, 1).
+inline double fraction_to_double(uint32_t bits) {
+  return bits * (1.0 / 4294967296.0);
+}
+
+// The first halton_dimensions primes, the bases of the Halton dimensions.
+inline const std::vector<uint32_t>& halton_bases() {
+  static const std::vector<uint32_t> primes = [] {
+    std::vector<uint32_t> p;
+    for (uint32_t n = 2; p.size() < halton_dimensions; ++n) {
+      bool prime = true;
+      for (size_t k = 0; prime && k < p.size() && p[k] * p[k] <= n; ++k) {
+        prime = n % p[k] != 0;
+      }
+      if (prime) {
+        p.push_back(n);
+      }
+    }
+    return p;
+  }();
+  return primes;
+}
+
+// The radical inverse of index in base: its digits mirrored around the
+// point. Every digit d of the result is scrambled to (a d + c) mod base,
+// with a (not 0) and c drawn from scrambles for every digit: base is prime,
+// so that's a permutation of the digits, which keeps the strata of the
+// sequence. Shifting digits only (a = 1) would not do: the first n < base
+// samples of a dimension would be in n strata next to each other. Digits
+// are summed down to 2^-32, like the other sequences.
+inline double scrambled_radical_inverse(
+  uint32_t index, uint32_t base, uint64_t scrambles
+) {
+  if (base == 2) {
+    // The only permutation mod 2 besides the identity is a flip.
+    return fraction_to_double(reverse_bits(index) ^ uint32_t(scrambles));
+  }
+  const double inverse_base = 1.0 / base;
+  double result = 0.0;
+  for (double weight = inverse_base; weight > 1.0 / 4294967296.0;
+    weight *= inverse_base) {
+    scrambles = scrambles * 6364136223846793005ULL + 1442695040888963407ULL;
+    const uint32_t a = 1 + uint32_t(((scrambles >> 32) * (base - 1)) >> 32);
+    const uint32_t c = uint32_t(((scrambles & 0xffffffffu) * base) >> 32);
+    const uint32_t digit = index % base;
+    index /= base;
+    result += ((a * digit + c) % base) * weight;
+  }
+  return std::min(result, 1.0 - std::numeric_limits<double>::epsilon());
+}
+
+// Builds a blue noise dither mask by Ulichney's void-and-cluster method:
+// every pixel gets a distinct rank, and the pixels with ranks below any n
+// are spread as evenly as they can be, with no low frequencies. The energy
+// of a pixel is the Gaussian-weighted count of set pixels around it; a
+// tightest cluster is the set pixel with the most energy, and a largest void
+// the unset pixel with the least. (Ulichney swaps the roles of set and unset
+// pixels past half of the ranks; filling voids to the end is close enough
+// for a mask.)
+inline std::vector<uint16_t> make_blue_noise_mask() {
+  const int n = blue_noise_size;
+  const int count = n * n;
+  const double sigma = 1.5;
+
+  // The energy a set pixel adds to the pixel (dx, dy) from it. The mask
+  // tiles, so distances wrap around.
+  std::vector<double> kernel(count);
+  for (int dy = 0; dy < n; ++dy) {
+    for (int dx = 0; dx < n; ++dx) {
+      int wx = std::min(dx, n - dx);
+      int wy = std::min(dy, n - dy);
+      kernel[dy * n + dx] = std::exp(-(wx * wx + wy * wy) / (2 * sigma * sigma));
+    }
+  }
+
+  std::vector<uint8_t> set(count, 0);
+  std::vector<double> energy(count, 0.0);
+  auto toggle = [&](int p, bool on) {
+    set[p] = on;
+    const double sign = on ? 1.0 : -1.0;
+    const int px = p % n, py = p / n;
+    for (int y = 0; y < n; ++y) {
+      const double* row = &kernel[((y - py) & (n - 1)) * n];
+      for (int x = 0; x < n; ++x) {
+        energy[y * n + x] += sign * row[(x - px) & (n - 1)];
+      }
+    }
+  };
+  auto tightest_cluster = [&] {
+    int best = -1;
+    for (int p = 0; p < count; ++p) {
+      if (set[p] && (best < 0 || energy[p] > energy[best])) {
+        best = p;
+      }
+    }
+    return best;
+  };
+  auto largest_void = [&] {
+    int best = -1;
+    for (int p = 0; p < count; ++p) {
+      if (!set[p] && (best < 0 || energy[p] < energy[best])) {
+        best = p;
+      }
+    }
+    return best;
+  };
+
+  // A tenth of the pixels at random, then evened out: the tightest cluster
+  // moves to the largest void until it would move back to where it was.
+  const int initial = count / 10;
+  rng stream(rng::default_seed);
+  for (int k = 0; k < initial;) {
+    int p = int(stream.next_bits() % count);
+    if (!set[p]) {
+      toggle(p, true);
+      ++k;
+    }
+  }
+  for (int moves = 0; moves < count; ++moves) {
+    int cluster = tightest_cluster();
+    toggle(cluster, false);
+    int gap = largest_void();
+    toggle(gap, true);
+    if (gap == cluster) {
+      break;
+    }
+  }
+  const std::vector<uint8_t> initial_set = set;
+  const std::vector<double> initial_energy = energy;
+
+  std::vector<uint16_t> rank(count);
+  // The initial pixels take the ranks below initial, tightest clusters last.
+  for (int r = initial - 1; r >= 0; --r) {
+    int cluster = tightest_cluster();
+    toggle(cluster, false);
+    rank[cluster] = uint16_t(r);
+  }
+  // The others, from the initial pattern, largest voids first.
+  set = initial_set;
+  energy = initial_energy;
+  for (int r = initial; r < count; ++r) {
+    int gap = largest_void();
+    toggle(gap, true);
+    rank[gap] = uint16_t(r);
+  }
+  return rank;
+}
+
+// The mask, built the first time it's needed (it takes a few tens of
+// milliseconds).
+inline const std::vector<uint16_t>& blue_noise_mask() {
+  static const std::vector<uint16_t> mask = make_blue_noise_mask();
+  return mask;
+}
+
+sampler::sampler(
+  sample_sequence sequence, uint64_t seed, int i, int j, int width,
+  uint32_t index
+) : stream(rng::for_sample(seed, uint64_t(j) * width + i, index)),
+    sequence(sequence), index(index), reversed_index(reverse_bits(index)),
+    x(uint32_t(i)), y(uint32_t(j)) {
+  if (sequence == sample_sequence::blue_noise) {
+    key = mix64(seed);
+  } else {
+    key = mix64(seed + (uint64_t(j) * width + i) * rng::gamma);
+  }
+}
+
+double sampler::get_1d() {
+  if (sequence == sample_sequence::random || dimension >= dimension_end) {
+    return stream.next_double();
+  }
+  const uint32_t d = dimension++;
+  switch (sequence) {
+  case sample_sequence::halton:
+    return d < halton_dimensions ? halton(d) : stream.next_double();
+  case sample_sequence::sobol: {
+    uint32_t u;
+    sobol(d, u, nullptr);
+    return fraction_to_double(u);
+  }
+  case sample_sequence::blue_noise: {
+    uint32_t u;
+    sobol(d, u, nullptr);
+    double value = fraction_to_double(u) + blue_noise(d, 0);
+    return value < 1.0 ? value : value - 1.0;
+  }
+  default:
+    return stream.next_double();
+  }
+}
+
+void sampler::get_2d(double& u, double& v) {
+  if (sequence == sample_sequence::random || dimension + 1 >= dimension_end
+    || (sequence == sample_sequence::halton
+      && dimension + 1 >= halton_dimensions)) {
+    dimension = std::max(dimension, dimension_end);
+    u = stream.next_double();
+    v = stream.next_double();
+    return;
+  }
+  const uint32_t d = dimension;
+  dimension += 2;
+  if (sequence == sample_sequence::halton) {
+    u = halton(d);
+    v = halton(d + 1);
+    return;
+  }
+  uint32_t a, b;
+  sobol(d, a, &b);
+  u = fraction_to_double(a);
+  v = fraction_to_double(b);
+  if (sequence == sample_sequence::blue_noise) {
+    u += blue_noise(d, 0);
+    v += blue_noise(d, 1);
+    u = u < 1.0 ? u : u - 1.0;
+    v = v < 1.0 ? v : v - 1.0;
+  }
+}
+
+double sampler::halton(uint32_t d) const {
+  return scrambled_radical_inverse(index, halton_bases()[d], dimension_hash(d));
+}
+
+void sampler::sobol(uint32_t d, uint32_t& u, uint32_t* v) const {
+  const uint64_t hash = dimension_hash(d);
+  // Shuffling the samples by an Owen scramble of their indices keeps every
+  // power-of-2 prefix a (0, 2)-net, and decorrelates the pairs. The
+  // reversals of owen_scramble that cancel out are left out.
+  const uint32_t shuffled
+    = reverse_bits(laine_karras_permutation(reversed_index, uint32_t(hash)));
+  u = reverse_bits(laine_karras_permutation(shuffled, uint32_t(hash >> 32)));
+  if (v) {
+    *v = owen_scramble(sobol_1(shuffled), uint32_t((hash * rng::gamma) >> 32));
+  }
+}
+
+double sampler::blue_noise(uint32_t d, int component) const {
+  const uint64_t shift = mix64(dimension_hash(d) + uint64_t(component) + 1);
+  const int mask = blue_noise_size - 1;
+  const int mx = int((x + shift) & mask);
+  const int my = int((y + (shift >> 32)) & mask);
+  return (blue_noise_mask()[my * blue_noise_size + mx] + 0.5)
+    / (blue_noise_size * blue_noise_size);
+}
+
+#endif
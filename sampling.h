@@ -0,0 +1,75 @@
+#ifndef SAMPLING_H
+#define SAMPLING_H
+
+#include "common.h"
+
+#include <algorithm>
+#include <cmath>
+
+// Warps of the unit square onto the shapes the tracer samples. Every warp
+// takes exactly two numbers in [0, 1), so that it draws the same dimensions
+// of a sampler every time (see sampler.h), and maps nearby points to nearby
+// points, so that stratified samples stay stratified. They are closed-form
+// and branch-free (the ?: are selects), so that loops over them vectorize.
+
+// The concentric map of Shirley and Chiu, onto the unit disk in the xy
+// plane: squares around the center of the square go to circles around the
+// center of the disk, so it distorts strata much less than taking u as the
+// radius and v as the angle would.
+inline vec3 concentric_disk(double u, double v) {
+  const double a = 2 * u - 1;
+  const double b = 2 * v - 1;
+  // In the left and right quarters of the square, the radius is |a| and the
+  // angle goes with b / a; in the top and bottom ones, the other way around.
+  const bool sides = std::abs(a) > std::abs(b);
+  const double radius = sides ? a : b;
+  const double ratio = sides ? b / (a != 0 ? a : 1) : a / (b != 0 ? b : 1);
+  const double phi = sides ? (pi / 4) * ratio : pi / 2 - (pi / 4) * ratio;
+  return vec3(radius * std::cos(phi), radius * std::sin(phi), 0);
+}
+
+// Uniform on the unit sphere: z is uniform in [-1, 1] (Archimedes' hat-box
+// theorem), and the angle around z in [0, 2 pi).
+inline vec3 uniform_sphere(double u, double v) {
+  const double z = 1 - 2 * u;
+  const double r = std::sqrt(std::max(0.0, 1 - z * z));
+  const double phi = 2 * pi * v;
+  return vec3(r * std::cos(phi), r * std::sin(phi), z);
+}
+
+// Cosine-weighted on the hemisphere around +z, a Lambertian bounce: the
+// concentric disk, lifted onto the hemisphere (Malley's method).
+inline vec3 cosine_hemisphere(double u, double v) {
+  const vec3 d = concentric_disk(u, v);
+  const double r2 = double(d.x()) * d.x() + double(d.y()) * d.y();
+  const double z = std::sqrt(std::max(0.0, 1 - r2));
+  return vec3(d.x(), d.y(), z);
+}
+
+// Uniform on the cap of the unit sphere around +z whose directions are at
+// most acos(cos_theta_max) from it: the cosine is uniform in
+// [cos_theta_max, 1].
+inline vec3 uniform_cone(double u, double v, double cos_theta_max) {
+  const double cos_theta = 1 - u * (1 - cos_theta_max);
+  const double sin_theta = std::sqrt(std::max(0.0, 1 - cos_theta * cos_theta));
+  const double phi = 2 * pi * v;
+  return vec3(sin_theta * std::cos(phi), sin_theta * std::sin(phi), cos_theta);
+}
+
+// Two unit vectors that make an orthonormal basis with the unit vector n,
+// without a branch (Duff et al., "Building an Orthonormal Basis, Revisited").
+// Directions sampled around +z are turned to go around n with to_basis.
+inline void orthonormal_basis(const vec3& n, vec3& b1, vec3& b2) {
+  const real sign = std::copysign(real(1), n.z());
+  const real a = -1 / (sign + n.z());
+  const real b = n.x() * n.y() * a;
+  b1 = vec3(1 + sign * n.x() * n.x() * a, sign * b, -sign * n.x());
+  b2 = vec3(b, sign + n.y() * n.y() * a, -n.y());
+}
+
+// d, given in the basis (b1, b2, n), in world coordinates.
+inline vec3 to_basis(const vec3& d, const vec3& b1, const vec3& b2, const vec3& n) {
+  return d.x() * b1 + d.y() * b2 + d.z() * n;
+}
+
+#endif
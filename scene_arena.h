@@ -0,0 +1,125 @@
+#ifndef SCENE_ARENA_H
+#define SCENE_ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Owns the objects of a scene (hittables, materials, BVH nodes), which are
+// placed one after the other in big blocks of memory instead of allocated one
+// by one. Everything else refers to them by plain pointer: they live as long
+// as the arena, so no reference needs counting, and copying a pointer into a
+// hit record costs nothing, where copying a shared_ptr is two atomic
+// operations on a counter that every thread hitting the same object shares.
+//
+// A scene that fits in the first block is freed with a single free. Objects
+// are destroyed in the reverse of the order they were made in; those that
+// don't need destroying (spheres, materials) aren't even visited.
+class scene_arena {
+public:
+  explicit scene_arena(size_t block_size = size_t(1) << 20)
+    : block_size(block_size) {}
+
+  scene_arena(const scene_arena&) = delete;
+  scene_arena& operator=(const scene_arena&) = delete;
+
+  ~scene_arena() {
+    for (destructor* d = destructors; d; d = d->next) {
+      d->destroy(d->object);
+    }
+    while (blocks) {
+      block* previous = blocks->previous;
+      std::free(blocks);
+      blocks = previous;
+    }
+  }
+
+  // Constructs a T in the arena and returns it. It's destroyed with the
+  // arena.
+  template <typename T, typename... Args>
+  T* make(Args&&... args) {
+    if (std::is_trivially_destructible<T>::value) {
+      return new (allocate(sizeof(T), alignof(T)))
+        T(std::forward<Args>(args)...);
+    }
+    destructor* d = static_cast<destructor*>(
+      allocate(sizeof(destructor), alignof(destructor))
+    );
+    T* object = new (allocate(sizeof(T), alignof(T)))
+      T(std::forward<Args>(args)...);
+    *d = {[](void* p) { static_cast<T*>(p)->~T(); }, object, destructors};
+    destructors = d;
+    return object;
+  }
+
+  // Room for count objects of type T, in a single block, for the caller to
+  // construct with placement new; from several threads at once if it likes,
+  // which make can't do. T must be trivially destructible, since the arena
+  // doesn't know which of them were constructed.
+  template <typename T>
+  T* allocate_array(size_t count) {
+    static_assert(
+      std::is_trivially_destructible<T>::value,
+      "allocate_array doesn't destroy its objects"
+    );
+    return static_cast<T*>(allocate(sizeof(T) * count, alignof(T)));
+  }
+
+  // Bytes of the objects made so far, not counting alignment padding.
+  size_t bytes_used() const { return used; }
+
+private:
+  struct block {
+    block* previous;
+  };
+
+  struct destructor {
+    void (*destroy)(void*);
+    void* object;
+    destructor* next;
+  };
+
+  static char* align(char* p, size_t alignment) {
+    return reinterpret_cast<char*>(
+      (reinterpret_cast<uintptr_t>(p) + alignment - 1) & ~uintptr_t(alignment - 1)
+    );
+  }
+
+  void* allocate(size_t size, size_t alignment) {
+    char* start = align(next, alignment);
+    if (!blocks || start > end || size > size_t(end - start)) {
+      // Objects bigger than a block get a block of their own.
+      size_t bytes = sizeof(block) + alignment + size;
+      if (bytes < block_size) {
+        bytes = block_size;
+      }
+      block* b = static_cast<block*>(std::malloc(bytes));
+      if (!b) {
+        throw std::bad_alloc();
+      }
+      b->previous = blocks;
+      blocks = b;
+      end = reinterpret_cast<char*>(b) + bytes;
+      start = align(reinterpret_cast<char*>(b + 1), alignment);
+    }
+    next = start + size;
+    used += size;
+    return start;
+  }
+
+  size_t block_size;
+  // The newest block, which objects are made in; the others are chained
+  // behind it.
+  block* blocks = nullptr;
+  // The free space of the newest block.
+  char* next = nullptr;
+  char* end = nullptr;
+  size_t used = 0;
+  // The objects to destroy, newest first.
+  destructor* destructors = nullptr;
+};
+
+#endif
@@ -0,0 +1,551 @@
+#ifndef SCENE_BINARY_H
+#define SCENE_BINARY_H
+
+#include "common.h"
+
+#include "aabb.h"
+#include "bvh8.h"
+#include "camera.h"
+#include "flat_array.h"
+#include "material.h"
+#include "scene_arena.h"
+#include "scene_file.h"
+#include "sphere_set.h"
+#include "texture.h"
+#include "trace.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Scenes of spheres in a binary file that is used where it lies instead of
+// being read: a built sphere_set, its BVH8 and its arrays as they are in
+// memory, its materials and textures, and the render settings and camera of
+// the scene it came from. Files end in .rtscene; compile_scene makes them out
+// of text scenes (see scene_file.h).
+//
+// Loading one maps the file and points the arrays of a sphere_set at it (see
+// flat_array.h): nothing is parsed, copied or built but the few materials and
+// textures, so the first pixel of a scene of 10M spheres starts in
+// milliseconds instead of the seconds it takes to parse it and build its tree.
+// Pages of the file are only read when a ray first gets to them, and every
+// process that renders the same file shares one copy of it, in the page
+// cache. Its spheres are those of the sphere_set, rounded to float (see
+// sphere_set.h), so it renders like its text scene does with the "spheres"
+// accelerator, not always like it does with the others.
+//
+// The file is a header followed by sections, each a plain array. Sections are
+// found by their offset from the start of the file, never by address, and
+// start on 64-byte boundaries, so that they're as aligned as the arrays they
+// stand for (mappings start on a page). Materials and textures refer to each
+// other by index into their sections, and so do surfaces to materials.
+//
+// The arrays are saved in the layout of the build that saves them, so a file
+// only loads in a build with the same layout: the header has a version, which
+// changes whenever the layout of the file or of its arrays does, the size of
+// real, and a number that reads differently in the other byte order. The
+// loader checks those, and that every section is inside the file, but not
+// what's in the spheres' sections, which would mean reading all of them.
+
+// What a binary scene starts with: a tag, and the size of real, like
+// checkpoints (see progressive.h).
+const char scene_binary_magic[8]
+  = {'r', 't', 's', 'c', 'n', '\0', '\0', char(sizeof(real))};
+const uint32_t scene_binary_version = 2;
+const uint32_t scene_binary_byte_order = 0x01020304;
+const uint64_t scene_binary_alignment = 64;
+
+struct scene_binary_section {
+  uint64_t offset;
+  uint64_t count;
+};
+
+struct scene_binary_texture {
+  enum kind_type : uint32_t { constant, checker };
+  uint32_t kind;
+  // The indices of the checker's textures, which come before it.
+  uint32_t even;
+  uint32_t odd;
+  uint32_t padding;
+  double color[3];
+  double scale;
+};
+
+struct scene_binary_material {
+  // A material_type, never other.
+  uint32_t type;
+  // The index of the albedo texture of a lambertian, or -1.
+  int32_t texture;
+  double albedo[3];
+  // The fuzz of a fuzzy, or the refractive index of a dielectric.
+  double parameter;
+};
+
+struct scene_binary_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+
+  int32_t image_width;
+  int32_t image_height;
+  int32_t samples_per_pixel;
+  int32_t tile_size;
+  int32_t max_depth;
+  int32_t sequence;
+  uint64_t seed;
+  double error_threshold;
+
+  uint64_t sphere_count;
+  double bounds[2][3];
+  uint32_t has_camera;
+  uint32_t padding;
+  alignas(8) unsigned char cam[sizeof(camera)];
+
+  scene_binary_section center_x;
+  scene_binary_section center_y;
+  scene_binary_section center_z;
+  scene_binary_section radius;
+  scene_binary_section surface_index;
+  scene_binary_section surfaces;
+  scene_binary_section nodes;
+  scene_binary_section materials;
+  scene_binary_section textures;
+};
+
+static_assert(
+  std::is_trivially_copyable<camera>::value
+    && std::is_trivially_copyable<sphere_set::surface>::value
+    && std::is_trivially_copyable<bvh8_node>::value,
+  "binary scenes save cameras, surfaces and nodes as they are in memory"
+);
+
+// Whether path names a binary scene, by its extension.
+inline bool is_binary_scene(const std::string& path) {
+  const std::string extension = ".rtscene";
+  return path.size() >= extension.size()
+    && path.compare(path.size() - extension.size(), extension.size(), extension)
+      == 0;
+}
+
+// Saves spheres, which must have been built (see sphere_set::build), with the
+// settings, max_depth, error_threshold and camera of scene, to a binary scene
+// at path. The file is written next to path and renamed over it, so that a
+// render that has the old file mapped keeps it. Returns false, after printing why, if a material
+// or texture isn't one the format has, or if the file can't be written.
+bool save_binary_scene(
+  const std::string& path, const sphere_set& spheres,
+  const scene_description& scene
+);
+
+// Maps the binary scene at path and returns its spheres, made in arena, with
+// the settings, max_depth, error_threshold and camera of the file in scene;
+// the world of scene is left alone. The file stays mapped until the arena is destroyed. Returns
+// null, after printing why, if the file can't be mapped or isn't a binary
+// scene of this build.
+sphere_set* map_binary_scene(
+  const std::string& path, scene_arena& arena, scene_description& scene
+);
+
+// A whole file, mapped read only. Made in a scene_arena, it's unmapped when
+// the arena is destroyed, after everything made after it that points into it.
+class mapped_file {
+public:
+  mapped_file() {}
+  mapped_file(const mapped_file&) = delete;
+  mapped_file& operator=(const mapped_file&) = delete;
+
+  ~mapped_file() {
+    if (base) {
+      munmap(base, length);
+    }
+  }
+
+  bool open(const std::string& path);
+
+  const char* data() const { return static_cast<const char*>(base); }
+  size_t size() const { return length; }
+
+private:
+  void* base = nullptr;
+  size_t length = 0;
+};
+
+bool mapped_file::open(const std::string& path) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat status;
+  if (fstat(fd, &status) != 0 || status.st_size <= 0) {
+    close(fd);
+    return false;
+  }
+  // Shared, so that every process mapping the file reads the same pages of
+  // the page cache. Nothing is read until it's touched.
+  void* mapping = mmap(
+    nullptr, size_t(status.st_size), PROT_READ, MAP_SHARED, fd, 0
+  );
+  // The mapping keeps the file open.
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    return false;
+  }
+  base = mapping;
+  length = size_t(status.st_size);
+  return true;
+}
+
+// The material and texture sections of a scene being saved, in the order
+// they're first met; a checker's textures go before it.
+class scene_binary_tables {
+public:
+  // Adds m if it isn't in yet and sets index to its position. Returns false
+  // if the format has no such material.
+  bool add(const material* m, uint32_t& index);
+  bool add(const texture* t, uint32_t& index);
+
+  std::vector<scene_binary_material> materials;
+  std::vector<scene_binary_texture> textures;
+
+private:
+  std::map<const material*, uint32_t> material_index;
+  std::map<const texture*, uint32_t> texture_index;
+};
+
+bool scene_binary_tables::add(const material* m, uint32_t& index) {
+  auto found = material_index.find(m);
+  if (found != material_index.end()) {
+    index = found->second;
+    return true;
+  }
+
+  scene_binary_material record = {};
+  record.type = uint32_t(m->type);
+  record.texture = -1;
+  auto set_albedo = [&](const color& albedo) {
+    for (int a = 0; a < 3; ++a) {
+      record.albedo[a] = albedo[a];
+    }
+  };
+  switch (m->type) {
+  case material_type::lambertian: {
+    auto l = static_cast<const lambertian*>(m);
+    set_albedo(l->albedo);
+    if (l->albedo_texture) {
+      uint32_t t;
+      if (!add(l->albedo_texture, t)) {
+        return false;
+      }
+      record.texture = int32_t(t);
+    }
+    break;
+  }
+  case material_type::metal:
+    set_albedo(static_cast<const metal*>(m)->albedo);
+    break;
+  case material_type::fuzzy:
+    set_albedo(static_cast<const fuzzy*>(m)->albedo);
+    record.parameter = static_cast<const fuzzy*>(m)->fuzz;
+    break;
+  case material_type::dielectric:
+    record.parameter = static_cast<const dielectric*>(m)->refractive_idx;
+    break;
+  default:
+    std::cerr << "Binary scenes only have the materials of material.h.\n";
+    return false;
+  }
+
+  index = uint32_t(materials.size());
+  materials.push_back(record);
+  material_index[m] = index;
+  return true;
+}
+
+bool scene_binary_tables::add(const texture* t, uint32_t& index) {
+  auto found = texture_index.find(t);
+  if (found != texture_index.end()) {
+    index = found->second;
+    return true;
+  }
+
+  scene_binary_texture record = {};
+  if (auto c = dynamic_cast<const constant_texture*>(t)) {
+    record.kind = scene_binary_texture::constant;
+    for (int a = 0; a < 3; ++a) {
+      record.color[a] = c->color_value[a];
+    }
+  } else if (auto c = dynamic_cast<const checker_texture*>(t)) {
+    record.kind = scene_binary_texture::checker;
+    if (!add(c->even, record.even) || !add(c->odd, record.odd)) {
+      return false;
+    }
+    record.scale = c->scale;
+  } else {
+    std::cerr << "Binary scenes only have the textures of texture.h.\n";
+    return false;
+  }
+
+  index = uint32_t(textures.size());
+  textures.push_back(record);
+  texture_index[t] = index;
+  return true;
+}
+
+bool save_binary_scene(
+  const std::string& path, const sphere_set& spheres,
+  const scene_description& scene
+) {
+  RT_TRACE_ZONE("save binary scene");
+  if (spheres.tree.nodes.empty()) {
+    std::cerr << "Only a built sphere_set can be saved.\n";
+    return false;
+  }
+
+  // The surfaces' materials are indices into spheres.materials; in the file,
+  // they're indices into the material section.
+  scene_binary_tables tables;
+  std::vector<uint32_t> file_material(spheres.materials.size());
+  for (size_t m = 0; m < spheres.materials.size(); ++m) {
+    if (!tables.add(spheres.materials[m], file_material[m])) {
+      return false;
+    }
+  }
+  std::vector<sphere_set::surface> surfaces(
+    spheres.surfaces.begin(), spheres.surfaces.end()
+  );
+  for (auto& s : surfaces) {
+    s.material = file_material[s.material];
+  }
+
+  scene_binary_header header = {};
+  std::memcpy(header.magic, scene_binary_magic, sizeof(header.magic));
+  header.version = scene_binary_version;
+  header.byte_order = scene_binary_byte_order;
+  const render_settings& settings = scene.settings;
+  header.image_width = settings.image_width;
+  header.image_height = settings.image_height;
+  header.samples_per_pixel = settings.samples_per_pixel;
+  header.tile_size = settings.tile_size;
+  header.max_depth = scene.max_depth;
+  header.sequence = int32_t(settings.sequence);
+  header.seed = settings.seed;
+  header.error_threshold = scene.error_threshold;
+  header.sphere_count = spheres.size();
+  for (int a = 0; a < 3; ++a) {
+    header.bounds[0][a] = spheres.tree.bounds.min()[a];
+    header.bounds[1][a] = spheres.tree.bounds.max()[a];
+  }
+  if (scene.cam) {
+    header.has_camera = 1;
+    std::memcpy(header.cam, &*scene.cam, sizeof(camera));
+  }
+
+  const std::string temporary = path + ".tmp";
+  {
+    std::ofstream out(temporary, std::ios::binary);
+    // The header is written again at the end, with the sections filled in.
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    uint64_t offset = sizeof(header);
+    auto write = [&](const auto& array) {
+      using element = std::remove_cv_t<
+        std::remove_reference_t<decltype(*array.data())>
+      >;
+      static const char zeros[scene_binary_alignment] = {};
+      const uint64_t start = (offset + scene_binary_alignment - 1)
+        / scene_binary_alignment * scene_binary_alignment;
+      out.write(zeros, std::streamsize(start - offset));
+      out.write(
+        reinterpret_cast<const char*>(array.data()),
+        std::streamsize(array.size() * sizeof(element))
+      );
+      offset = start + array.size() * sizeof(element);
+      return scene_binary_section{start, array.size()};
+    };
+    header.center_x = write(spheres.center_x);
+    header.center_y = write(spheres.center_y);
+    header.center_z = write(spheres.center_z);
+    header.radius = write(spheres.radius);
+    header.surface_index = write(spheres.surface_index);
+    header.surfaces = write(surfaces);
+    header.nodes = write(spheres.tree.nodes);
+    header.materials = write(tables.materials);
+    header.textures = write(tables.textures);
+    out.seekp(0);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.close();
+    if (!out) {
+      std::cerr << "Failed to write " << temporary << ".\n";
+      std::remove(temporary.c_str());
+      return false;
+    }
+  }
+  if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+    std::cerr << "Failed to rename " << temporary << " to " << path << ".\n";
+    return false;
+  }
+  return true;
+}
+
+sphere_set* map_binary_scene(
+  const std::string& path, scene_arena& arena, scene_description& scene
+) {
+  RT_TRACE_ZONE("map binary scene");
+  mapped_file* file = arena.make<mapped_file>();
+  if (!file->open(path)) {
+    std::cerr << "Can't map " << path << ".\n";
+    return nullptr;
+  }
+  scene_binary_header header;
+  if (file->size() < sizeof(header)) {
+    std::cerr << path << " is too short for a binary scene.\n";
+    return nullptr;
+  }
+  std::memcpy(&header, file->data(), sizeof(header));
+  if (std::memcmp(header.magic, scene_binary_magic, sizeof(header.magic) - 1)
+    != 0) {
+    std::cerr << path << " isn't a binary scene.\n";
+    return nullptr;
+  }
+  if (header.magic[7] != scene_binary_magic[7]
+    || header.version != scene_binary_version
+    || header.byte_order != scene_binary_byte_order) {
+    std::cerr << path << " is a binary scene of another build; make it again"
+      << " with this build's compile_scene.\n";
+    return nullptr;
+  }
+
+  // The elements of a section, if it's aligned, whole within the file, and
+  // has count elements (any number if count is 0).
+  bool ok = true;
+  auto section = [&](const scene_binary_section& s, auto* type, uint64_t count) {
+    using element = std::remove_pointer_t<decltype(type)>;
+    if (s.offset % scene_binary_alignment != 0 || s.offset > file->size()
+      || s.count > (file->size() - s.offset) / sizeof(element)
+      || (count && s.count != count)) {
+      ok = false;
+      return flat_array<element>();
+    }
+    return flat_array<element>::borrow(
+      reinterpret_cast<const element*>(file->data() + s.offset), s.count
+    );
+  };
+  const uint64_t n = header.sphere_count;
+  const uint64_t padded = n + sphere_set_padding;
+  sphere_set* spheres = arena.make<sphere_set>();
+  spheres->center_x = section(header.center_x, (float*)nullptr, padded);
+  spheres->center_y = section(header.center_y, (float*)nullptr, padded);
+  spheres->center_z = section(header.center_z, (float*)nullptr, padded);
+  spheres->radius = section(header.radius, (float*)nullptr, padded);
+  spheres->surface_index = section(header.surface_index, (uint32_t*)nullptr, n);
+  spheres->surfaces = section(header.surfaces, (sphere_set::surface*)nullptr, 0);
+  spheres->tree.nodes = section(header.nodes, (bvh8_node*)nullptr, 0);
+  auto materials = section(header.materials, (scene_binary_material*)nullptr, 0);
+  auto textures = section(header.textures, (scene_binary_texture*)nullptr, 0);
+  if (!ok || n == 0 || n > UINT32_MAX || spheres->tree.nodes.empty()) {
+    std::cerr << path << " is truncated or corrupt.\n";
+    return nullptr;
+  }
+  spheres->tree.primitive_count = uint32_t(n);
+  spheres->tree.bounds = aabb(
+    point3(header.bounds[0][0], header.bounds[0][1], header.bounds[0][2]),
+    point3(header.bounds[1][0], header.bounds[1][1], header.bounds[1][2])
+  );
+
+  // Materials and textures are the only objects that are made, in the order
+  // of their sections.
+  std::vector<const texture*> made_textures;
+  for (const scene_binary_texture& t : textures) {
+    if (t.kind == scene_binary_texture::constant) {
+      made_textures.push_back(arena.make<constant_texture>(
+        color(t.color[0], t.color[1], t.color[2])
+      ));
+    } else if (t.kind == scene_binary_texture::checker
+      && t.even < made_textures.size() && t.odd < made_textures.size()) {
+      made_textures.push_back(arena.make<checker_texture>(
+        made_textures[t.even], made_textures[t.odd], t.scale
+      ));
+    } else {
+      std::cerr << path << " has a bad texture.\n";
+      return nullptr;
+    }
+  }
+  for (const scene_binary_material& m : materials) {
+    color albedo(m.albedo[0], m.albedo[1], m.albedo[2]);
+    const material* made = nullptr;
+    switch (material_type(m.type)) {
+    case material_type::lambertian:
+      if (m.texture < 0) {
+        made = arena.make<lambertian>(albedo);
+      } else if (size_t(m.texture) < made_textures.size()) {
+        made = arena.make<lambertian>(made_textures[m.texture]);
+      }
+      break;
+    case material_type::metal:
+      made = arena.make<metal>(albedo);
+      break;
+    case material_type::fuzzy:
+      made = arena.make<fuzzy>(albedo, m.parameter);
+      break;
+    case material_type::dielectric:
+      made = arena.make<dielectric>(m.parameter);
+      break;
+    default:
+      break;
+    }
+    if (!made) {
+      std::cerr << path << " has a bad material.\n";
+      return nullptr;
+    }
+    spheres->materials.push_back(made);
+  }
+
+  // The tables the spheres and their tree index into are checked here. The
+  // spheres and nodes themselves are too many to read before they're needed;
+  // traversal checks the nodes as it goes (see bvh8_tree::traverse).
+  for (const sphere_set::surface& s : spheres->surfaces) {
+    if (s.material >= spheres->materials.size()) {
+      std::cerr << path << " has a surface with a bad material.\n";
+      return nullptr;
+    }
+  }
+  if (header.sequence < 0
+    || header.sequence > int32_t(sample_sequence::blue_noise)) {
+    std::cerr << path << " has a bad sample sequence.\n";
+    return nullptr;
+  }
+  if (!(header.error_threshold > 0)) {
+    std::cerr << path << " has a bad error threshold.\n";
+    return nullptr;
+  }
+
+  render_settings& settings = scene.settings;
+  settings.image_width = header.image_width;
+  settings.image_height = header.image_height;
+  settings.samples_per_pixel = header.samples_per_pixel;
+  settings.tile_size = header.tile_size;
+  settings.sequence = sample_sequence(header.sequence);
+  settings.seed = header.seed;
+  scene.max_depth = header.max_depth;
+  scene.error_threshold = header.error_threshold;
+  if (header.has_camera) {
+    // Any camera will do: its bytes are replaced with the saved one's.
+    scene.cam.emplace(
+      point3(0, 0, 0), point3(0, 0, -1), vec3(0, 1, 0), 90, 1, 0, 1
+    );
+    std::memcpy(&*scene.cam, header.cam, sizeof(camera));
+  }
+  return spheres;
+}
+
+#endif
@@ -0,0 +1,680 @@
+#ifndef SCENE_FILE_H
+#define SCENE_FILE_H
+
+#include "common.h"
+
+#include "camera.h"
+#include "hittable_list.h"
+#include "image_reader.h"
+#include "image_texture.h"
+#include "instance.h"
+#include "material.h"
+#include "obj_file.h"
+#include "renderer.h"
+#include "sampler.h"
+#include "scene_arena.h"
+#include "sphere.h"
+#include "texture.h"
+#include "thread_pool.h"
+#include "trace.h"
+#include "triangle_mesh.h"
+
+#include <charconv>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <new>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Scenes in text files. Every line is a statement, its words separated by
+// blanks; # starts a comment that goes to the end of the line:
+//
+//   settings width 1280 height 720 samples 100 max_depth 50 seed 0
+//            sequence sobol tile 16 error_threshold 0.02
+//   camera  13 2 3   0 0 0   0 1 0   20  auto  0.1  10
+//   texture white constant 0.9 0.9 0.9
+//   texture green constant 0.2 0.3 0.1
+//   texture board checker white green 10
+//   texture map   image earth.ppm
+//   material ground lambertian board
+//   material clay   lambertian 0.4 0.2 0.1
+//   material steel  metal 0.7 0.6 0.5
+//   material brass  fuzzy 0.8 0.6 0.2 0.3
+//   material glass  dielectric 1.5
+//   sphere 0 -1000 0  1000  ground
+//   sphere 4 1 0  1  steel  0.7 0.6 0.5
+//   mesh   teapot.obj clay  0.5  -4 0 0
+//   shape  tree  tree.obj bark
+//   instance tree  3 0 -2  45  1.5
+//
+// settings sets any of the render settings, the number of bounces after
+// which paths end (max_depth), and the error adaptive renders stop at
+// (error_threshold); the ones it doesn't set keep the values they had
+// before loading. camera takes the parameters of the camera constructor
+// in order: look_from, look_at, vup, vfov, aspect_ratio, aperture and
+// focus_distance; an aspect ratio of auto is the image's. A texture is a
+// constant color, a checker of two textures (see texture.h), with an
+// optional scale, or an image (see image_texture.h) read from a PPM or PFM
+// file, whose path is relative to the scene file's. A material is
+// lambertian (with a color, or a texture), metal, fuzzy or dielectric, with
+// the parameters of its constructor. A sphere has a center, a radius and a
+// material, then optionally its exterior color and its interior color,
+// which default to white and to the exterior color. A mesh is the triangles
+// of an OBJ file (see obj_file.h), also relative to the scene file, with a
+// material, then optionally a scale and an offset for its vertices. A shape
+// is a mesh with a name, which isn't in the scene itself, but is shared by
+// all its instances (see instance.h): an instance puts it at an offset,
+// then optionally turns it about the y axis by an angle in degrees and
+// scales it, around its own origin.
+//
+// Textures, materials and shapes must be defined before the statements that
+// use them, but spheres can come anywhere. Names are unique within textures,
+// within materials and within shapes.
+//
+// Scenes are mostly spheres, so the loader reads the whole file at once and
+// parses it in chunks on a pool of threads: a first pass counts the spheres
+// of every chunk and notes where the other statements are; those are run in
+// file order on the calling thread; then a second pass constructs every
+// chunk's spheres, in file order, into a single array allocated in the arena,
+// without any other allocation per sphere.
+
+// What a scene file describes.
+struct scene_description {
+  render_settings settings;
+  int max_depth = 50;
+  // What adaptive renders stop at (see
+  // progressive_settings::error_threshold). With 0.02, the image is a little
+  // less noisy than a uniform render with samples_per_pixel samples, for less
+  // than half the samples.
+  double error_threshold = 0.02;
+  // Empty if the file has no camera.
+  std::optional<camera> cam;
+  hittable_list world;
+};
+
+// Loads the scene file at path into scene, making its objects in arena, with
+// thread_count threads (0 for one per hardware thread). The settings and
+// max_depth of scene are the defaults the file overrides. Returns false, after
+// printing where the file is wrong, if it can't be read or parsed.
+bool load_scene(
+  const std::string& path, scene_arena& arena, scene_description& scene,
+  unsigned thread_count = 0
+);
+
+// A cursor over the words of one line.
+class scene_line {
+public:
+  scene_line(const char* begin, const char* end) : p(begin), end(end) {}
+
+  // Whether there are words left, before the end of the line or a comment.
+  bool more() {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) {
+      ++p;
+    }
+    return p < end && *p != '#';
+  }
+
+  bool word(std::string_view& w) {
+    if (!more()) {
+      return false;
+    }
+    const char* start = p;
+    while (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '#') {
+      ++p;
+    }
+    w = std::string_view(start, size_t(p - start));
+    return true;
+  }
+
+  template <typename Number>
+  bool number(Number& x) {
+    if (!more()) {
+      return false;
+    }
+    auto result = std::from_chars(p, end, x);
+    if (result.ec != std::errc() || (result.ptr < end
+        && *result.ptr != ' ' && *result.ptr != '\t' && *result.ptr != '\r'
+        && *result.ptr != '#')) {
+      return false;
+    }
+    p = result.ptr;
+    return true;
+  }
+
+  bool vector(vec3& v) {
+    double x, y, z;
+    if (!number(x) || !number(y) || !number(z)) {
+      return false;
+    }
+    v = vec3(x, y, z);
+    return true;
+  }
+
+  // Whether the next word is a number, without reading it.
+  bool number_next() {
+    double x;
+    const char* start = p;
+    bool is_number = number(x);
+    p = start;
+    return is_number;
+  }
+
+private:
+  const char* p;
+  const char* end;
+};
+
+// The end of the line that starts at p: its newline, or end.
+inline const char* scene_line_end(const char* p, const char* end) {
+  const void* newline = std::memchr(p, '\n', size_t(end - p));
+  return newline ? static_cast<const char*>(newline) : end;
+}
+
+class scene_loader {
+public:
+  scene_loader(
+    const std::string& path, scene_arena& arena, scene_description& scene
+  ) : path(path), arena(arena), scene(scene) {}
+
+  bool parse(const char* text, size_t size, unsigned thread_count);
+
+private:
+  // A statement other than a sphere, and its line number.
+  struct definition {
+    const char* begin;
+    const char* end;
+    size_t line;
+  };
+
+  // A piece of the file made of whole lines.
+  struct chunk {
+    const char* begin;
+    const char* end;
+    // The line number of begin, and the lines of the chunk. The lines of
+    // definitions are counted from begin.
+    size_t first_line = 0;
+    size_t lines = 0;
+    size_t spheres = 0;
+    // The index of the chunk's first sphere in the scene's.
+    size_t first_sphere = 0;
+    std::vector<definition> definitions;
+    // The first error of the second pass.
+    size_t error_line = 0;
+    std::string error;
+  };
+
+  void scan(chunk& c);
+  void make_spheres(chunk& c, sphere* spheres, hittable** objects);
+
+  bool define(const definition& d);
+  bool define_settings(scene_line& words);
+  bool define_camera(scene_line& words);
+  bool define_texture(scene_line& words);
+  bool define_material(scene_line& words);
+  bool define_mesh(scene_line& words);
+  bool define_shape(scene_line& words);
+  bool define_instance(scene_line& words);
+  // Reads the file, material, scale and offset of a mesh or shape statement,
+  // and loads and builds the mesh. Returns null if it can't.
+  triangle_mesh* read_mesh(scene_line& words);
+  // The path of a file named in the scene file: file itself if it's
+  // absolute, otherwise relative to the scene file's directory.
+  std::string resolve(std::string_view file) const;
+  // Reads the rest of a sphere statement into s. Returns an error message, or
+  // null if it's fine.
+  const char* read_sphere(
+    scene_line& words, sphere& s, std::string_view& last_name,
+    const material*& last_material
+  ) const;
+
+  bool fail(size_t line, const std::string& message) const {
+    std::cerr << path << ":" << line << ": " << message << "\n";
+    return false;
+  }
+
+  const std::string& path;
+  scene_arena& arena;
+  scene_description& scene;
+
+  std::map<std::string, const texture*, std::less<>> textures;
+  std::map<std::string, const material*, std::less<>> materials;
+  std::map<std::string, const hittable*, std::less<>> shapes;
+  // The camera's parameters, which are only turned into a camera once all
+  // the settings are known (see auto).
+  bool has_camera = false;
+  point3 look_from, look_at;
+  vec3 vup;
+  double vfov = 90, aspect_ratio = 0, aperture = 0, focus_distance = 1;
+};
+
+bool scene_loader::parse(const char* text, size_t size, unsigned thread_count) {
+  work_stealing_pool pool(thread_count);
+
+  // Chunks of at least 1 MB, a few per thread so that they balance out.
+  const size_t min_chunk = size_t(1) << 20;
+  size_t chunk_count = std::max<size_t>(
+    1, std::min<size_t>(4 * pool.size(), size / min_chunk)
+  );
+  std::vector<chunk> chunks;
+  const char* end = text + size;
+  const char* begin = text;
+  for (size_t n = 1; n <= chunk_count && begin < end; ++n) {
+    const char* split = n == chunk_count ? end : text + size * n / chunk_count;
+    if (split < begin) {
+      split = begin;
+    }
+    split = scene_line_end(split, end);
+    if (split < end) {
+      ++split;
+    }
+    chunk c;
+    c.begin = begin;
+    c.end = split;
+    chunks.push_back(std::move(c));
+    begin = split;
+  }
+
+  pool.parallel_for(chunks.size(), [&](size_t n, unsigned) {
+    scan(chunks[n]);
+  });
+
+  size_t line = 1;
+  size_t sphere_count = 0;
+  for (chunk& c : chunks) {
+    c.first_line = line;
+    c.first_sphere = sphere_count;
+    line += c.lines;
+    sphere_count += c.spheres;
+  }
+  for (const chunk& c : chunks) {
+    for (definition d : c.definitions) {
+      d.line += c.first_line;
+      if (!define(d)) {
+        return false;
+      }
+    }
+  }
+
+  if (has_camera) {
+    if (aspect_ratio <= 0) {
+      aspect_ratio = double(scene.settings.image_width) / scene.settings.image_height;
+    }
+    scene.cam.emplace(
+      look_from, look_at, vup, vfov, aspect_ratio, aperture, focus_distance
+    );
+  }
+
+  sphere* spheres = arena.allocate_array<sphere>(sphere_count);
+  const size_t first_object = scene.world.objects.size();
+  scene.world.objects.resize(first_object + sphere_count);
+  hittable** objects = scene.world.objects.data() + first_object;
+  pool.parallel_for(chunks.size(), [&](size_t n, unsigned) {
+    make_spheres(chunks[n], spheres, objects);
+  });
+
+  for (const chunk& c : chunks) {
+    if (!c.error.empty()) {
+      return fail(c.error_line, c.error);
+    }
+  }
+  return true;
+}
+
+void scene_loader::scan(chunk& c) {
+  RT_TRACE_ZONE("scan scene chunk");
+  for (const char* p = c.begin; p < c.end; ) {
+    const char* line_end = scene_line_end(p, c.end);
+    scene_line words(p, line_end);
+    std::string_view statement;
+    if (words.word(statement)) {
+      if (statement == "sphere") {
+        ++c.spheres;
+      } else {
+        c.definitions.push_back({p, line_end, c.lines});
+      }
+    }
+    ++c.lines;
+    p = line_end + 1;
+  }
+}
+
+void scene_loader::make_spheres(chunk& c, sphere* spheres, hittable** objects) {
+  RT_TRACE_ZONE("parse scene chunk");
+  // Spheres of the same material tend to come together, so the last name is
+  // checked before looking it up.
+  std::string_view last_name;
+  const material* last_material = nullptr;
+  size_t index = c.first_sphere;
+  size_t line = c.first_line;
+  for (const char* p = c.begin; p < c.end; ++line) {
+    const char* line_end = scene_line_end(p, c.end);
+    scene_line words(p, line_end);
+    p = line_end + 1;
+    std::string_view statement;
+    if (!words.word(statement) || statement != "sphere") {
+      continue;
+    }
+    sphere* s = new (&spheres[index]) sphere();
+    objects[index] = s;
+    ++index;
+    if (const char* error = read_sphere(words, *s, last_name, last_material)) {
+      c.error_line = line;
+      c.error = error;
+      return;
+    }
+  }
+}
+
+const char* scene_loader::read_sphere(
+  scene_line& words, sphere& s, std::string_view& last_name,
+  const material*& last_material
+) const {
+  std::string_view name;
+  if (!words.vector(s.center) || !words.number(s.radius) || !words.word(name)) {
+    return "A sphere needs a center, a radius and a material.";
+  }
+  if (name != last_name || !last_material) {
+    auto found = materials.find(name);
+    if (found == materials.end()) {
+      return "Unknown material.";
+    }
+    last_name = name;
+    last_material = found->second;
+  }
+  s.material = last_material;
+
+  s.exterior_color = color(1.0, 1.0, 1.0);
+  if (words.more() && !words.vector(s.exterior_color)) {
+    return "A sphere's exterior color needs 3 numbers.";
+  }
+  s.interior_color = s.exterior_color;
+  if (words.more() && !words.vector(s.interior_color)) {
+    return "A sphere's interior color needs 3 numbers.";
+  }
+  if (words.more()) {
+    return "Too many words for a sphere.";
+  }
+  return nullptr;
+}
+
+bool scene_loader::define(const definition& d) {
+  scene_line words(d.begin, d.end);
+  std::string_view statement;
+  words.word(statement);
+  bool ok = false;
+  if (statement == "settings") {
+    ok = define_settings(words);
+  } else if (statement == "camera") {
+    ok = define_camera(words);
+  } else if (statement == "texture") {
+    ok = define_texture(words);
+  } else if (statement == "material") {
+    ok = define_material(words);
+  } else if (statement == "mesh") {
+    ok = define_mesh(words);
+  } else if (statement == "shape") {
+    ok = define_shape(words);
+  } else if (statement == "instance") {
+    ok = define_instance(words);
+  } else {
+    return fail(d.line, "Unknown statement " + std::string(statement) + ".");
+  }
+  if (!ok) {
+    return fail(d.line, "Bad " + std::string(statement) + " statement.");
+  }
+  if (words.more()) {
+    return fail(
+      d.line, "Too many words for a " + std::string(statement) + " statement."
+    );
+  }
+  return true;
+}
+
+bool scene_loader::define_settings(scene_line& words) {
+  render_settings& settings = scene.settings;
+  std::string_view key;
+  while (words.word(key)) {
+    bool ok;
+    if (key == "width") {
+      ok = words.number(settings.image_width) && settings.image_width > 0;
+    } else if (key == "height") {
+      ok = words.number(settings.image_height) && settings.image_height > 0;
+    } else if (key == "samples") {
+      ok = words.number(settings.samples_per_pixel)
+        && settings.samples_per_pixel > 0;
+    } else if (key == "max_depth") {
+      ok = words.number(scene.max_depth);
+    } else if (key == "error_threshold") {
+      ok = words.number(scene.error_threshold) && scene.error_threshold > 0;
+    } else if (key == "seed") {
+      ok = words.number(settings.seed);
+    } else if (key == "tile") {
+      ok = words.number(settings.tile_size) && settings.tile_size > 0;
+    } else if (key == "sequence") {
+      std::string_view name;
+      ok = words.word(name)
+        && sample_sequence_named(std::string(name), settings.sequence);
+    } else {
+      ok = false;
+    }
+    if (!ok) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool scene_loader::define_camera(scene_line& words) {
+  if (!words.vector(look_from) || !words.vector(look_at) || !words.vector(vup)
+    || !words.number(vfov)) {
+    return false;
+  }
+  std::string_view automatic;
+  if (words.number_next()) {
+    words.number(aspect_ratio);
+  } else if (words.word(automatic) && automatic == "auto") {
+    aspect_ratio = 0;
+  } else {
+    return false;
+  }
+  has_camera = true;
+  return words.number(aperture) && words.number(focus_distance);
+}
+
+bool scene_loader::define_texture(scene_line& words) {
+  std::string_view name, kind;
+  if (!words.word(name) || !words.word(kind) || textures.count(name)) {
+    return false;
+  }
+  const texture* t = nullptr;
+  if (kind == "constant") {
+    color c;
+    if (!words.vector(c)) {
+      return false;
+    }
+    t = arena.make<constant_texture>(c);
+  } else if (kind == "checker") {
+    std::string_view even, odd;
+    if (!words.word(even) || !words.word(odd)) {
+      return false;
+    }
+    auto found_even = textures.find(even);
+    auto found_odd = textures.find(odd);
+    if (found_even == textures.end() || found_odd == textures.end()) {
+      return false;
+    }
+    double scale = 10;
+    if (words.more() && !words.number(scale)) {
+      return false;
+    }
+    t = arena.make<checker_texture>(found_even->second, found_odd->second, scale);
+  } else if (kind == "image") {
+    std::string_view file;
+    int width, height;
+    std::vector<color> pixels;
+    if (!words.word(file)
+      || !read_image(resolve(file), width, height, pixels)) {
+      return false;
+    }
+    t = arena.make<image_texture>(width, height, pixels);
+  } else {
+    return false;
+  }
+  textures.emplace(std::string(name), t);
+  return true;
+}
+
+bool scene_loader::define_material(scene_line& words) {
+  std::string_view name, kind;
+  if (!words.word(name) || !words.word(kind) || materials.count(name)) {
+    return false;
+  }
+  const material* m = nullptr;
+  color albedo;
+  if (kind == "lambertian") {
+    std::string_view texture_name;
+    if (words.number_next()) {
+      if (!words.vector(albedo)) {
+        return false;
+      }
+      m = arena.make<lambertian>(albedo);
+    } else if (words.word(texture_name)) {
+      auto found = textures.find(texture_name);
+      if (found == textures.end()) {
+        return false;
+      }
+      m = arena.make<lambertian>(found->second);
+    } else {
+      return false;
+    }
+  } else if (kind == "metal") {
+    if (!words.vector(albedo)) {
+      return false;
+    }
+    m = arena.make<metal>(albedo);
+  } else if (kind == "fuzzy") {
+    double fuzz;
+    if (!words.vector(albedo) || !words.number(fuzz)) {
+      return false;
+    }
+    m = arena.make<fuzzy>(albedo, fuzz);
+  } else if (kind == "dielectric") {
+    double refractive_idx;
+    if (!words.number(refractive_idx)) {
+      return false;
+    }
+    m = arena.make<dielectric>(refractive_idx);
+  } else {
+    return false;
+  }
+  materials.emplace(std::string(name), m);
+  return true;
+}
+
+bool scene_loader::define_mesh(scene_line& words) {
+  triangle_mesh* mesh = read_mesh(words);
+  if (!mesh) {
+    return false;
+  }
+  scene.world.add(mesh);
+  return true;
+}
+
+bool scene_loader::define_shape(scene_line& words) {
+  std::string_view name;
+  if (!words.word(name) || shapes.count(name)) {
+    return false;
+  }
+  triangle_mesh* mesh = read_mesh(words);
+  if (!mesh) {
+    return false;
+  }
+  shapes.emplace(std::string(name), mesh);
+  return true;
+}
+
+bool scene_loader::define_instance(scene_line& words) {
+  std::string_view name;
+  vec3 offset;
+  if (!words.word(name) || !words.vector(offset)) {
+    return false;
+  }
+  auto found = shapes.find(name);
+  if (found == shapes.end()) {
+    return false;
+  }
+  double angle = 0, scale = 1;
+  if (words.more() && !words.number(angle)) {
+    return false;
+  }
+  if (words.more() && (!words.number(scale) || scale == 0)) {
+    return false;
+  }
+  transform to_world = transform::translation(offset)
+    * transform::rotation(vec3(0, 1, 0), angle)
+    * transform::scaling(vec3(scale, scale, scale));
+  scene.world.add(arena.make<instance>(found->second, to_world));
+  return true;
+}
+
+triangle_mesh* scene_loader::read_mesh(scene_line& words) {
+  std::string_view file, material_name;
+  if (!words.word(file) || !words.word(material_name)) {
+    return nullptr;
+  }
+  auto found = materials.find(material_name);
+  if (found == materials.end()) {
+    return nullptr;
+  }
+  real scale = 1;
+  vec3 offset(0, 0, 0);
+  if (words.more() && !words.number(scale)) {
+    return nullptr;
+  }
+  if (words.more() && !words.vector(offset)) {
+    return nullptr;
+  }
+
+  auto mesh = arena.make<triangle_mesh>(found->second);
+  if (!load_obj(resolve(file), *mesh, scale, offset) || mesh->size() == 0) {
+    return nullptr;
+  }
+  mesh->build();
+  return mesh;
+}
+
+std::string scene_loader::resolve(std::string_view file) const {
+  size_t slash = path.rfind('/');
+  if (file.front() == '/' || slash == std::string::npos) {
+    return std::string(file);
+  }
+  return path.substr(0, slash + 1) + std::string(file);
+}
+
+bool load_scene(
+  const std::string& path, scene_arena& arena, scene_description& scene,
+  unsigned thread_count
+) {
+  RT_TRACE_ZONE("load scene");
+  std::ifstream in(path, std::ios::binary | std::ios::ate);
+  if (!in) {
+    std::cerr << "Can't open " << path << ".\n";
+    return false;
+  }
+  // Read in one go, into a buffer that isn't zeroed first.
+  const size_t size = size_t(in.tellg());
+  std::unique_ptr<char[]> text(new char[size]);
+  in.seekg(0);
+  if (!in.read(text.get(), std::streamsize(size))) {
+    std::cerr << "Can't read " << path << ".\n";
+    return false;
+  }
+  return scene_loader(path, arena, scene).parse(text.get(), size, thread_count);
+}
+
+#endif
@@ -0,0 +1,124 @@
+#ifndef SCENES_H
+#define SCENES_H
+
+#include "common.h"
+
+#include "camera.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "scene_arena.h"
+#include "sphere.h"
+
+#include <cmath>
+#include <vector>
+
+// The scenes main renders and scene_benchmark times. Their objects and
+// materials are made in the arena, and they draw their random layouts from
+// random_double(), so the same generator state gives the same scene.
+
+// The color of rays that hit nothing.
+color sky(const ray& r) {
+  vec3 unit_direction = unit_vector(r.direction());
+  double t = 0.5 * (unit_direction.y() + 1.0);
+  return (1.0 - t)*color(1.0, 1.0, 1.0) + t*color(0.5, 0.7, 1.0);
+}
+
+sphere* make_sphere(scene_arena& arena, point3 center, double radius, color albedo, const material* mat) {
+  return arena.make<sphere>(center, radius, albedo, albedo, mat);
+}
+
+// The grid of small spheres of the book's final scene, on its big ground
+// sphere. A sphere is diffuse with probability diffuse, metal with
+// probability metal, and glass otherwise.
+hittable_list sphere_grid(scene_arena& arena, double diffuse, double metal) {
+  hittable_list world;
+
+  world.add(make_sphere(arena, point3(0,-1000,0), 1000, color(0.5,0.5,0.5), arena.make<lambertian>(color(0.5,0.5,0.5))));
+
+  for (int a = -11; a < 11; a++) {
+    for (int b = -11; b < 11; b++) {
+      double choose_mat = random_double();
+      point3 center(a+0.9*random_double(), 0.2, b+0.9*random_double());
+      if ((center-point3(4,0.2,0)).length() > 0.9) {
+        if (choose_mat < diffuse) {
+          // Diffuse.
+          color albedo = color::random() * color::random();
+          world.add(make_sphere(arena, center, 0.2, albedo, arena.make<lambertian>(albedo)));
+        } else if (choose_mat < diffuse + metal) {
+          // Metal.
+          color albedo = color::random(0.5, 1);
+          world.add(make_sphere(arena, center, 0.2, albedo, arena.make<fuzzy>(albedo, 0.5*random_double())));
+        } else {
+          // Glass.
+          world.add(make_sphere(arena, center, 0.2, color(1,1,1), arena.make<dielectric>(1.5)));
+        }
+      }
+    }
+  }
+
+  return world;
+}
+
+// The book's final scene: the grid, mostly diffuse, and three big spheres
+// of glass, diffuse and metal.
+hittable_list random_scene(scene_arena& arena) {
+  hittable_list world = sphere_grid(arena, 0.8, 0.15);
+
+  world.add(make_sphere(arena, point3(0, 1, 0), 1.0, color(1,1,1), arena.make<dielectric>(1.5)));
+  world.add(make_sphere(arena, point3(-4, 1,0), 1.0, color(0.4, 0.2, 0.1), arena.make<lambertian>(color(0.4, 0.2, 0.1))));
+  world.add(make_sphere(arena, point3(4, 1, 0), 1.0, color(0.7, 0.6, 0.5), arena.make<metal>(color(0.7, 0.6, 0.5))));
+
+  return world;
+}
+
+// The book's camera for the final scene, which is aspect_ratio wide for 1
+// high, and whose lens is aperture wide.
+camera final_scene_camera(double aspect_ratio, double aperture) {
+  point3 look_from(13, 2, 3);
+  point3 look_at(0, 0, 0);
+  return camera(look_from, look_at, vec3(0, 1, 0), 20, aspect_ratio, aperture, 10.0);
+}
+
+// The side of the cube of sphere_field(count).
+double sphere_field_side(size_t count) {
+  return 2.0 * std::cbrt(double(count));
+}
+
+// count spheres of radius 0.2 to 0.5 filling a cube whose side grows with
+// the cube root of count, so that the density (and the number of spheres a
+// ray goes through before it hits one) is the same at every count. They
+// share a palette of 64 materials, mixed like the final scene's, so that a
+// big field isn't mostly materials.
+hittable_list sphere_field(scene_arena& arena, size_t count) {
+  std::vector<const material*> palette;
+  for (int m = 0; m < 64; ++m) {
+    double choose_mat = random_double();
+    if (choose_mat < 0.8) {
+      palette.push_back(arena.make<lambertian>(color::random() * color::random()));
+    } else if (choose_mat < 0.95) {
+      palette.push_back(arena.make<fuzzy>(color::random(0.5, 1), 0.5 * random_double()));
+    } else {
+      palette.push_back(arena.make<dielectric>(1.5));
+    }
+  }
+
+  hittable_list world;
+  world.objects.reserve(count);
+  const double side = sphere_field_side(count);
+  for (size_t n = 0; n < count; ++n) {
+    point3 center = side * vec3::random(-0.5, 0.5);
+    double radius = random_double(0.2, 0.5);
+    const material* mat = palette[size_t(64 * random_double())];
+    world.add(make_sphere(arena, center, radius, color(1, 1, 1), mat));
+  }
+  return world;
+}
+
+// A camera outside the cube of sphere_field(count), looking at its center.
+camera sphere_field_camera(size_t count, double aspect_ratio) {
+  double side = sphere_field_side(count);
+  point3 look_from(0, 0, 1.5 * side);
+  return camera(look_from, point3(0, 0, 0), vec3(0, 1, 0), 40, aspect_ratio, 0.0, 1.5 * side);
+}
+
+#endif
@@ -2,17 +2,24 @@
 #define SPHERE_H
 
 #include "hittable.h"
+#include "material.h"
+#include "stats.h"
 #include "vec3.h"
 
+#include <cmath>
+#include <utility>
+
 class sphere : public hittable {
 public:
-  sphere() : radius(0.0), exterior_color(0, 0, 0), interior_color(0, 0, 0) {};
+  sphere()
+    : radius(0.0), exterior_color(0, 0, 0), interior_color(0, 0, 0),
+      material(nullptr) {};
   sphere(
     point3 center,
-    double radius,
+    real radius,
     color exterior_color,
     color interior_color,
-    shared_ptr<material> material
+    const ::material* material
   )
     : center(center),
       radius(radius),
@@ -20,54 +27,124 @@ public:
       interior_color(interior_color),
       material(material) {};
 
-  virtual bool 
-    hit(const ray& r, double t_min, double t_max, hit_record& rec) const;
+  virtual bool
+    intersect(const ray& r, real t_min, real t_max, ray_hit& hit) const;
+
+  virtual void
+    finish_hit(const ray& r, const ray_hit& hit, hit_record& rec) const;
+
+  virtual bool bounding_box(aabb& output_box) const;
 
   point3 center;
-  double radius;
+  real radius;
   color exterior_color;
   color interior_color;
-  shared_ptr<material> material;
+  const ::material* material;
 };
 
-bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec)
-  const {
+// Intersects r with the sphere of the given center and radius. When it hits
+// it between t_min and t_max, sets t, and exterior to whether it's the near
+// root, and returns true; t and exterior are only written on a hit. sphere and
+// sphere_set both intersect through it.
+inline bool intersect_sphere(
+  const point3& center, real radius, const ray& r, real t_min, real t_max,
+  real& t, bool& exterior
+) {
   vec3 oc = r.origin() - center;
   auto a = r.direction().length_squared();
   auto half_b = dot(oc, r.direction());
   auto c = oc.length_squared() - radius * radius;
   auto discriminant = half_b * half_b - a * c;
+  if (discriminant <= 0) {
+    return false;
+  }
 
-  if (discriminant > 0) {
-    auto root = sqrt(discriminant);
-    // One root.
-    auto temp = (-half_b - root) / a;
-    if (temp < t_max && temp > t_min) {
-      rec.t = temp;
-      rec.p = r.at(rec.t);
-      rec.color = exterior_color;
-      rec.material = this->material;
-      vec3 outward_normal = (rec.p - center) / radius;
-      // The outward_normal always points away from the surface. But the hit's
-      // normal depends on whether it is on the front or back face of the
-      // surface.
-      rec.set_face_normal(r, outward_normal);
-      return true;
-    }
-    // The other root.
-    temp = (-half_b + root) / a;
-    if (temp < t_max && temp > t_min) {
-      rec.t = temp;
-      rec.p = r.at(rec.t);
-      rec.color = interior_color;
-      rec.material = this->material;
-      vec3 outward_normal = (rec.p - center) / radius;
-      rec.set_face_normal(r, outward_normal);
-      return true;
-    }
+  // The roots are q / a and c / q. Unlike (-half_b +- root) / a, neither
+  // subtracts two nearly equal numbers, so the root near 0 of a ray that
+  // leaves the surface is as accurate as c, and has the right sign.
+  auto root = sqrt(discriminant);
+  auto q = half_b > 0 ? -(half_b + root) : root - half_b;
+  auto near = q / a;
+  auto far = c / q;
+  if (near > far) {
+    std::swap(near, far);
   }
 
+  // The near root hits the exterior, the far one the interior.
+  if (near < t_max && near > t_min) {
+    t = near;
+    exterior = true;
+    return true;
+  }
+  if (far < t_max && far > t_min) {
+    t = far;
+    exterior = false;
+    return true;
+  }
   return false;
 }
 
+// Fills in the geometry of rec (t, p, p_error and the normal) for the hit of r
+// at t found by intersect_sphere.
+inline void finish_sphere_hit(
+  const point3& center, real radius, const ray& r, real t, hit_record& rec
+) {
+  // Move r.at(t), which may be off by a lot more than the sphere's own
+  // rounding, back onto the surface. Then it's off by at most 7 roundings
+  // relative to the center, plus one for adding the center back.
+  rec.t = t;
+  vec3 from_center = r.at(t) - center;
+  from_center *= std::fabs(radius) / from_center.length();
+  rec.p = center + from_center;
+  rec.p_error = rounding_gamma(7) * abs(from_center) + rounding_gamma(1) * abs(rec.p);
+
+  // The outward_normal always points away from the surface. But the hit's
+  // normal depends on whether it is on the front or back face of the
+  // surface. A negative radius turns the normals inside out.
+  vec3 outward_normal = from_center / radius;
+  rec.set_face_normal(r, outward_normal);
+}
+
+// Sets the texture coordinates of rec (see hit_record::u) for a hit on the
+// sphere of the given center and radius: u is the longitude, around the y
+// axis from -x, and v the latitude, from the bottom pole to the top one.
+inline void set_sphere_uv(const point3& center, real radius, hit_record& rec) {
+  const vec3 n = (rec.p - center) / std::fabs(radius);
+  const real theta = std::acos(clamp(-n.y(), -1.0, 1.0));
+  const real phi = std::atan2(-n.z(), n.x()) + pi;
+  rec.u = phi / (2 * pi);
+  rec.v = theta / pi;
+  // u goes around in 2 pi r, v in pi r; this is their geometric mean.
+  rec.uv_scale = 1 / (pi * std::sqrt(2.0) * std::fabs(radius));
+}
+
+bool sphere::intersect(const ray& r, real t_min, real t_max, ray_hit& hit)
+  const {
+  RT_STAT(++thread_stats().primitive_tests);
+  real t;
+  bool exterior;
+  if (!intersect_sphere(center, radius, r, t_min, t_max, t, exterior)) {
+    return false;
+  }
+  hit = {this, t, 0, exterior};
+  return true;
+}
+
+void sphere::finish_hit(const ray& r, const ray_hit& hit, hit_record& rec)
+  const {
+  finish_sphere_hit(center, radius, r, hit.t, rec);
+  rec.color = hit.exterior ? exterior_color : interior_color;
+  rec.material = this->material;
+  if (material && material->needs_uv) {
+    set_sphere_uv(center, radius, rec);
+  }
+}
+
+bool sphere::bounding_box(aabb& output_box) const {
+  // The radius may be negative (see the hollow glass sphere).
+  vec3 half_extent(fabs(radius), fabs(radius), fabs(radius));
+  output_box = aabb(center - half_extent, center + half_extent);
+  return true;
+}
+
 #endif
\ No newline at end of file
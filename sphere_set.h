@@ -0,0 +1,485 @@
+#ifndef SPHERE_SET_H
+#define SPHERE_SET_H
+
+#include "common.h"
+
+#include "aabb.h"
+#include "bvh8.h"
+#include "flat_array.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "sphere.h"
+#include "stats.h"
+#include "trace.h"
+
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <tuple>
+#include <vector>
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+// Many spheres stored as a structure of arrays: the x coordinates of all
+// centers are contiguous, then the y's, and so on. A SIMD register loads the
+// same field of 8 (AVX2) or 16 (AVX-512) spheres at once, and the set is a
+// single hittable, so there's no virtual call per sphere.
+//
+// The SIMD pass works in single precision and is only a filter: it's
+// conservative, letting through every sphere that might be hit (and a few
+// that aren't), and the survivors are intersected by intersect_sphere, like
+// sphere does, in the precision of real.
+//
+// The spheres themselves are stored in single precision, though, to keep
+// big sets small: add rounds centers and radii to float, and the exact test
+// and finish_hit use the rounded sphere. Where real is double, a set only
+// gives the same image as the other accelerators when its coordinates are
+// floats already; otherwise spheres move by up to half a float ulp, which
+// can change which of two touching spheres a ray hits, or a pixel where a
+// ray grazes an edge.
+//
+// Spheres with a negative radius work like in sphere: same surface, inverted
+// normals.
+class sphere_set : public hittable {
+public:
+  // What a sphere looks like; spheres that look the same share one. The
+  // material is an index into materials, not a pointer, so that surfaces can
+  // be saved to a file as they are (see scene_binary.h).
+  struct surface {
+    uint32_t material;
+    color exterior_color;
+    color interior_color;
+  };
+
+  sphere_set() {}
+
+  // Takes every sphere out of the list. Other kinds of objects are skipped.
+  sphere_set(const hittable_list& list);
+
+  void add(
+    point3 center,
+    double radius,
+    color exterior_color,
+    color interior_color,
+    const ::material* material
+  );
+
+  // Builds a BVH8 over the spheres and reorders the arrays so that every leaf
+  // is a contiguous run that one SIMD iteration tests. Until it's called, hit
+  // tests all spheres.
+  void build();
+
+  size_t size() const { return surface_index.size(); }
+
+  virtual bool
+    intersect(const ray& r, real t_min, real t_max, ray_hit& hit) const;
+
+  virtual void
+    finish_hit(const ray& r, const ray_hit& hit, hit_record& rec) const;
+
+  virtual bool bounding_box(aabb& output_box) const;
+
+  // With a tree, traverses it once for the whole packet and tests every
+  // sphere of a leaf against all its rays at once.
+  virtual unsigned intersect_packet(
+    const ray_packet& packet, real t_min, real t_max, ray_hit hits[]
+  ) const;
+
+  // Flat arrays, so that a built set can be read straight out of a mapped
+  // file (see scene_binary.h). Centers and radii are rounded to float.
+  flat_array<float> center_x;
+  flat_array<float> center_y;
+  flat_array<float> center_z;
+  flat_array<float> radius;
+  flat_array<uint32_t> surface_index;
+  flat_array<surface> surfaces;
+  std::vector<const ::material*> materials;
+
+  bvh8_tree tree;
+
+private:
+  bool intersect_range(
+    const ray& r, uint32_t first, uint32_t count, real t_min,
+    real& closest_so_far, ray_hit& hit
+  ) const;
+
+  bool intersect_sphere(
+    uint32_t i, const ray& r, real t_min, real t_max, ray_hit& hit
+  ) const;
+
+  // The float arrays are always padded, so that a full SIMD register can be
+  // loaded at the start of any range. Padding spheres have NaN centers, which
+  // fail every comparison.
+  void pad();
+
+  std::map<std::tuple<const ::material*, double, double, double, double, double, double>, uint32_t>
+    surface_lookup;
+  std::map<const ::material*, uint32_t> material_lookup;
+};
+
+const size_t sphere_set_padding = 16;
+
+// The filters' tolerances are relative to the magnitude of the terms that go
+// into each comparison, and generous: a false positive costs one exact test,
+// a false negative a missing sphere.
+const float sphere_set_tolerance = 1e-4f;
+
+sphere_set::sphere_set(const hittable_list& list) {
+  RT_TRACE_ZONE_ARGS("build sphere_set", "objects", list.objects.size(), nullptr, 0);
+  for (const auto& object : list.objects) {
+    auto s = dynamic_cast<const sphere*>(object);
+    if (!s) {
+      std::cerr << "sphere_set only holds spheres; skipping an object.\n";
+      continue;
+    }
+    add(s->center, s->radius, s->exterior_color, s->interior_color, s->material);
+  }
+}
+
+void sphere_set::add(
+  point3 center,
+  double r,
+  color exterior_color,
+  color interior_color,
+  const ::material* material
+) {
+  auto key = std::make_tuple(
+    material,
+    exterior_color.x(), exterior_color.y(), exterior_color.z(),
+    interior_color.x(), interior_color.y(), interior_color.z()
+  );
+  auto found = surface_lookup.find(key);
+  uint32_t s;
+  if (found != surface_lookup.end()) {
+    s = found->second;
+  } else {
+    auto found_material = material_lookup.find(material);
+    uint32_t m;
+    if (found_material != material_lookup.end()) {
+      m = found_material->second;
+    } else {
+      m = uint32_t(materials.size());
+      materials.push_back(material);
+      material_lookup[material] = m;
+    }
+    s = uint32_t(surfaces.size());
+    surfaces.push_back({m, exterior_color, interior_color});
+    surface_lookup[key] = s;
+  }
+
+  center_x.resize(size());
+  center_y.resize(size());
+  center_z.resize(size());
+  radius.resize(size());
+  tree = bvh8_tree();
+
+  center_x.push_back(float(center.x()));
+  center_y.push_back(float(center.y()));
+  center_z.push_back(float(center.z()));
+  radius.push_back(float(r));
+  surface_index.push_back(s);
+  pad();
+}
+
+void sphere_set::build() {
+  const size_t n = size();
+  std::vector<aabb> boxes(n);
+  for (size_t i = 0; i < n; ++i) {
+    double e = std::fabs(radius[i]);
+    point3 c(center_x[i], center_y[i], center_z[i]);
+    boxes[i] = aabb(c - vec3(e, e, e), c + vec3(e, e, e));
+  }
+  // Leaves of up to 8 spheres: one SIMD iteration each.
+  tree.build(boxes, 8, 8);
+
+  auto reorder = [&](auto& field) {
+    auto old = field;
+    for (size_t i = 0; i < n; ++i) {
+      field[i] = old[tree.indices[i]];
+    }
+  };
+  reorder(center_x);
+  reorder(center_y);
+  reorder(center_z);
+  reorder(radius);
+  reorder(surface_index);
+}
+
+void sphere_set::pad() {
+  const float nan = std::numeric_limits<float>::quiet_NaN();
+  center_x.resize(size() + sphere_set_padding, nan);
+  center_y.resize(size() + sphere_set_padding, nan);
+  center_z.resize(size() + sphere_set_padding, nan);
+  radius.resize(size() + sphere_set_padding, 0.0f);
+}
+
+bool sphere_set::intersect(const ray& r, real t_min, real t_max, ray_hit& hit)
+  const {
+  if (tree.nodes.empty()) {
+    return intersect_range(r, 0, uint32_t(size()), t_min, t_max, hit);
+  }
+
+  return tree.traverse(r, t_min, t_max,
+    [&](uint32_t first, uint32_t count, real& closest_so_far) {
+      return intersect_range(r, first, count, t_min, closest_so_far, hit);
+    }
+  );
+}
+
+bool sphere_set::intersect_range(
+  const ray& r, uint32_t first, uint32_t count, real t_min,
+  real& closest_so_far, ray_hit& hit
+) const {
+  RT_STAT(thread_stats().primitive_tests += count);
+  bool hit_anything = false;
+
+#if defined(__AVX512F__) || (defined(__AVX2__) && defined(__FMA__))
+  const float ox = float(r.origin().x());
+  const float oy = float(r.origin().y());
+  const float oz = float(r.origin().z());
+  const float dx = float(r.direction().x());
+  const float dy = float(r.direction().y());
+  const float dz = float(r.direction().z());
+  const float a = dx * dx + dy * dy + dz * dz;
+
+  // There are no square roots in the filter; their latency costs more than
+  // the exact tests they'd save.
+  const float rel = sphere_set_tolerance;
+#endif
+
+#if defined(__AVX512F__)
+  const int width = 16;
+  const __m512 v_ox = _mm512_set1_ps(ox), v_oy = _mm512_set1_ps(oy), v_oz = _mm512_set1_ps(oz);
+  const __m512 v_dx = _mm512_set1_ps(dx), v_dy = _mm512_set1_ps(dy), v_dz = _mm512_set1_ps(dz);
+  const __m512 v_a = _mm512_set1_ps(a);
+  const __m512 v_rel = _mm512_set1_ps(rel);
+  const __m512 v_rel2 = _mm512_set1_ps(rel * rel);
+  const __m512 v_zero = _mm512_setzero_ps();
+
+  for (uint32_t base = first; base < first + count; base += width) {
+    __m512 ocx = _mm512_sub_ps(v_ox, _mm512_loadu_ps(&center_x[base]));
+    __m512 ocy = _mm512_sub_ps(v_oy, _mm512_loadu_ps(&center_y[base]));
+    __m512 ocz = _mm512_sub_ps(v_oz, _mm512_loadu_ps(&center_z[base]));
+    __m512 rad = _mm512_loadu_ps(&radius[base]);
+
+    __m512 half_b = _mm512_fmadd_ps(ocz, v_dz, _mm512_fmadd_ps(ocy, v_dy, _mm512_mul_ps(ocx, v_dx)));
+    __m512 oc2 = _mm512_fmadd_ps(ocz, ocz, _mm512_fmadd_ps(ocy, ocy, _mm512_mul_ps(ocx, ocx)));
+    __m512 r2 = _mm512_mul_ps(rad, rad);
+    __m512 hb2 = _mm512_mul_ps(half_b, half_b);
+    __m512 disc = _mm512_fnmadd_ps(v_a, _mm512_sub_ps(oc2, r2), hb2);
+    __m512 slack = _mm512_mul_ps(v_rel, _mm512_fmadd_ps(v_a, _mm512_add_ps(oc2, r2), hb2));
+
+    // The ray's line hits the sphere...
+    __mmask16 mask = _mm512_cmp_ps_mask(disc, _mm512_sub_ps(v_zero, slack), _CMP_GT_OQ);
+    // ...unless the origin is clearly outside it and moving away from it, in
+    // which case both roots are behind the origin.
+    __mmask16 away = _mm512_cmp_ps_mask(
+      _mm512_sub_ps(oc2, r2), _mm512_mul_ps(v_rel, _mm512_add_ps(oc2, r2)), _CMP_GT_OQ
+    );
+    away &= _mm512_cmp_ps_mask(half_b, v_zero, _CMP_GT_OQ);
+    away &= _mm512_cmp_ps_mask(hb2, _mm512_mul_ps(v_rel2, _mm512_mul_ps(v_a, oc2)), _CMP_GT_OQ);
+    mask &= ~away;
+
+    uint32_t remaining = first + count - base;
+    if (remaining < uint32_t(width)) {
+      mask &= __mmask16((1u << remaining) - 1);
+    }
+    while (mask) {
+      uint32_t i = base + __builtin_ctz(mask);
+      mask &= mask - 1;
+      if (intersect_sphere(i, r, t_min, closest_so_far, hit)) {
+        hit_anything = true;
+        closest_so_far = hit.t;
+      }
+    }
+  }
+#elif defined(__AVX2__) && defined(__FMA__)
+  const int width = 8;
+  const __m256 v_ox = _mm256_set1_ps(ox), v_oy = _mm256_set1_ps(oy), v_oz = _mm256_set1_ps(oz);
+  const __m256 v_dx = _mm256_set1_ps(dx), v_dy = _mm256_set1_ps(dy), v_dz = _mm256_set1_ps(dz);
+  const __m256 v_a = _mm256_set1_ps(a);
+  const __m256 v_rel = _mm256_set1_ps(rel);
+  const __m256 v_rel2 = _mm256_set1_ps(rel * rel);
+  const __m256 v_zero = _mm256_setzero_ps();
+
+  for (uint32_t base = first; base < first + count; base += width) {
+    __m256 ocx = _mm256_sub_ps(v_ox, _mm256_loadu_ps(&center_x[base]));
+    __m256 ocy = _mm256_sub_ps(v_oy, _mm256_loadu_ps(&center_y[base]));
+    __m256 ocz = _mm256_sub_ps(v_oz, _mm256_loadu_ps(&center_z[base]));
+    __m256 rad = _mm256_loadu_ps(&radius[base]);
+
+    __m256 half_b = _mm256_fmadd_ps(ocz, v_dz, _mm256_fmadd_ps(ocy, v_dy, _mm256_mul_ps(ocx, v_dx)));
+    __m256 oc2 = _mm256_fmadd_ps(ocz, ocz, _mm256_fmadd_ps(ocy, ocy, _mm256_mul_ps(ocx, ocx)));
+    __m256 r2 = _mm256_mul_ps(rad, rad);
+    __m256 hb2 = _mm256_mul_ps(half_b, half_b);
+    __m256 disc = _mm256_fnmadd_ps(v_a, _mm256_sub_ps(oc2, r2), hb2);
+    __m256 slack = _mm256_mul_ps(v_rel, _mm256_fmadd_ps(v_a, _mm256_add_ps(oc2, r2), hb2));
+
+    // The ray's line hits the sphere...
+    __m256 keep = _mm256_cmp_ps(disc, _mm256_sub_ps(v_zero, slack), _CMP_GT_OQ);
+    // ...unless the origin is clearly outside it and moving away from it, in
+    // which case both roots are behind the origin.
+    __m256 away = _mm256_cmp_ps(
+      _mm256_sub_ps(oc2, r2), _mm256_mul_ps(v_rel, _mm256_add_ps(oc2, r2)), _CMP_GT_OQ
+    );
+    away = _mm256_and_ps(away, _mm256_cmp_ps(half_b, v_zero, _CMP_GT_OQ));
+    away = _mm256_and_ps(away, _mm256_cmp_ps(
+      hb2, _mm256_mul_ps(v_rel2, _mm256_mul_ps(v_a, oc2)), _CMP_GT_OQ
+    ));
+    keep = _mm256_andnot_ps(away, keep);
+    unsigned mask = unsigned(_mm256_movemask_ps(keep));
+
+    uint32_t remaining = first + count - base;
+    if (remaining < uint32_t(width)) {
+      mask &= (1u << remaining) - 1;
+    }
+    while (mask) {
+      uint32_t i = base + __builtin_ctz(mask);
+      mask &= mask - 1;
+      if (intersect_sphere(i, r, t_min, closest_so_far, hit)) {
+        hit_anything = true;
+        closest_so_far = hit.t;
+      }
+    }
+  }
+#else
+  for (uint32_t i = first; i < first + count; ++i) {
+    if (intersect_sphere(i, r, t_min, closest_so_far, hit)) {
+      hit_anything = true;
+      closest_so_far = hit.t;
+    }
+  }
+#endif
+
+  return hit_anything;
+}
+
+unsigned sphere_set::intersect_packet(
+  const ray_packet& packet, real t_min, real t_max, ray_hit hits[]
+) const {
+  if (tree.nodes.empty()) {
+    return hittable::intersect_packet(packet, t_min, t_max, hits);
+  }
+
+  ray rays[ray_packet_size];
+  real closest_so_far[ray_packet_size];
+  for (int k = 0; k < packet.count; ++k) {
+    rays[k] = packet.get(k);
+    closest_so_far[k] = t_max;
+  }
+
+#if defined(__AVX2__) && defined(__FMA__)
+  // The filter of intersect_range with the lanes swapped: one sphere against 8
+  // rays instead of one ray against 8 spheres.
+  __m256 ox = _mm256_setzero_ps(), oy = ox, oz = ox, dx = ox, dy = ox, dz = ox;
+  {
+    alignas(32) float f[6][ray_packet_size] = {};
+    for (int k = 0; k < packet.count; ++k) {
+      for (int a = 0; a < 3; ++a) {
+        f[a][k] = float(packet.origin[a][k]);
+        f[3 + a][k] = float(packet.direction[a][k]);
+      }
+    }
+    ox = _mm256_load_ps(f[0]);
+    oy = _mm256_load_ps(f[1]);
+    oz = _mm256_load_ps(f[2]);
+    dx = _mm256_load_ps(f[3]);
+    dy = _mm256_load_ps(f[4]);
+    dz = _mm256_load_ps(f[5]);
+  }
+  const __m256 a = _mm256_fmadd_ps(dz, dz, _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dx, dx)));
+  const __m256 v_rel = _mm256_set1_ps(sphere_set_tolerance);
+  const __m256 v_rel2 = _mm256_set1_ps(sphere_set_tolerance * sphere_set_tolerance);
+  const __m256 v_zero = _mm256_setzero_ps();
+#endif
+
+  return tree.traverse_packet(packet, t_min, closest_so_far,
+    [&](uint32_t first, uint32_t count, unsigned lanes, real* closest) {
+      unsigned hit_lanes = 0;
+      for (uint32_t i = first; i < first + count; ++i) {
+#if defined(__AVX2__) && defined(__FMA__)
+        __m256 ocx = _mm256_sub_ps(ox, _mm256_set1_ps(center_x[i]));
+        __m256 ocy = _mm256_sub_ps(oy, _mm256_set1_ps(center_y[i]));
+        __m256 ocz = _mm256_sub_ps(oz, _mm256_set1_ps(center_z[i]));
+        __m256 r2 = _mm256_set1_ps(radius[i] * radius[i]);
+
+        __m256 half_b = _mm256_fmadd_ps(ocz, dz, _mm256_fmadd_ps(ocy, dy, _mm256_mul_ps(ocx, dx)));
+        __m256 oc2 = _mm256_fmadd_ps(ocz, ocz, _mm256_fmadd_ps(ocy, ocy, _mm256_mul_ps(ocx, ocx)));
+        __m256 hb2 = _mm256_mul_ps(half_b, half_b);
+        __m256 disc = _mm256_fnmadd_ps(a, _mm256_sub_ps(oc2, r2), hb2);
+        __m256 slack = _mm256_mul_ps(v_rel, _mm256_fmadd_ps(a, _mm256_add_ps(oc2, r2), hb2));
+
+        __m256 keep = _mm256_cmp_ps(disc, _mm256_sub_ps(v_zero, slack), _CMP_GT_OQ);
+        __m256 away = _mm256_cmp_ps(
+          _mm256_sub_ps(oc2, r2), _mm256_mul_ps(v_rel, _mm256_add_ps(oc2, r2)), _CMP_GT_OQ
+        );
+        away = _mm256_and_ps(away, _mm256_cmp_ps(half_b, v_zero, _CMP_GT_OQ));
+        away = _mm256_and_ps(away, _mm256_cmp_ps(
+          hb2, _mm256_mul_ps(v_rel2, _mm256_mul_ps(a, oc2)), _CMP_GT_OQ
+        ));
+        keep = _mm256_andnot_ps(away, keep);
+        unsigned mask = lanes & unsigned(_mm256_movemask_ps(keep));
+#else
+        unsigned mask = lanes;
+#endif
+        for (; mask; mask &= mask - 1) {
+          int k = __builtin_ctz(mask);
+          if (intersect_sphere(i, rays[k], t_min, closest[k], hits[k])) {
+            hit_lanes |= 1u << k;
+            closest[k] = hits[k].t;
+          }
+        }
+      }
+      return hit_lanes;
+    }
+  );
+}
+
+bool sphere_set::intersect_sphere(
+  uint32_t i, const ray& r, real t_min, real t_max, ray_hit& hit
+) const {
+  point3 center(center_x[i], center_y[i], center_z[i]);
+  real t;
+  bool exterior;
+  if (!::intersect_sphere(center, radius[i], r, t_min, t_max, t, exterior)) {
+    return false;
+  }
+  hit = {this, t, i, exterior};
+  return true;
+}
+
+void sphere_set::finish_hit(const ray& r, const ray_hit& hit, hit_record& rec)
+  const {
+  uint32_t i = hit.primitive;
+  point3 center(center_x[i], center_y[i], center_z[i]);
+  finish_sphere_hit(center, radius[i], r, hit.t, rec);
+  const surface& s = surfaces[surface_index[i]];
+  rec.color = hit.exterior ? s.exterior_color : s.interior_color;
+  rec.material = materials[s.material];
+  if (rec.material && rec.material->needs_uv) {
+    set_sphere_uv(center, radius[i], rec);
+  }
+}
+
+bool sphere_set::bounding_box(aabb& output_box) const {
+  if (size() == 0) {
+    return false;
+  }
+  if (!tree.nodes.empty()) {
+    output_box = tree.bounds;
+    return true;
+  }
+  output_box = aabb();
+  for (size_t i = 0; i < size(); ++i) {
+    double e = std::fabs(radius[i]);
+    point3 c(center_x[i], center_y[i], center_z[i]);
+    output_box.grow(aabb(c - vec3(e, e, e), c + vec3(e, e, e)));
+  }
+  return true;
+}
+
+#endif
@@ -0,0 +1,188 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+// Counters of what a render does: how many rays it traces, how many boxes
+// and primitives they're tested against, how paths end and after how many
+// bounces, and what the materials do with them.
+//
+// They're compiled in with -DRT_STATS (the RT_STATS option of CMake), and
+// out otherwise: every place that counts something does it inside RT_STAT(),
+// which is empty without RT_STATS, so a normal build pays nothing. With it,
+// every thread counts into a block of its own, without atomics or locks, and
+// collect_stats() adds the blocks up once the render is done.
+#if defined(RT_STATS)
+#define RT_STAT(statement) statement
+#else
+#define RT_STAT(statement)
+#endif
+
+// Why a path stopped bouncing.
+enum class path_end {
+  // It hit nothing, and took the background's color.
+  escaped,
+  // Its material didn't scatter it.
+  absorbed,
+  // Russian roulette (see path_tracer.h).
+  roulette,
+  // It bounced max_depth times.
+  max_depth
+};
+
+struct alignas(64) render_stats {
+  // Paths of this many bounces or more all go in the last bin.
+  static const int path_length_bins = 64;
+  // One counter per material_type (see material.h).
+  static const int material_classes = 5;
+
+  // Rays intersected with the world: the ones from the camera, and the ones
+  // that bounced off a surface. The tracer has no lights, so there are no
+  // shadow rays.
+  size_t camera_rays = 0;
+  size_t bounce_rays = 0;
+  // Bounding boxes and primitives rays were tested against. A SIMD test of
+  // several boxes or primitives at once counts every one of them.
+  size_t box_tests = 0;
+  size_t primitive_tests = 0;
+
+  size_t scatters[material_classes] = {};
+  // What dielectric::scatter did: refract, reflect by Schlick's
+  // approximation, or reflect because there's no refraction.
+  size_t refractions = 0;
+  size_t fresnel_reflections = 0;
+  size_t total_internal_reflections = 0;
+
+  size_t path_ends[4] = {};
+  // Paths by their number of bounces when they ended.
+  size_t path_lengths[path_length_bins] = {};
+
+  void end_path(path_end reason, int bounces) {
+    ++path_ends[int(reason)];
+    ++path_lengths[std::min(bounces, path_length_bins - 1)];
+  }
+
+  void add(const render_stats& other);
+
+  // Writes the counters as a JSON object.
+  void write_json(std::ostream& out) const;
+};
+
+void render_stats::add(const render_stats& other) {
+  camera_rays += other.camera_rays;
+  bounce_rays += other.bounce_rays;
+  box_tests += other.box_tests;
+  primitive_tests += other.primitive_tests;
+  for (int n = 0; n < material_classes; ++n) {
+    scatters[n] += other.scatters[n];
+  }
+  refractions += other.refractions;
+  fresnel_reflections += other.fresnel_reflections;
+  total_internal_reflections += other.total_internal_reflections;
+  for (int n = 0; n < 4; ++n) {
+    path_ends[n] += other.path_ends[n];
+  }
+  for (int n = 0; n < path_length_bins; ++n) {
+    path_lengths[n] += other.path_lengths[n];
+  }
+}
+
+void render_stats::write_json(std::ostream& out) const {
+  static const char* const material_names[material_classes]
+    = {"other", "lambertian", "metal", "fuzzy", "dielectric"};
+  static const char* const end_names[4]
+    = {"escaped", "absorbed", "roulette", "max_depth"};
+  const size_t rays = camera_rays + bounce_rays;
+  const double per_ray = rays ? 1.0 / rays : 0.0;
+
+  out << "{\n"
+    << "  \"rays\": {\"camera\": " << camera_rays
+    << ", \"bounce\": " << bounce_rays << ", \"shadow\": 0},\n"
+    << "  \"box_tests\": " << box_tests << ",\n"
+    << "  \"primitive_tests\": " << primitive_tests << ",\n"
+    << "  \"box_tests_per_ray\": " << box_tests * per_ray << ",\n"
+    << "  \"primitive_tests_per_ray\": " << primitive_tests * per_ray << ",\n"
+    << "  \"scatters\": {";
+  for (int n = 0; n < material_classes; ++n) {
+    out << (n ? ", " : "") << "\"" << material_names[n] << "\": " << scatters[n];
+  }
+  out << "},\n"
+    << "  \"dielectric\": {\"refractions\": " << refractions
+    << ", \"fresnel_reflections\": " << fresnel_reflections
+    << ", \"total_internal_reflections\": " << total_internal_reflections
+    << "},\n"
+    << "  \"path_ends\": {";
+  for (int n = 0; n < 4; ++n) {
+    out << (n ? ", " : "") << "\"" << end_names[n] << "\": " << path_ends[n];
+  }
+  // The histogram stops at the longest path.
+  int bins = path_length_bins;
+  while (bins > 0 && path_lengths[bins - 1] == 0) {
+    --bins;
+  }
+  out << "},\n"
+    << "  \"path_lengths\": [";
+  for (int n = 0; n < bins; ++n) {
+    out << (n ? ", " : "") << path_lengths[n];
+  }
+  out << "]\n}\n";
+}
+
+// The blocks of every thread that has counted something. A block outlives
+// its thread, so that the counts of a pool that's gone aren't lost.
+class stats_registry {
+public:
+  static stats_registry& instance() {
+    static stats_registry registry;
+    return registry;
+  }
+
+  render_stats* add() {
+    std::lock_guard<std::mutex> guard(lock);
+    blocks.push_back(std::make_unique<render_stats>());
+    return blocks.back().get();
+  }
+
+  // Only while no thread is counting, e.g. between renders.
+  render_stats total() {
+    std::lock_guard<std::mutex> guard(lock);
+    render_stats sum;
+    for (const auto& block : blocks) {
+      sum.add(*block);
+    }
+    return sum;
+  }
+
+  void reset() {
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto& block : blocks) {
+      *block = render_stats();
+    }
+  }
+
+private:
+  std::mutex lock;
+  std::vector<std::unique_ptr<render_stats>> blocks;
+};
+
+// The block the calling thread counts into.
+inline render_stats& thread_stats() {
+  thread_local render_stats* block = stats_registry::instance().add();
+  return *block;
+}
+
+// The counts of all threads since the start, or since reset_stats().
+inline render_stats collect_stats() {
+  return stats_registry::instance().total();
+}
+
+inline void reset_stats() {
+  stats_registry::instance().reset();
+}
+
+#endif
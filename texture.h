@@ -1,45 +1,56 @@
-#ifndef TEXTUREH
-#define TEXTUREH
+#ifndef TEXTURE_H
+#define TEXTURE_H
 
-class vec3;
+#include "common.h"
 
-// Conceptually, a texture is a function that returns the color found at
-// a given UV coordinate.
-class texture {
-  public:
-    virtual vec3 value(float u, float v, const vec3& p) const = 0;
-};
+#include "hittable.h"
 
-class constant_texture : public texture {
-  public:
-    constant_texture() {}
+#include <cmath>
 
-    constant_texture(vec3 c) : color(c) {}
+// Conceptually, a texture is a function that returns the color found at
+// a given point of a surface. It's given the whole hit, so that it can use
+// whatever it needs of it.
+class texture {
+public:
+  texture(bool needs_uv = false) : needs_uv(needs_uv) {}
 
-    virtual vec3 value(float u, float v, const vec3& p) const {
-      return color;
-    }
+  virtual color value(const hit_record& hit) const = 0;
 
-    vec3 color;
+  // Whether value() uses the hit's u, v and uv_scale, which objects only
+  // compute when asked.
+  const bool needs_uv;
 };
 
-class checker_texture : public texture {
-  public:
-    checker_texture() {}
+class constant_texture final : public texture {
+public:
+  constant_texture(color c) : color_value(c) {}
 
-    checker_texture(texture *t0, texture *t1) : even(t0), odd(t1) {}
+  virtual color value(const hit_record& hit) const {
+    return color_value;
+  }
 
-    virtual vec3 value(float u, float v, const vec3& p) const {
-      float sines = sin(10*p.x()) * sin(10*p.y()) * sin(10*p.z());
-      if (sines < 0) {
-        return odd->value(u, v, p);
-      } else {
-        return even->value(u, v, p);
-      }
-    };
+  color color_value;
+};
 
-    texture *odd;
-    texture *even;
+// A 3D checkerboard of two textures, whose squares are about pi / scale
+// wide: surfaces take the squares of wherever they are in space.
+class checker_texture final : public texture {
+public:
+  checker_texture(const texture* even, const texture* odd, real scale = 10)
+    : texture(even->needs_uv || odd->needs_uv), even(even), odd(odd),
+      scale(scale) {}
+
+  virtual color value(const hit_record& hit) const {
+    const point3& p = hit.p;
+    real sines = std::sin(scale * p.x()) * std::sin(scale * p.y())
+      * std::sin(scale * p.z());
+    return sines < 0 ? odd->value(hit) : even->value(hit);
+  }
+
+  // Owned by the scene (see scene_arena.h).
+  const texture* even;
+  const texture* odd;
+  real scale;
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,185 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "random.h"
+#include "trace.h"
+
+// A fixed set of worker threads that run parallel_for jobs. Every worker owns
+// a deque of work items: it pops from the front of its own deque and, when it
+// runs out, steals from the back of somebody else's. Items are dealt in
+// contiguous blocks, so neighboring tiles tend to be rendered by the same
+// thread, and the expensive regions of the image (glass, for instance) get
+// spread around by stealing instead of leaving one thread behind.
+class work_stealing_pool {
+public:
+  explicit work_stealing_pool(unsigned thread_count = 0);
+  ~work_stealing_pool();
+
+  work_stealing_pool(const work_stealing_pool&) = delete;
+  work_stealing_pool& operator=(const work_stealing_pool&) = delete;
+
+  unsigned size() const { return static_cast<unsigned>(workers.size()); }
+
+  // Calls task(item, worker) for every item in [0, count) and blocks until all
+  // of them have finished. worker is in [0, size()).
+  void parallel_for(
+    size_t count, const std::function<void(size_t, unsigned)>& task
+  );
+
+private:
+  struct work_queue {
+    std::mutex lock;
+    std::deque<size_t> items;
+  };
+
+  bool pop(unsigned worker, size_t& item);
+  bool steal(unsigned thief, size_t& item);
+  void worker_loop(unsigned worker);
+
+  std::vector<std::thread> workers;
+  std::vector<std::unique_ptr<work_queue>> queues;
+
+  std::mutex job_lock;
+  std::condition_variable job_ready;
+  std::condition_variable job_done;
+  const std::function<void(size_t, unsigned)>* job = nullptr;
+  unsigned long long generation = 0;
+  // Number of workers that haven't yet run out of items for the current job.
+  unsigned busy = 0;
+  bool stopping = false;
+};
+
+work_stealing_pool::work_stealing_pool(unsigned thread_count) {
+  if (thread_count == 0) {
+    thread_count = std::thread::hardware_concurrency();
+  }
+  if (thread_count == 0) {
+    thread_count = 1;
+  }
+
+  for (unsigned w = 0; w < thread_count; ++w) {
+    queues.push_back(std::make_unique<work_queue>());
+  }
+  for (unsigned w = 0; w < thread_count; ++w) {
+    workers.emplace_back([this, w] { worker_loop(w); });
+  }
+}
+
+work_stealing_pool::~work_stealing_pool() {
+  {
+    std::lock_guard<std::mutex> guard(job_lock);
+    stopping = true;
+  }
+  job_ready.notify_all();
+  for (auto& worker : workers) {
+    worker.join();
+  }
+}
+
+void work_stealing_pool::parallel_for(
+  size_t count, const std::function<void(size_t, unsigned)>& task
+) {
+  if (count == 0) {
+    return;
+  }
+
+  // Deal the items in contiguous blocks, one block per worker. No worker is
+  // running yet, so the queues can be filled without contention.
+  const size_t n = queues.size();
+  for (size_t w = 0; w < n; ++w) {
+    std::lock_guard<std::mutex> guard(queues[w]->lock);
+    size_t begin = count * w / n;
+    size_t end = count * (w + 1) / n;
+    for (size_t item = begin; item < end; ++item) {
+      queues[w]->items.push_back(item);
+    }
+  }
+
+  RT_TRACE_ZONE("wait for workers");
+  std::unique_lock<std::mutex> guard(job_lock);
+  job = &task;
+  busy = size();
+  ++generation;
+  job_ready.notify_all();
+  job_done.wait(guard, [this] { return busy == 0; });
+  job = nullptr;
+}
+
+bool work_stealing_pool::pop(unsigned worker, size_t& item) {
+  work_queue& queue = *queues[worker];
+  std::lock_guard<std::mutex> guard(queue.lock);
+  if (queue.items.empty()) {
+    return false;
+  }
+  item = queue.items.front();
+  queue.items.pop_front();
+  return true;
+}
+
+bool work_stealing_pool::steal(unsigned thief, size_t& item) {
+  RT_TRACE_ZONE("steal");
+  const unsigned n = size();
+  for (unsigned k = 1; k < n; ++k) {
+    work_queue& victim = *queues[(thief + k) % n];
+    std::lock_guard<std::mutex> guard(victim.lock);
+    if (!victim.items.empty()) {
+      // Steal from the opposite end the owner pops from, so that the owner
+      // keeps working on the tiles next to the one it just finished.
+      item = victim.items.back();
+      victim.items.pop_back();
+      return true;
+    }
+  }
+  return false;
+}
+
+void work_stealing_pool::worker_loop(unsigned worker) {
+  unsigned long long seen_generation = 0;
+
+  // Give every worker a stream of its own, for the code that draws random
+  // numbers without re-keying the generator first.
+  thread_rng() = rng(mix64(rng::default_seed + (worker + 1) * rng::gamma));
+  RT_TRACE_ONLY(trace_thread_name("worker " + std::to_string(worker)));
+
+  while (true) {
+    const std::function<void(size_t, unsigned)>* task;
+    {
+      RT_TRACE_ZONE("wait for job");
+      std::unique_lock<std::mutex> guard(job_lock);
+      job_ready.wait(guard, [&] {
+        return stopping || generation != seen_generation;
+      });
+      if (stopping) {
+        return;
+      }
+      seen_generation = generation;
+      task = job;
+    }
+
+    // Items are only ever added before the job starts, so once every queue is
+    // empty there is nothing left to do for this job.
+    size_t item;
+    while (pop(worker, item) || steal(worker, item)) {
+      (*task)(item, worker);
+    }
+
+    {
+      std::lock_guard<std::mutex> guard(job_lock);
+      if (--busy == 0) {
+        job_done.notify_one();
+      }
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,194 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// A timeline of what every thread did when: the spans of time spent in
+// trace zones, written out in the Chrome trace format, which
+// chrome://tracing and Perfetto (ui.perfetto.dev) show one row per thread.
+//
+// Zones are compiled in with -DRT_TRACE (the RT_TRACE option of CMake). A
+// zone is the scope of an RT_TRACE_ZONE("name") or
+// RT_TRACE_ZONE_ARGS("name", "arg", value, "arg", value):
+//
+//   {
+//     RT_TRACE_ZONE_ARGS("tile", "x", t.x0, "y", t.y0);
+//     ... everything until the end of the scope is in the zone ...
+//   }
+//
+// Threads show up with the name they give themselves with
+// RT_TRACE_ONLY(trace_thread_name(name)), or a number.
+//
+// Without RT_TRACE, the macros are empty and nothing is compiled in. With it,
+// a zone reads the clock twice and writes one event into a ring buffer that
+// belongs to its thread, without a lock: only the thread writes it, and it's
+// read by write_trace() once the threads are done. A thread keeps its last
+// trace_buffer::capacity events.
+#if defined(RT_TRACE)
+#define RT_TRACE_CONCAT2(a, b) a##b
+#define RT_TRACE_CONCAT(a, b) RT_TRACE_CONCAT2(a, b)
+#define RT_TRACE_ZONE(name) \
+  trace_zone RT_TRACE_CONCAT(trace_zone_, __LINE__)(name)
+#define RT_TRACE_ZONE_ARGS(name, arg0, value0, arg1, value1) \
+  trace_zone RT_TRACE_CONCAT(trace_zone_, __LINE__)( \
+    name, arg0, int64_t(value0), arg1, int64_t(value1) \
+  )
+// Any other statement that only makes sense with tracing, e.g. naming a
+// thread with trace_thread_name().
+#define RT_TRACE_ONLY(statement) statement
+#else
+#define RT_TRACE_ZONE(name)
+#define RT_TRACE_ZONE_ARGS(name, arg0, value0, arg1, value1)
+#define RT_TRACE_ONLY(statement)
+#endif
+
+#if defined(RT_TRACE)
+// A span of time of one thread. Names are string literals, so only their
+// pointers are kept; an arg whose name is null isn't written.
+struct trace_event {
+  const char* name;
+  int64_t begin_ns;
+  int64_t end_ns;
+  const char* arg_names[2];
+  int64_t args[2];
+};
+
+// The events of one thread, in a ring: once it's full, every event overwrites
+// the oldest one.
+struct trace_buffer {
+  static constexpr size_t capacity = size_t(1) << 16;
+
+  trace_buffer(int id) : id(id), events(capacity) {}
+
+  void add(const trace_event& e) {
+    size_t n = written.load(std::memory_order_relaxed);
+    events[n & (capacity - 1)] = e;
+    written.store(n + 1, std::memory_order_release);
+  }
+
+  const int id;
+  std::string name;
+  std::vector<trace_event> events;
+  // Events ever written; the last min(written, capacity) are in events.
+  std::atomic<size_t> written{0};
+};
+
+// The buffers of every thread that has traced a zone. Buffers outlive their
+// threads, so that the zones of a pool that's gone are still written.
+class trace_registry {
+public:
+  static trace_registry& instance() {
+    static trace_registry registry;
+    return registry;
+  }
+
+  trace_buffer* add() {
+    std::lock_guard<std::mutex> guard(lock);
+    buffers.push_back(std::make_unique<trace_buffer>(int(buffers.size())));
+    return buffers.back().get();
+  }
+
+  // Writes every event in the Chrome trace format, with times in
+  // microseconds since the trace started. Only while no thread is tracing.
+  void write(std::ostream& out);
+
+  // Times are measured from here.
+  const std::chrono::steady_clock::time_point start
+    = std::chrono::steady_clock::now();
+
+private:
+  std::mutex lock;
+  std::vector<std::unique_ptr<trace_buffer>> buffers;
+};
+
+void trace_registry::write(std::ostream& out) {
+  std::lock_guard<std::mutex> guard(lock);
+  out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+  bool first = true;
+  auto separator = [&] {
+    out << (first ? "" : ",\n");
+    first = false;
+  };
+  for (const auto& buffer : buffers) {
+    if (!buffer->name.empty()) {
+      separator();
+      out << "{\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": 1, \"tid\": "
+        << buffer->id << ", \"args\": {\"name\": \"" << buffer->name << "\"}}";
+    }
+    const size_t written = buffer->written.load(std::memory_order_acquire);
+    const size_t kept = std::min(written, trace_buffer::capacity);
+    for (size_t n = written - kept; n < written; ++n) {
+      const trace_event& e = buffer->events[n & (trace_buffer::capacity - 1)];
+      separator();
+      out << "{\"ph\": \"X\", \"name\": \"" << e.name
+        << "\", \"pid\": 1, \"tid\": " << buffer->id
+        << ", \"ts\": " << e.begin_ns / 1000.0
+        << ", \"dur\": " << (e.end_ns - e.begin_ns) / 1000.0;
+      if (e.arg_names[0] || e.arg_names[1]) {
+        out << ", \"args\": {";
+        const char* comma = "";
+        for (int a = 0; a < 2; ++a) {
+          if (e.arg_names[a]) {
+            out << comma << "\"" << e.arg_names[a] << "\": " << e.args[a];
+            comma = ", ";
+          }
+        }
+        out << "}";
+      }
+      out << "}";
+    }
+  }
+  out << "\n]}\n";
+}
+
+// The buffer the calling thread traces into.
+inline trace_buffer& thread_trace() {
+  thread_local trace_buffer* buffer = trace_registry::instance().add();
+  return *buffer;
+}
+
+inline void trace_thread_name(const std::string& name) {
+  thread_trace().name = name;
+}
+
+inline int64_t trace_now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now() - trace_registry::instance().start
+  ).count();
+}
+
+// Records the time from its construction to its destruction as an event.
+class trace_zone {
+public:
+  explicit trace_zone(
+    const char* name, const char* arg0 = nullptr, int64_t value0 = 0,
+    const char* arg1 = nullptr, int64_t value1 = 0
+  ) : event{name, trace_now_ns(), 0, {arg0, arg1}, {value0, value1}} {}
+
+  trace_zone(const trace_zone&) = delete;
+  trace_zone& operator=(const trace_zone&) = delete;
+
+  ~trace_zone() {
+    event.end_ns = trace_now_ns();
+    thread_trace().add(event);
+  }
+
+private:
+  trace_event event;
+};
+
+// Writes the zones of every thread so far (see trace_registry::write).
+inline void write_trace(std::ostream& out) {
+  trace_registry::instance().write(out);
+}
+#endif
+
+#endif
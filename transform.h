@@ -0,0 +1,147 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include "common.h"
+
+#include <cmath>
+
+// An affine transform of space: a linear map, then a translation. It's stored
+// as the 3 rows of a 3x4 matrix whose last column is the translation.
+struct transform {
+  real m[3][4];
+
+  static transform identity() {
+    return scaling(vec3(1, 1, 1));
+  }
+
+  static transform translation(const vec3& offset) {
+    transform t = identity();
+    for (int r = 0; r < 3; ++r) {
+      t.m[r][3] = offset[r];
+    }
+    return t;
+  }
+
+  static transform scaling(const vec3& factors) {
+    transform t = {};
+    for (int r = 0; r < 3; ++r) {
+      t.m[r][r] = factors[r];
+    }
+    return t;
+  }
+
+  // A rotation by the given angle about the axis, counterclockwise when the
+  // axis points at the viewer.
+  static transform rotation(const vec3& axis, double degrees) {
+    const vec3 a = unit_vector(axis);
+    const real c = std::cos(degrees_to_radians(degrees));
+    const real s = std::sin(degrees_to_radians(degrees));
+    transform t = {};
+    for (int r = 0; r < 3; ++r) {
+      for (int col = 0; col < 3; ++col) {
+        t.m[r][col] = (1 - c) * a[r] * a[col] + (r == col ? c : 0);
+      }
+    }
+    t.m[0][1] -= s * a.z();
+    t.m[0][2] += s * a.y();
+    t.m[1][0] += s * a.z();
+    t.m[1][2] -= s * a.x();
+    t.m[2][0] -= s * a.y();
+    t.m[2][1] += s * a.x();
+    return t;
+  }
+
+  // This transform after other.
+  transform operator*(const transform& other) const;
+
+  // The transform that undoes this one, which must not be singular.
+  transform inverse() const;
+
+  // The determinant of the linear part: how much it scales volumes, and
+  // whether it mirrors them.
+  real determinant() const {
+    return m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])
+      - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+      + m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+  }
+
+  point3 point(const point3& p) const {
+    point3 out;
+    for (int r = 0; r < 3; ++r) {
+      out[r] = m[r][0] * p.x() + m[r][1] * p.y() + m[r][2] * p.z() + m[r][3];
+    }
+    return out;
+  }
+
+  // The same, with a bound on the rounding error of the result, given one on
+  // that of p (see hit_record::p_error).
+  point3 point(const point3& p, const vec3& p_error, vec3& error) const {
+    for (int r = 0; r < 3; ++r) {
+      real magnitude = 0;
+      real propagated = 0;
+      for (int col = 0; col < 3; ++col) {
+        magnitude += std::fabs(m[r][col] * p[col]);
+        propagated += std::fabs(m[r][col]) * p_error[col];
+      }
+      error[r] = (1 + rounding_gamma(3)) * propagated
+        + rounding_gamma(3) * (magnitude + std::fabs(m[r][3]));
+    }
+    return point(p);
+  }
+
+  // Directions aren't translated.
+  vec3 vector(const vec3& v) const {
+    vec3 out;
+    for (int r = 0; r < 3; ++r) {
+      out[r] = m[r][0] * v.x() + m[r][1] * v.y() + m[r][2] * v.z();
+    }
+    return out;
+  }
+
+  // The linear part transposed. Normals of surfaces transformed by t are
+  // transformed by t.inverse().transposed_vector(n), which keeps them normal.
+  vec3 transposed_vector(const vec3& v) const {
+    vec3 out;
+    for (int col = 0; col < 3; ++col) {
+      out[col] = m[0][col] * v.x() + m[1][col] * v.y() + m[2][col] * v.z();
+    }
+    return out;
+  }
+};
+
+transform transform::operator*(const transform& other) const {
+  transform t;
+  for (int r = 0; r < 3; ++r) {
+    for (int col = 0; col < 4; ++col) {
+      t.m[r][col] = m[r][0] * other.m[0][col] + m[r][1] * other.m[1][col]
+        + m[r][2] * other.m[2][col] + (col == 3 ? m[r][3] : 0);
+    }
+  }
+  return t;
+}
+
+transform transform::inverse() const {
+  // The inverse of the linear part is its adjugate over its determinant; the
+  // translation is then undone by moving back by the inverse of it.
+  transform t;
+  for (int r = 0; r < 3; ++r) {
+    for (int col = 0; col < 3; ++col) {
+      const int r1 = (col + 1) % 3, r2 = (col + 2) % 3;
+      const int c1 = (r + 1) % 3, c2 = (r + 2) % 3;
+      t.m[r][col] = m[r1][c1] * m[r2][c2] - m[r1][c2] * m[r2][c1];
+    }
+  }
+  const real det
+    = m[0][0] * t.m[0][0] + m[0][1] * t.m[1][0] + m[0][2] * t.m[2][0];
+  for (int r = 0; r < 3; ++r) {
+    for (int col = 0; col < 3; ++col) {
+      t.m[r][col] /= det;
+    }
+  }
+  for (int r = 0; r < 3; ++r) {
+    t.m[r][3] = -(t.m[r][0] * m[0][3] + t.m[r][1] * m[1][3] + t.m[r][2] * m[2][3]);
+  }
+  return t;
+}
+
+#endif
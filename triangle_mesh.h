@@ -0,0 +1,421 @@
+#ifndef TRIANGLE_MESH_H
+#define TRIANGLE_MESH_H
+
+#include "common.h"
+
+#include "aabb.h"
+#include "bvh8.h"
+#include "hittable.h"
+#include "stats.h"
+#include "trace.h"
+
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// Intersects r with the triangle v0 v1 v2 by the Moller-Trumbore algorithm.
+// When it hits it between t_min and t_max, sets t and the barycentric
+// coordinates u and v of the hit (the weights of v1 and v2), and returns true.
+// Edges are computed from v0, so two triangles that share an edge don't
+// round it the same way; a ray that grazes it may slip through both.
+inline bool intersect_triangle(
+  const point3& v0, const point3& v1, const point3& v2, const ray& r,
+  real t_min, real t_max, real& t, real& u, real& v
+) {
+  const vec3 e1 = v1 - v0;
+  const vec3 e2 = v2 - v0;
+  const vec3 p = cross(r.direction(), e2);
+  const real det = dot(e1, p);
+  if (det == 0) {
+    return false;
+  }
+  const real inv_det = 1 / det;
+  const vec3 tv = r.origin() - v0;
+  const real hit_u = dot(tv, p) * inv_det;
+  if (hit_u < 0 || hit_u > 1) {
+    return false;
+  }
+  const vec3 q = cross(tv, e1);
+  const real hit_v = dot(r.direction(), q) * inv_det;
+  if (hit_v < 0 || hit_u + hit_v > 1) {
+    return false;
+  }
+  const real hit_t = dot(e2, q) * inv_det;
+  if (hit_t <= t_min || hit_t >= t_max) {
+    return false;
+  }
+  t = hit_t;
+  u = hit_u;
+  v = hit_v;
+  return true;
+}
+
+// A mesh of triangles that share their corners: vertex positions, normals and
+// texture coordinates are each stored once, in a pool, and a triangle is the
+// indices of its corners in them. The whole mesh is a single hittable with
+// one material, and a BVH8 of its own, like sphere_set, which goes into any
+// list or accelerator as one object.
+//
+// build() also keeps every triangle's first vertex and two edges in single
+// precision, as a structure of arrays in leaf order, so that a leaf's 8
+// triangles are tested at once by one SIMD pass. Like the one of sphere_set,
+// the pass is only a conservative filter, and the triangles that pass it are
+// intersected again from the pool, in the precision of real.
+class triangle_mesh : public hittable {
+public:
+  static const uint32_t no_normal = std::numeric_limits<uint32_t>::max();
+  static const uint32_t no_texcoord = std::numeric_limits<uint32_t>::max();
+
+  // Indices into vertices, into normals or no_normal, and into texcoords or
+  // no_texcoord. A triangle without normals is flat, and faces where its
+  // corners turn counterclockwise. One without texture coordinates maps the
+  // texture's corners (0, 0), (1, 0) and (0, 1) to its own.
+  struct triangle {
+    uint32_t vertex[3];
+    uint32_t normal[3];
+    uint32_t texcoord[3];
+  };
+
+  struct texcoord {
+    real u;
+    real v;
+  };
+
+  triangle_mesh(
+    const ::material* material, color surface_color = color(1.0, 1.0, 1.0)
+  ) : material(material), surface_color(surface_color) {}
+
+  size_t size() const { return triangles.size(); }
+
+  // Builds the BVH8 over the triangles and reorders them in leaf order. Until
+  // it's called, intersect tests every triangle.
+  void build();
+
+  virtual bool
+    intersect(const ray& r, real t_min, real t_max, ray_hit& hit) const;
+
+  virtual void
+    finish_hit(const ray& r, const ray_hit& hit, hit_record& rec) const;
+
+  virtual bool bounding_box(aabb& output_box) const;
+
+  std::vector<point3> vertices;
+  std::vector<vec3> normals;
+  std::vector<texcoord> texcoords;
+  std::vector<triangle> triangles;
+
+  const ::material* material;
+  color surface_color;
+
+private:
+  bool intersect_range(
+    const ray& r, uint32_t first, uint32_t count, real t_min,
+    real& closest_so_far, ray_hit& hit
+  ) const;
+
+  bool intersect_one(
+    uint32_t i, const ray& r, real t_min, real t_max, ray_hit& hit
+  ) const;
+
+  // Single precision copies for the SIMD filter, padded by
+  // triangle_mesh_padding triangles whose first vertex is NaN.
+  std::vector<float> v0_x, v0_y, v0_z;
+  std::vector<float> e1_x, e1_y, e1_z;
+  std::vector<float> e2_x, e2_y, e2_z;
+
+  bvh8_tree tree;
+};
+
+const size_t triangle_mesh_padding = 8;
+
+// How far off the filter lets a float result be, relative to a bound on the
+// magnitude of what went into it. As in sphere_set, a false positive costs
+// one exact test, a false negative a hole in the mesh.
+const float triangle_mesh_tolerance = 1e-4f;
+
+void triangle_mesh::build() {
+  RT_TRACE_ZONE_ARGS("build triangle_mesh", "triangles", triangles.size(), nullptr, 0);
+  const size_t n = triangles.size();
+  std::vector<aabb> boxes(n);
+  for (size_t i = 0; i < n; ++i) {
+    const triangle& tri = triangles[i];
+    aabb box;
+    for (int c = 0; c < 3; ++c) {
+      const point3& v = vertices[tri.vertex[c]];
+      box.grow(aabb(v, v));
+    }
+    boxes[i] = box;
+  }
+  // Leaves of up to 8 triangles: one SIMD iteration each.
+  tree.build(boxes, 8, 8);
+
+  std::vector<triangle> old = triangles;
+  for (size_t i = 0; i < n; ++i) {
+    triangles[i] = old[tree.indices[i]];
+  }
+
+  const float nan = std::numeric_limits<float>::quiet_NaN();
+  for (auto* field : {&v0_x, &v0_y, &v0_z, &e1_x, &e1_y, &e1_z, &e2_x, &e2_y, &e2_z}) {
+    field->assign(n + triangle_mesh_padding, nan);
+  }
+  for (size_t i = 0; i < n; ++i) {
+    const point3& v0 = vertices[triangles[i].vertex[0]];
+    const vec3 e1 = vertices[triangles[i].vertex[1]] - v0;
+    const vec3 e2 = vertices[triangles[i].vertex[2]] - v0;
+    v0_x[i] = float(v0.x());
+    v0_y[i] = float(v0.y());
+    v0_z[i] = float(v0.z());
+    e1_x[i] = float(e1.x());
+    e1_y[i] = float(e1.y());
+    e1_z[i] = float(e1.z());
+    e2_x[i] = float(e2.x());
+    e2_y[i] = float(e2.y());
+    e2_z[i] = float(e2.z());
+  }
+}
+
+bool triangle_mesh::intersect(
+  const ray& r, real t_min, real t_max, ray_hit& hit
+) const {
+  if (tree.nodes.empty()) {
+    bool hit_anything = false;
+    for (uint32_t i = 0; i < triangles.size(); ++i) {
+      RT_STAT(++thread_stats().primitive_tests);
+      if (intersect_one(i, r, t_min, t_max, hit)) {
+        hit_anything = true;
+        t_max = hit.t;
+      }
+    }
+    return hit_anything;
+  }
+
+  return tree.traverse(r, t_min, t_max,
+    [&](uint32_t first, uint32_t count, real& closest_so_far) {
+      return intersect_range(r, first, count, t_min, closest_so_far, hit);
+    }
+  );
+}
+
+bool triangle_mesh::intersect_range(
+  const ray& r, uint32_t first, uint32_t count, real t_min,
+  real& closest_so_far, ray_hit& hit
+) const {
+  RT_STAT(thread_stats().primitive_tests += count);
+  bool hit_anything = false;
+
+#if defined(__AVX2__) && defined(__FMA__)
+  // Moller-Trumbore without the division: u, v and t all come out scaled by
+  // det, so they're compared with det times their bounds, after flipping
+  // their signs if det is negative.
+  //
+  // The error of a float result is bounded by the tolerance times the product
+  // of the L1 norms of the vectors it's made of: the direction (D), the edges
+  // (E1, E2) and the vector from v0 to the origin (T), which is itself off
+  // by up to the tolerance times the norms of the origin (O) and v0, at most
+  // 2 O + T. A nearly parallel triangle, whose det is within its error of 0,
+  // is always let through.
+  const float ox = float(r.origin().x());
+  const float oy = float(r.origin().y());
+  const float oz = float(r.origin().z());
+  const float dx = float(r.direction().x());
+  const float dy = float(r.direction().y());
+  const float dz = float(r.direction().z());
+  const float rel = triangle_mesh_tolerance;
+  const float o_norm = std::fabs(ox) + std::fabs(oy) + std::fabs(oz);
+  const float d_norm = std::fabs(dx) + std::fabs(dy) + std::fabs(dz);
+
+  const __m256 v_ox = _mm256_set1_ps(ox), v_oy = _mm256_set1_ps(oy), v_oz = _mm256_set1_ps(oz);
+  const __m256 v_dx = _mm256_set1_ps(dx), v_dy = _mm256_set1_ps(dy), v_dz = _mm256_set1_ps(dz);
+  const __m256 v_rel = _mm256_set1_ps(rel);
+  const __m256 v_rel_d = _mm256_set1_ps(rel * d_norm);
+  const __m256 v_origin_slack = _mm256_set1_ps(2 * rel * o_norm);
+  const __m256 v_one_rel = _mm256_set1_ps(1 + rel);
+  const __m256 v_t_min = _mm256_set1_ps(float(t_min));
+  const __m256 v_abs_t_min = _mm256_set1_ps(std::fabs(float(t_min)));
+  const __m256 v_sign = _mm256_set1_ps(-0.0f);
+  auto abs = [&](__m256 x) { return _mm256_andnot_ps(v_sign, x); };
+  auto norm = [&](__m256 x, __m256 y, __m256 z) {
+    return _mm256_add_ps(abs(x), _mm256_add_ps(abs(y), abs(z)));
+  };
+
+  for (uint32_t base = first; base < first + count; base += 8) {
+    const __m256 e1x = _mm256_loadu_ps(&e1_x[base]);
+    const __m256 e1y = _mm256_loadu_ps(&e1_y[base]);
+    const __m256 e1z = _mm256_loadu_ps(&e1_z[base]);
+    const __m256 e2x = _mm256_loadu_ps(&e2_x[base]);
+    const __m256 e2y = _mm256_loadu_ps(&e2_y[base]);
+    const __m256 e2z = _mm256_loadu_ps(&e2_z[base]);
+    const __m256 tx = _mm256_sub_ps(v_ox, _mm256_loadu_ps(&v0_x[base]));
+    const __m256 ty = _mm256_sub_ps(v_oy, _mm256_loadu_ps(&v0_y[base]));
+    const __m256 tz = _mm256_sub_ps(v_oz, _mm256_loadu_ps(&v0_z[base]));
+
+    // p = d x e2, q = t x e1.
+    const __m256 px = _mm256_fmsub_ps(v_dy, e2z, _mm256_mul_ps(v_dz, e2y));
+    const __m256 py = _mm256_fmsub_ps(v_dz, e2x, _mm256_mul_ps(v_dx, e2z));
+    const __m256 pz = _mm256_fmsub_ps(v_dx, e2y, _mm256_mul_ps(v_dy, e2x));
+    const __m256 qx = _mm256_fmsub_ps(ty, e1z, _mm256_mul_ps(tz, e1y));
+    const __m256 qy = _mm256_fmsub_ps(tz, e1x, _mm256_mul_ps(tx, e1z));
+    const __m256 qz = _mm256_fmsub_ps(tx, e1y, _mm256_mul_ps(ty, e1x));
+
+    const __m256 det = _mm256_fmadd_ps(e1z, pz, _mm256_fmadd_ps(e1y, py, _mm256_mul_ps(e1x, px)));
+    const __m256 sign = _mm256_and_ps(det, v_sign);
+    const __m256 abs_det = abs(det);
+    const __m256 u = _mm256_xor_ps(sign,
+      _mm256_fmadd_ps(tz, pz, _mm256_fmadd_ps(ty, py, _mm256_mul_ps(tx, px))));
+    const __m256 v = _mm256_xor_ps(sign,
+      _mm256_fmadd_ps(v_dz, qz, _mm256_fmadd_ps(v_dy, qy, _mm256_mul_ps(v_dx, qx))));
+    const __m256 t = _mm256_xor_ps(sign,
+      _mm256_fmadd_ps(e2z, qz, _mm256_fmadd_ps(e2y, qy, _mm256_mul_ps(e2x, qx))));
+
+    const __m256 e1_norm = norm(e1x, e1y, e1z);
+    const __m256 e2_norm = norm(e2x, e2y, e2z);
+    const __m256 t_norm = _mm256_fmadd_ps(
+      v_one_rel, norm(tx, ty, tz), v_origin_slack
+    );
+    const __m256 det_slack = _mm256_mul_ps(v_rel_d, _mm256_mul_ps(e1_norm, e2_norm));
+    const __m256 u_slack = _mm256_mul_ps(v_rel_d, _mm256_mul_ps(t_norm, e2_norm));
+    const __m256 v_slack = _mm256_mul_ps(v_rel_d, _mm256_mul_ps(t_norm, e1_norm));
+    const __m256 t_slack = _mm256_mul_ps(v_rel, _mm256_mul_ps(t_norm, _mm256_mul_ps(e1_norm, e2_norm)));
+
+    const __m256 v_t_max = _mm256_set1_ps(float(closest_so_far));
+    __m256 keep = _mm256_cmp_ps(u, _mm256_sub_ps(_mm256_setzero_ps(), u_slack), _CMP_GE_OQ);
+    keep = _mm256_and_ps(keep,
+      _mm256_cmp_ps(v, _mm256_sub_ps(_mm256_setzero_ps(), v_slack), _CMP_GE_OQ));
+    keep = _mm256_and_ps(keep, _mm256_cmp_ps(
+      _mm256_add_ps(u, v),
+      _mm256_add_ps(_mm256_add_ps(abs_det, det_slack), _mm256_add_ps(u_slack, v_slack)),
+      _CMP_LE_OQ
+    ));
+    keep = _mm256_and_ps(keep, _mm256_cmp_ps(
+      t, _mm256_fmsub_ps(v_t_min, abs_det, _mm256_fmadd_ps(v_abs_t_min, det_slack, t_slack)),
+      _CMP_GT_OQ
+    ));
+    keep = _mm256_and_ps(keep, _mm256_cmp_ps(
+      t, _mm256_fmadd_ps(v_t_max, _mm256_add_ps(abs_det, det_slack), t_slack),
+      _CMP_LT_OQ
+    ));
+    keep = _mm256_or_ps(keep, _mm256_cmp_ps(abs_det, det_slack, _CMP_LE_OQ));
+    unsigned mask = unsigned(_mm256_movemask_ps(keep));
+
+    uint32_t remaining = first + count - base;
+    if (remaining < 8) {
+      mask &= (1u << remaining) - 1;
+    }
+    while (mask) {
+      uint32_t i = base + __builtin_ctz(mask);
+      mask &= mask - 1;
+      if (intersect_one(i, r, t_min, closest_so_far, hit)) {
+        hit_anything = true;
+        closest_so_far = hit.t;
+      }
+    }
+  }
+#else
+  for (uint32_t i = first; i < first + count; ++i) {
+    if (intersect_one(i, r, t_min, closest_so_far, hit)) {
+      hit_anything = true;
+      closest_so_far = hit.t;
+    }
+  }
+#endif
+
+  return hit_anything;
+}
+
+bool triangle_mesh::intersect_one(
+  uint32_t i, const ray& r, real t_min, real t_max, ray_hit& hit
+) const {
+  const triangle& tri = triangles[i];
+  const point3& v0 = vertices[tri.vertex[0]];
+  const point3& v1 = vertices[tri.vertex[1]];
+  const point3& v2 = vertices[tri.vertex[2]];
+  real t, u, v;
+  if (!intersect_triangle(v0, v1, v2, r, t_min, t_max, t, u, v)) {
+    return false;
+  }
+  bool exterior = dot(r.direction(), cross(v1 - v0, v2 - v0)) < 0;
+  hit = {this, t, i, exterior};
+  return true;
+}
+
+void triangle_mesh::finish_hit(
+  const ray& r, const ray_hit& hit, hit_record& rec
+) const {
+  const triangle& tri = triangles[hit.primitive];
+  const point3& v0 = vertices[tri.vertex[0]];
+  const point3& v1 = vertices[tri.vertex[1]];
+  const point3& v2 = vertices[tri.vertex[2]];
+  const vec3 e1 = v1 - v0;
+  const vec3 e2 = v2 - v0;
+
+  // The barycentric coordinates of the hit, as intersect_triangle found
+  // them, but without rejecting anything: the hit is known to be there.
+  const vec3 p = cross(r.direction(), e2);
+  const real inv_det = 1 / dot(e1, p);
+  const vec3 tv = r.origin() - v0;
+  const vec3 q = cross(tv, e1);
+  const real u = clamp(dot(tv, p) * inv_det, 0.0, 1.0);
+  const real v = clamp(dot(r.direction(), q) * inv_det, 0.0, 1.0 - u);
+  const real w = 1 - u - v;
+
+  // Interpolating the corners puts the point on the triangle, off by a few
+  // roundings of the weighted corners, unlike r.at(t).
+  rec.t = hit.t;
+  rec.p = w * v0 + u * v1 + v * v2;
+  rec.p_error = rounding_gamma(7) * (abs(w * v0) + abs(u * v1) + abs(v * v2));
+
+  // Which face was hit is the geometric normal's business; the shading
+  // normal is interpolated from the corners, turned to that same face.
+  rec.set_face_normal(r, unit_vector(cross(e1, e2)));
+  if (tri.normal[0] != no_normal) {
+    vec3 shading = unit_vector(
+      w * normals[tri.normal[0]] + u * normals[tri.normal[1]]
+        + v * normals[tri.normal[2]]
+    );
+    rec.normal = dot(shading, rec.normal) < 0 ? -shading : shading;
+  }
+  rec.color = surface_color;
+  rec.material = material;
+  if (material && material->needs_uv) {
+    texcoord c[3] = {{0, 0}, {1, 0}, {0, 1}};
+    if (tri.texcoord[0] != no_texcoord) {
+      for (int k = 0; k < 3; ++k) {
+        c[k] = texcoords[tri.texcoord[k]];
+      }
+    }
+    rec.u = w * c[0].u + u * c[1].u + v * c[2].u;
+    rec.v = w * c[0].v + u * c[1].v + v * c[2].v;
+    // The square root of the ratio of the triangle's area in the texture to
+    // its area in the world.
+    const real uv_area = std::fabs(
+      (c[1].u - c[0].u) * (c[2].v - c[0].v) - (c[2].u - c[0].u) * (c[1].v - c[0].v)
+    );
+    const real area = cross(e1, e2).length();
+    rec.uv_scale = area > 0 ? std::sqrt(uv_area / area) : 0;
+  }
+}
+
+bool triangle_mesh::bounding_box(aabb& output_box) const {
+  if (triangles.empty()) {
+    return false;
+  }
+  if (!tree.nodes.empty()) {
+    output_box = tree.bounds;
+    return true;
+  }
+  output_box = aabb();
+  for (const triangle& tri : triangles) {
+    for (int c = 0; c < 3; ++c) {
+      const point3& v = vertices[tri.vertex[c]];
+      output_box.grow(aabb(v, v));
+    }
+  }
+  return true;
+}
+
+#endif
@@ -0,0 +1,249 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include "common.h"
+
+#include "camera.h"
+#include "hittable.h"
+#include "material.h"
+#include "path_tracer.h"
+#include "ray_cone.h"
+#include "ray_packet.h"
+#include "renderer.h"
+#include "sampler.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+// A path tracer that advances many paths a bounce at a time instead of
+// following one path to its end before starting the next, like path_tracer
+// does. Every bounce:
+//
+//   1. intersects all the live paths with the world,
+//   2. finishes the ones that missed, and puts the others in a queue per
+//      material class,
+//   3. runs every class's scatter over its queue in a loop of its own, so
+//      the branch predictor and the instruction cache see one material at a
+//      time, and the call isn't virtual,
+//
+// and the paths that scattered go on to the next bounce. A tile's samples
+// are all in flight at once, up to max_paths of them.
+//
+// Every path keeps the sampler of its pixel sample and scatters with it, so
+// it draws the same numbers, and ends in the same Russian roulette, as it
+// would in path_tracer: the images are the same.
+template <typename Background>
+class wavefront_integrator {
+public:
+  // background(r) is the color carried by a ray that hits nothing.
+  wavefront_integrator(
+    const camera& cam, const hittable& world, const Background& background
+  ) : cam(cam), world(world), background(background) {}
+
+  // Renders with the tiles and samples of r's settings.
+  framebuffer render(renderer& r) {
+    rays_traced = 0;
+    return r.render_tiles([&](const tile& t, color* accumulated) {
+      sample_tile(r.settings, t, accumulated);
+    });
+  }
+
+  const camera& cam;
+  const hittable& world;
+  const Background background;
+  // As in path_tracer.
+  int max_depth = 50;
+  int roulette_depth = 3;
+  real cone_spread = 0;
+  size_t max_paths = size_t(1) << 16;
+
+  // Rays intersected with the world by the last render, camera rays
+  // included.
+  std::atomic<size_t> rays_traced{0};
+
+private:
+  struct path {
+    ray r;
+    color throughput;
+    sampler samples;
+    ray_cone cone;
+    int depth;
+  };
+
+  // The buffers of one wavefront. They live as long as the thread, so that
+  // tiles after the first don't allocate.
+  struct wavefront {
+    std::vector<path> paths;
+    std::vector<hit_record> hits;
+    // The color every path ended with, by sample, to be added up in sample
+    // order like render does.
+    std::vector<color> results;
+    std::vector<uint32_t> live;
+    std::vector<uint32_t> queues[material_type_count];
+  };
+
+  void sample_tile(
+    const render_settings& settings, const tile& t, color* accumulated
+  );
+
+  void trace_camera_rays(
+    const render_settings& settings, wavefront& w, int i, int j
+  );
+
+  template <typename Material>
+  void scatter_queue(wavefront& w, const std::vector<uint32_t>& queue);
+};
+
+template <typename Background>
+void wavefront_integrator<Background>::sample_tile(
+  const render_settings& settings, const tile& t, color* accumulated
+) {
+  thread_local wavefront w;
+  const size_t spp = size_t(settings.samples_per_pixel);
+  // Whole pixels per wavefront, at least one.
+  const size_t pixels_per_wave = std::max<size_t>(1, max_paths / spp);
+  const int tile_width = t.x1 - t.x0;
+  const size_t pixel_count = size_t(tile_width) * (t.y1 - t.y0);
+  size_t rays = 0;
+
+  for (size_t first = 0; first < pixel_count; first += pixels_per_wave) {
+    const size_t last = std::min(pixel_count, first + pixels_per_wave);
+
+    w.paths.clear();
+    w.hits.resize((last - first) * spp);
+    w.results.assign((last - first) * spp, color(0.0, 0.0, 0.0));
+    w.live.clear();
+    for (size_t n = first; n < last; ++n) {
+      trace_camera_rays(
+        settings, w, t.x0 + int(n % tile_width), t.y0 + int(n / tile_width)
+      );
+    }
+
+    while (!w.live.empty()) {
+      rays += w.live.size();
+      for (auto& queue : w.queues) {
+        queue.clear();
+      }
+      for (uint32_t p : w.live) {
+        const hit_record& rec = w.hits[p];
+        if (w.paths[p].depth < 0) {
+          // Missed.
+          w.results[p] = w.paths[p].throughput * background(w.paths[p].r);
+        } else if (w.paths[p].depth < max_depth) {
+          w.queues[int(rec.material->type)].push_back(p);
+        } else {
+          RT_STAT(thread_stats().end_path(path_end::max_depth, w.paths[p].depth));
+        }
+      }
+
+      w.live.clear();
+      scatter_queue<material>(w, w.queues[int(material_type::other)]);
+      scatter_queue<lambertian>(w, w.queues[int(material_type::lambertian)]);
+      scatter_queue<metal>(w, w.queues[int(material_type::metal)]);
+      scatter_queue<fuzzy>(w, w.queues[int(material_type::fuzzy)]);
+      scatter_queue<dielectric>(w, w.queues[int(material_type::dielectric)]);
+
+      RT_STAT(thread_stats().bounce_rays += w.live.size());
+      for (uint32_t p : w.live) {
+        if (!world.hit(w.paths[p].r, 0, infinity, w.hits[p])) {
+          RT_STAT(thread_stats().end_path(path_end::escaped, w.paths[p].depth));
+          w.paths[p].depth = -1;
+        }
+      }
+    }
+
+    for (size_t n = first; n < last; ++n) {
+      color pixel_color(0.0, 0.0, 0.0);
+      for (size_t s = 0; s < spp; ++s) {
+        pixel_color += w.results[(n - first) * spp + s];
+      }
+      accumulated[n] = pixel_color;
+    }
+  }
+
+  rays_traced.fetch_add(rays, std::memory_order_relaxed);
+}
+
+// The first bounce of every sample of pixel (i, j), with the same random
+// numbers and packets as renderer::render(cam, world, shade).
+template <typename Background>
+void wavefront_integrator<Background>::trace_camera_rays(
+  const render_settings& settings, wavefront& w, int i, int j
+) {
+  for (int s0 = 0; s0 < settings.samples_per_pixel; s0 += ray_packet_size) {
+    const int count = std::min(ray_packet_size, settings.samples_per_pixel - s0);
+
+    double u[ray_packet_size], v[ray_packet_size];
+    vec3 lens[ray_packet_size];
+    const uint32_t first = uint32_t(w.paths.size());
+    for (int k = 0; k < count; ++k) {
+      sampler samples(
+        settings.sequence, settings.seed, i, j, settings.image_width, s0 + k
+      );
+      double film_u, film_v;
+      samples.get_2d(film_u, film_v);
+      u[k] = (double(i) + film_u) / (settings.image_width - 1);
+      v[k] = (double(j) + film_v) / (settings.image_height - 1);
+      lens[k] = cam.sample_lens(samples);
+      w.paths.push_back(
+        {ray(), color(1.0, 1.0, 1.0), samples, {0, cone_spread}, 0}
+      );
+    }
+
+    ray_packet packet;
+    cam.get_rays(count, u, v, lens, packet);
+    RT_STAT(thread_stats().camera_rays += count);
+    unsigned hits = world.hit_packet(
+      packet, settings.ray_t_min, infinity, &w.hits[first]
+    );
+    for (int k = 0; k < count; ++k) {
+      path& p = w.paths[first + k];
+      p.r = packet.get(k);
+      if (!((hits >> k) & 1)) {
+        RT_STAT(thread_stats().end_path(path_end::escaped, 0));
+        p.depth = -1;
+      }
+      w.live.push_back(first + k);
+    }
+  }
+}
+
+// Scatters the paths of one queue, all of whose materials are Material.
+// Material classes are final, so the call isn't virtual, except for the
+// queue of "other" materials, whose Material is the base class. Paths that
+// scatter and survive the roulette go on w.live.
+template <typename Background>
+template <typename Material>
+void wavefront_integrator<Background>::scatter_queue(
+  wavefront& w, const std::vector<uint32_t>& queue
+) {
+  for (uint32_t index : queue) {
+    path& p = w.paths[index];
+    hit_record& rec = w.hits[index];
+    const Material& m = static_cast<const Material&>(*rec.material);
+    p.cone.reach(p.r, rec);
+
+    color attenuation;
+    ray scattered;
+    p.samples.start_bounce(p.depth);
+    RT_STAT(++thread_stats().scatters[int(m.type)]);
+    if (!m.scatter(p.r, rec, attenuation, scattered, p.samples)) {
+      RT_STAT(thread_stats().end_path(path_end::absorbed, p.depth));
+      continue;
+    }
+    p.throughput = p.throughput * attenuation;
+    if (!survives_roulette(
+      p.throughput, p.depth + 1, roulette_depth, p.samples
+    )) {
+      RT_STAT(thread_stats().end_path(path_end::roulette, p.depth + 1));
+      continue;
+    }
+    p.r = scattered;
+    ++p.depth;
+    w.live.push_back(index);
+  }
+}
+
+#endif